@@ -9,71 +9,179 @@
 //
 
 #include <sstream>
+#include <algorithm>
+#include <map>
+#include <list>
+#include <string.h>
+#include <stdlib.h>
 //#include <fstream>
 //#include <math.h>
 
 #include "gfx.h"
 
 //
-// Color arithmetic tables
-// Used for component based saturation arithmetic.
+// SIMD
+// Instruction sets used by the span kernels are selected at
+// compile time. Every kernel has a scalar fallback.
+//
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define GFX_AVX2
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GFX_SSE2
+#endif
+#if defined(__SSSE3__) || defined(GFX_AVX2)
+#include <tmmintrin.h>
+#define GFX_SSSE3
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define GFX_NEON
+#endif
+
+//
+// File mapping
+// Used by Image::Stream. Other platforms always take the
+// unmapped fallback.
+//
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define GFX_MMAP_WIN32
+#elif defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#define GFX_MMAP_POSIX
+#endif
+
+// per-thread storage for the pool index of a worker
+#if defined(_MSC_VER)
+#define GFX_THREAD_LOCAL __declspec(thread)
+#else
+#define GFX_THREAD_LOCAL __thread
+#endif
+
+// bit offset of the alpha channel within Color32::value
+#ifdef __MACOSX__
+#define GFX_ALPHA_SHIFT 0
+#else
+#define GFX_ALPHA_SHIFT 24
+#endif
+
+//
+// Color conversion table
 //
-static Uint8 tableAdd[UCHAR_MAX+1][UCHAR_MAX+1];
-static Uint8 tableSub[UCHAR_MAX+1][UCHAR_MAX+1];
-static Uint8 tableMul[UCHAR_MAX+1][UCHAR_MAX+1];
 float u8chan_to_fchan[UCHAR_MAX+1];
 
+//
+// Worker pool state
+// Protected by poolLock.
+//
+static SDL_Thread *poolThread[GfxMaxThreads];
+static GFX_THREAD_LOCAL Sint32 poolIndex = 0; // set by each worker, 0 on other threads
+static Sint32 poolCount = 0;
+static SDL_mutex *poolLock = (SDL_mutex*)0;
+static SDL_cond *poolWake = (SDL_cond*)0;
+static SDL_cond *poolDone = (SDL_cond*)0;
+static GfxParallelFunc poolFunc = (GfxParallelFunc)0;
+static void *poolData = (void*)0;
+static Sint32 poolNext = 0, poolEnd = 0, poolBand = 1, poolPending = 0;
+static bool poolBusy = false, poolQuit = false;
+
+//
+// Background task state
+// Tasks (see ImageLoader) wait in taskQueue until a worker
+// has no band to draw. Also protected by poolLock; taskDone
+// is signalled whenever a task finishes.
+//
+struct PoolTask
+{
+	void (*func)(void *pData);
+	void (*drop)(void *pData); // frees data of a task that never ran, may be 0
+	void *data;
+	Sint32 priority;
+	Uint32 order;
+};
+static std::vector<PoolTask> taskQueue;
+static Sint32 taskRunning = 0;
+static Uint32 taskOrder = 0;
+static SDL_cond *taskDone = (SDL_cond*)0;
+
+//
+// Pixel storage state
+// storeCache holds released buffers, protected by storeLock,
+// which exists while Gfx is initialized. Without it buffers
+// go straight to the allocator.
+//
+struct StoreEntry { void *memory; size_t bytes; };
+static const Sint32 StoreEntries = 32;
+static StoreEntry storeCache[StoreEntries];
+static Sint32 storeCount = 0;
+static size_t storeBytes = 0, storeLimit = 64 << 20;
+static SDL_mutex *storeLock = (SDL_mutex*)0;
+
+//
+// Stream cache state
+// Decoded stream tiles, keyed by file id and tile position,
+// with cacheLru most recently used first. Everything is
+// protected by cacheLock, which exists while Gfx is
+// initialized. cacheFiles gives every streamed file an id,
+// which changes when the file is refreshed or saved.
+//
+struct CacheTile
+{
+	Uint64 key;
+	Color32 *pixels;
+	size_t bytes;
+	Sint32 pins; // Blits reading the tile
+	std::list<CacheTile*>::iterator lru;
+};
+static std::map<Uint64, CacheTile*> cacheTiles;
+static std::list<CacheTile*> cacheLru;
+struct CacheFile
+{
+	Sint32 id, streams; // streams associated to the file
+	CacheFile( void ) : id(0), streams(0) {}
+};
+static std::map<std::string, CacheFile> cacheFiles;
+static Sint32 cacheNextId = 0;
+static size_t cacheBytes = 0, cacheBudget = 32 << 20;
+static GfxStreamStats cacheStats = { 0, 0, 0, 0, 0 };
+static SDL_mutex *cacheLock = (SDL_mutex*)0;
+
 //
 // GfxInit
 // Initializes the Gfx component, such as
-// color arithmetic tables.
+// color conversion tables.
 //
-bool GfxInit(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen, Uint32 SDL_INIT_FLAGS)
+bool GfxInit(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen, Uint32 SDL_INIT_FLAGS, Uint32 pThreads)
 {
 	if (SDL_Init(SDL_INIT_FLAGS) == -1) {
 		return false;
 	}
+	if (storeLock == (SDL_mutex*)0) {
+		storeLock = SDL_CreateMutex();
+	}
+	if (cacheLock == (SDL_mutex*)0) {
+		cacheLock = SDL_CreateMutex();
+	}
 	
 	if (sizeof(Sint32) == sizeof(Color32) && sizeof(Color32) == 4) {
-		// initializes addition table
-		for (Sint32 i = 0; i <= UCHAR_MAX; ++i){
-			Sint32 j = 0;
-			for (Sint32 n = i; n <= UCHAR_MAX; ++j, ++n){
-				tableAdd[i][j] = (Uint8)n;
-			}
-			for (; j <= UCHAR_MAX; ++j){
-				tableAdd[i][j] = UCHAR_MAX;
-			}
-		}
-
-		// initializes subtration table
-		for (Sint32 i = 0; i <= UCHAR_MAX; ++i){
-			Sint32 j = 0;
-			for (Sint32 n = i; n >= 0; ++j, --n){
-				tableSub[i][j] = (Uint8)n;
-			}
-			for (; j <= UCHAR_MAX; ++j){
-				tableSub[i][j] = 0;
-			}
-		}
-		
-		// initializes multiplication table
 		const float fBYTE_MAX = (float)UCHAR_MAX;
-		for (float i = 0; i <= fBYTE_MAX; ++i){
-			for (float j = 0; j <= fBYTE_MAX; ++j){
-				tableMul[(Sint32)i][(Sint32)j] = (Uint8)(i *(j/fBYTE_MAX));
-			}
-		}
-		
 		// initializes Uint8 to float table
 		for (Sint32 i = 0; i < UCHAR_MAX+1; ++i){
-			u8chan_to_fchan[i] = fBYTE_MAX/(float)i;
+			u8chan_to_fchan[i] = (float)i/fBYTE_MAX;
 		}
 	} else {
 		SDL_SetError("Gfx cannot be used (platform error)");
 		return false;
 	}
-	return GfxSetVideo(pScreenW, pScreenH, pFullscreen);
+	return GfxSetThreads(pThreads) && ((SDL_INIT_FLAGS & SDL_INIT_VIDEO) == 0 || GfxSetVideo(pScreenW, pScreenH, pFullscreen));
 }
 
 //
@@ -81,592 +189,5153 @@ bool GfxInit(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen, Uint32 SDL_INIT
 // Destroys the screen surface and calls SDL_Quit in the
 // correct order to prevent crash.
 //
+static void ResolveFree( void );
+static void PoolRowsFree( void );
+
 void GfxQuit( void )
 {
+	GfxSetThreads(0);
+	ResolveFree();
+	PoolRowsFree();
+	GfxTrimStreamCache();
+	if (cacheLock != (SDL_mutex*)0) {
+		SDL_DestroyMutex(cacheLock);
+		cacheLock = (SDL_mutex*)0;
+	}
+	GfxTrimStorage();
+	if (storeLock != (SDL_mutex*)0) {
+		SDL_DestroyMutex(storeLock);
+		storeLock = (SDL_mutex*)0;
+	}
+	if (poolLock != (SDL_mutex*)0) {
+		SDL_DestroyCond(poolWake);
+		SDL_DestroyCond(poolDone);
+		SDL_DestroyCond(taskDone);
+		SDL_DestroyMutex(poolLock);
+		poolWake = poolDone = taskDone = (SDL_cond*)0;
+		poolLock = (SDL_mutex*)0;
+	}
+	for (size_t i = 0; i < taskQueue.size(); ++i){
+		if (taskQueue[i].drop != (void (*)(void*))0) { taskQueue[i].drop(taskQueue[i].data); }
+	}
+	taskQueue.clear();
 	SDL_FreeSurface(SDL_GetVideoSurface());
 	SDL_Quit();
 }
 
 //
-// Color32
+// Pixel storage
 //
 
 //
-// Color32 (ctor)
+// DefaultAlloc
+// Over-allocates and keeps the block start in front of the
+// aligned address.
 //
-Color32::Color32( void ) : value(0) {}
-Color32::Color32(const Color32 &pColor) : value(pColor.value) {}
-Color32::Color32(const Color32 &pColor, Uint8 pAlpha) : value(pColor.value) { channels.alpha = pAlpha; }
-Color32::Color32(Uint32 pColor) : value(pColor) {}
-Color32::Color32(Uint8 pR, Uint8 pG, Uint8 pB, Uint8 pA)
+static void *DefaultAlloc(size_t pBytes)
 {
-	channels.red = pR;
-	channels.green = pG;
-	channels.blue = pB;
-	channels.alpha = pA;
+	void *block = malloc(pBytes + GfxAlignment + sizeof(void*));
+	if (block == (void*)0) { return (void*)0; }
+	const size_t ALIGNED = ((size_t)block + sizeof(void*) + GfxAlignment - 1) & ~(size_t)(GfxAlignment - 1);
+	((void**)ALIGNED)[-1] = block;
+	return (void*)ALIGNED;
 }
 
-//
-// Color arithmetic operators
-//
-Color32 &operator +=(Color32 &pLeft, const Color32 &pRight)
-{
-	pLeft.channels.red = tableAdd[pLeft.channels.red][pRight.channels.red];
-	pLeft.channels.green = tableAdd[pLeft.channels.green][pRight.channels.green];
-	pLeft.channels.blue = tableAdd[pLeft.channels.blue][pRight.channels.blue];
-	pLeft.channels.alpha = tableAdd[pLeft.channels.alpha][pRight.channels.alpha];
-	return pLeft;
-}
-Color32 &operator -=(Color32 &pLeft, const Color32 &pRight)
-{
-	pLeft.channels.red = tableSub[pLeft.channels.red][pRight.channels.red];
-	pLeft.channels.green = tableSub[pLeft.channels.green][pRight.channels.green];
-	pLeft.channels.blue = tableSub[pLeft.channels.blue][pRight.channels.blue];
-	pLeft.channels.alpha = tableSub[pLeft.channels.alpha][pRight.channels.alpha];
-	return pLeft;
-}
-Color32 &operator *=(Color32 &pLeft, const Color32 &pRight)
+static void DefaultFree(void *pMemory, size_t)
 {
-	pLeft.channels.red = tableMul[pLeft.channels.red][pRight.channels.red];
-	pLeft.channels.green = tableMul[pLeft.channels.green][pRight.channels.green];
-	pLeft.channels.blue = tableMul[pLeft.channels.blue][pRight.channels.blue];
-	pLeft.channels.alpha = tableMul[pLeft.channels.alpha][pRight.channels.alpha];
-	return pLeft;
+	if (pMemory != (void*)0) { free(((void**)pMemory)[-1]); }
 }
-Color32 &operator >>=(Color32 &pLeft, Sint32 pRight)
+
+static GfxAllocFunc storeAlloc = DefaultAlloc;
+static GfxFreeFunc storeFree = DefaultFree;
+
+//
+// GfxAllocate
+// Returns a cached buffer of exactly pBytes if there is one,
+// otherwise allocates one. Returns 0 when out of memory.
+//
+void *GfxAllocate(size_t pBytes)
 {
-	pLeft.channels.red >>= pRight;
-	pLeft.channels.green >>= pRight;
-	pLeft.channels.blue >>= pRight;
-	pLeft.channels.alpha >>= pRight;
-	return pLeft;
+	if (storeLock != (SDL_mutex*)0) {
+		SDL_mutexP(storeLock);
+		for (Sint32 i = storeCount - 1; i >= 0; --i){ // most recently released first, it is the most likely to be in cache
+			if (storeCache[i].bytes == pBytes) {
+				void *memory = storeCache[i].memory;
+				storeBytes -= pBytes;
+				storeCache[i] = storeCache[--storeCount];
+				SDL_mutexV(storeLock);
+				return memory;
+			}
+		}
+		SDL_mutexV(storeLock);
+	}
+	return storeAlloc(pBytes);
 }
-Color32 &operator <<=(Color32 &pLeft, Sint32 pRight)
+
+//
+// GfxRelease
+// Caches a buffer from GfxAllocate, evicting the oldest
+// buffers when the cache is full.
+//
+void GfxRelease(void *pMemory, size_t pBytes)
 {
-	pLeft.channels.red <<= pRight;
-	pLeft.channels.green <<= pRight;
-	pLeft.channels.blue <<= pRight;
-	pLeft.channels.alpha <<= pRight;
-	return pLeft;
+	if (pMemory == (void*)0) { return; }
+	if (storeLock == (SDL_mutex*)0 || pBytes > storeLimit) {
+		storeFree(pMemory, pBytes);
+		return;
+	}
+	SDL_mutexP(storeLock);
+	while (storeCount > 0 && (storeCount == StoreEntries || storeBytes + pBytes > storeLimit)) {
+		storeFree(storeCache[0].memory, storeCache[0].bytes);
+		storeBytes -= storeCache[0].bytes;
+		--storeCount;
+		memmove(storeCache, storeCache + 1, storeCount*sizeof(StoreEntry));
+	}
+	storeCache[storeCount].memory = pMemory;
+	storeCache[storeCount].bytes = pBytes;
+	++storeCount;
+	storeBytes += pBytes;
+	SDL_mutexV(storeLock);
 }
-bool operator ==(Color32 pLeft, Color32 pRight) // does not test alpha
+
+//
+// GfxTrimStorage
+// Frees every cached buffer.
+//
+void GfxTrimStorage( void )
 {
-	return (
-		pLeft.channels.red == pRight.channels.red &&
-		pLeft.channels.green == pRight.channels.green &&
-		pLeft.channels.blue == pRight.channels.blue
-		);
+	if (storeLock != (SDL_mutex*)0) { SDL_mutexP(storeLock); }
+	for (Sint32 i = 0; i < storeCount; ++i){
+		storeFree(storeCache[i].memory, storeCache[i].bytes);
+	}
+	storeCount = 0;
+	storeBytes = 0;
+	if (storeLock != (SDL_mutex*)0) { SDL_mutexV(storeLock); }
 }
-bool operator !=(const Color32 &pLeft, const Color32 &pRight)
+
+//
+// GfxSetStorageLimit
+// Sets how many bytes of released buffers are kept (0
+// disables the cache).
+//
+void GfxSetStorageLimit(size_t pBytes)
 {
-	return !(pLeft == pRight);
+	storeLimit = pBytes;
+	GfxTrimStorage();
 }
-Color32 operator+(Color32 pLeft, const Color32 &pRight) { return (pLeft += pRight); }
-Color32 operator-(Color32 pLeft, const Color32 &pRight) { return (pLeft -= pRight); }
-Color32 operator*(Color32 pLeft, const Color32 &pRight) { return (pLeft *= pRight); }
-Color32 operator>>(Color32 pLeft, Sint32 pRight) { return (pLeft >>= pRight); }
-Color32 operator<<(Color32 pLeft, Sint32 pRight) { return (pLeft <<= pRight); }
 
 //
-// Nearest
+// GfxSetAllocator
+// Cached buffers and stream tiles belong to the old
+// allocator, so they are freed first.
 //
+void GfxSetAllocator(GfxAllocFunc pAlloc, GfxFreeFunc pFree)
+{
+	GfxTrimStreamCache();
+	GfxTrimStorage();
+	storeAlloc = (pAlloc != (GfxAllocFunc)0 && pFree != (GfxFreeFunc)0) ? pAlloc : DefaultAlloc;
+	storeFree = (pAlloc != (GfxAllocFunc)0 && pFree != (GfxFreeFunc)0) ? pFree : DefaultFree;
+}
 
 //
-// operator()
-// Samples the nearest color. Looks pixelated
-// when stretched out, and looks aliased when
-// compressed to a smaller size than normal.
+// Worker pool
 //
-Color32 Nearest::operator()(const Image &pImage, float pU, float pV) const {
-	return pImage[(Sint32)((pImage.GetHeight()-1)*pV)][(Sint32)((pImage.GetWidth()-1)*pU)];
-}
 
 //
-// Bilinear
+// PoolTake
+// Hands out the next band of the current job. Caller must
+// hold poolLock.
 //
+static bool PoolTake(Sint32 &pBegin, Sint32 &pEnd)
+{
+	if (poolNext >= poolEnd) { return false; }
+	pBegin = poolNext;
+	poolNext = (poolEnd - poolNext) > poolBand ? poolNext + poolBand : poolEnd;
+	pEnd = poolNext;
+	return true;
+}
 
 //
-// operator()
-// Samples the four closest colors and
-// interpolates between the colors to get the
-// most accurate color.
+// PoolTakeTask
+// Removes the highest priority task from the queue, unless
+// half of the workers are running tasks already. Caller must
+// hold poolLock.
 //
-Color32 Bilinear::operator()(const Image &pImage, float pU, float pV) const {	
-	float fU = pU * (pImage.GetWidth() - 2);
-	float fV = pV * (pImage.GetHeight() - 2);
-	Sint32 iU = (Sint32)fU;
-	Sint32 iV = (Sint32)fV;
-	
-	float u_ratio = fU - iU;
-	float v_ratio = fV - iV;
-	float u_opposite = 1.f - u_ratio;
-	float v_opposite = 1.f - v_ratio;
-	
-	Color32 c00 = pImage[iV][iU];
-	Color32 c01 = pImage[iV+1][iU];
-	Color32 c10 = pImage[iV][iU+1];
-	Color32 c11 = pImage[iV+1][iU+1];
-	
-	Color32 final(
-		(Uint8)((c00.channels.red * u_opposite + c10.channels.red * u_ratio) * v_opposite + (c01.channels.red * u_opposite + c11.channels.red * u_ratio) * v_ratio),
-		(Uint8)((c00.channels.green * u_opposite + c10.channels.green * u_ratio) * v_opposite + (c01.channels.green * u_opposite + c11.channels.green * u_ratio) * v_ratio),
-		(Uint8)((c00.channels.blue * u_opposite + c10.channels.blue * u_ratio) * v_opposite + (c01.channels.blue * u_opposite + c11.channels.blue * u_ratio) * v_ratio),
-		(Uint8)((c00.channels.alpha * u_opposite + c10.channels.alpha * u_ratio) * v_opposite + (c01.channels.alpha * u_opposite + c11.channels.alpha * u_ratio) * v_ratio)
-	);
-	
-	return final;
+static bool PoolTakeTask(PoolTask &pTask)
+{
+	if (taskQueue.empty() || taskRunning >= (poolCount + 1) / 2) { return false; }
+	size_t best = 0;
+	for (size_t i = 1; i < taskQueue.size(); ++i){
+		if (taskQueue[i].priority > taskQueue[best].priority || (taskQueue[i].priority == taskQueue[best].priority && taskQueue[i].order < taskQueue[best].order)) {
+			best = i;
+		}
+	}
+	pTask = taskQueue[best];
+	taskQueue.erase(taskQueue.begin() + best);
+	++taskRunning;
+	return true;
 }
 
 //
-// Image
+// PoolWorker
+// Main loop of a worker thread. Bands of parallel jobs come
+// before background tasks.
 //
+static int PoolWorker(void *pThread)
+{
+	const Sint32 THREAD = (Sint32)(size_t)pThread;
+	poolIndex = THREAD;
+	SDL_mutexP(poolLock);
+	for (;;) {
+		Sint32 begin, end;
+		PoolTask task;
+		bool band = false;
+		while (!poolQuit && !(band = PoolTake(begin, end)) && !PoolTakeTask(task)) {
+			SDL_CondWait(poolWake, poolLock);
+		}
+		if (poolQuit) { break; }
+		if (!band) {
+			SDL_mutexV(poolLock);
+			task.func(task.data);
+			SDL_mutexP(poolLock);
+			--taskRunning;
+			SDL_CondBroadcast(taskDone);
+			if (!taskQueue.empty()) { SDL_CondBroadcast(poolWake); }
+			continue;
+		}
+		GfxParallelFunc func = poolFunc;
+		void *data = poolData;
+		SDL_mutexV(poolLock);
+		func(data, begin, end, THREAD);
+		SDL_mutexP(poolLock);
+		if (--poolPending == 0) {
+			SDL_CondSignal(poolDone);
+		}
+	}
+	SDL_mutexV(poolLock);
+	return 0;
+}
 
 //
-// Free
-// Frees the data allocated for the image.
+// PoolIndex
+// Returns the pool index of the calling thread, or 0 if the
+// calling thread is not a worker.
 //
-void Image::Free( void )
+static inline Sint32 PoolIndex( void )
 {
-	delete [] pixels;
-	pixels = (Color32*)0;
-	width = 0;
-	height = 0;
+	return poolIndex;
 }
 
 //
-// Create
-// Allocated data for the image.
+// PoolCreate
+// Creates the pool lock and conditions if needed.
 //
-bool Image::Create(Sint32 pWidth, Sint32 pHeight)
+static bool PoolCreate( void )
 {
-	Free();
-	if (pWidth > 0 && pWidth <= Image::MaxDimension && pHeight > 0 && pHeight <= Image::MaxDimension) {
-		try {
-			pixels = new Color32 [pWidth*pHeight];
-			width = pWidth;
-			height = pHeight;
-		} catch (std::exception &pEx) {
-			std::ostringstream sout;
-			sout << "0x" << this << ": " << pEx.what();
-			SDL_SetError(sout.str().c_str());
-			Free();
+	if (poolLock == (SDL_mutex*)0) {
+		poolLock = SDL_CreateMutex();
+		poolWake = SDL_CreateCond();
+		poolDone = SDL_CreateCond();
+		taskDone = SDL_CreateCond();
+		if (poolLock == (SDL_mutex*)0 || poolWake == (SDL_cond*)0 || poolDone == (SDL_cond*)0 || taskDone == (SDL_cond*)0) {
+			SDL_SetError("GfxSetThreads: Could not create synchronization primitives");
+			return false;
 		}
-	} else {
-		std::ostringstream sout;
-		sout << "0x" << this << ": Invalid size";
-		SDL_SetError(sout.str().c_str());
 	}
-	return IsGood();
+	return true;
 }
 
 //
-// SetMemory
-// Force a specific memory in image.
-// Note: Does not free previous memory and can result
-// in memory leakage when used improperly.
+// PoolQueue
+// Queues pFunc(pData) as a background task. pDrop is called
+// instead if the task is still queued when Gfx quits. Caller
+// must hold poolLock.
 //
-void Image::SetMemory(Color32 *pPix, Sint32 pWidth, Sint32 pHeight)
+static void PoolQueue(void (*pFunc)(void*), void *pData, Sint32 pPriority, void (*pDrop)(void*) = 0)
 {
-	pixels = pPix;
-	width = pWidth;
-	height = pHeight;
+	PoolTask task;
+	task.func = pFunc;
+	task.drop = pDrop;
+	task.data = pData;
+	task.priority = pPriority;
+	task.order = taskOrder++;
+	taskQueue.push_back(task);
+	SDL_CondBroadcast(poolWake);
 }
 
 //
-// Copy
-// Copies the data from an existing image.
+// PoolUnqueue
+// Removes the task for pData if it has not started. Caller
+// must hold poolLock.
 //
-bool Image::Copy(const Image &pImage)
+static bool PoolUnqueue(void *pData)
 {
-	if (Create(pImage.width, pImage.height)) {
-		Color32 *dst = (*this)[0];
-		const Color32 *src = pImage[0];
-		for (Sint32 i=0; i < width*height; ++i){
-			dst[i] = src[i];
+	for (size_t i = 0; i < taskQueue.size(); ++i){
+		if (taskQueue[i].data == pData) {
+			taskQueue.erase(taskQueue.begin() + i);
+			return true;
 		}
-		return true;
 	}
 	return false;
 }
 
 //
-// Load
-// Allocates data for image and loads a native format
-// from a file.
+// PoolReprioritize
+// Changes the priority of the task for pData if it has not
+// started. Caller must hold poolLock.
 //
-bool Image::Load(const std::string &pFile)
+static bool PoolReprioritize(void *pData, Sint32 pPriority)
 {
-	std::ifstream fin(pFile.c_str(), std::ios::binary);
-	if (!fin.is_open()) {
-		std::ostringstream sout;
-		sout << "0x" << this << ": Could not open file";
-		SDL_SetError(sout.str().c_str());
-		return false;
-	}
-
-	try {
-		Sint32 typeSize=0;
-		fin.read((char*)(&typeSize), sizeof(typeSize));
-		if (typeSize == sizeof(Color32)) {
-			fin.read((char*)(&width), sizeof(width));
-			fin.read((char*)(&height), sizeof(height));
-			if (Create(width, height)) {
-				fin.read((char*)pixels, width*height*sizeof(Color32));
-			}
-		} else {
-			std::ostringstream sout;
-			sout << "0x" << this << ": Format not recognized";
-			SDL_SetError(sout.str().c_str());
-			Free();
+	for (size_t i = 0; i < taskQueue.size(); ++i){
+		if (taskQueue[i].data == pData) {
+			taskQueue[i].priority = pPriority;
+			return true;
 		}
-	} catch (std::exception &pEx) {
-		std::ostringstream sout;
-		sout << "0x" << this << ": " << pEx.what();
-		SDL_SetError(sout.str().c_str());
-		Free();
 	}
-
-	fin.close();
-	return IsGood();
+	return false;
 }
 
 //
-// Save
-// Saves the current image to a file in a native format.
+// GfxSetThreads
+// Stops the current worker threads and starts pThreads new
+// ones. Must not be called while a parallel job is running.
+// Running background tasks are finished first; queued ones
+// stay queued.
 //
-bool Image::Save(const std::string &pFile) const
+bool GfxSetThreads(Uint32 pThreads)
 {
-	if (width*height == 0 || pixels == NULL) { return false; }
-	std::ofstream fout(pFile.c_str(), std::ios::binary);
-	if (!fout.is_open()) {
-		std::ostringstream sout;
-		sout << "0x" << this << ": Could not open file";
-		SDL_SetError(sout.str().c_str());
-		return false;
+	if (poolLock == (SDL_mutex*)0 && pThreads == 0) { return true; }
+	if (!PoolCreate()) { return false; }
+	
+	SDL_mutexP(poolLock);
+	poolQuit = true;
+	SDL_CondBroadcast(poolWake);
+	SDL_mutexV(poolLock);
+	for (Sint32 i = 0; i < poolCount; ++i){
+		SDL_WaitThread(poolThread[i], (int*)0);
 	}
-
-	try {
-		Sint32 typeSize = sizeof(Color32);
-		fout.write((char*)(&typeSize), sizeof(typeSize));
-		fout.write((char*)(&width), sizeof(width));
-		fout.write((char*)(&height), sizeof(height));
-		fout.write((char*)pixels, width*height*sizeof(Color32));
-	} catch (std::exception &pEx) {
-		std::ostringstream sout;
-		sout << "0x" << this << ": " << pEx.what();
-		SDL_SetError(sout.str().c_str());
-		fout.close();
-		return false;
+	poolCount = 0;
+	poolQuit = false;
+	
+	const Sint32 COUNT = pThreads < (Uint32)GfxMaxThreads ? (Sint32)pThreads : GfxMaxThreads;
+	SDL_mutexP(poolLock); // new workers may find queued tasks, so they wait until the pool is complete
+	for (Sint32 i = 0; i < COUNT; ++i){
+		poolThread[i] = SDL_CreateThread(PoolWorker, (void*)(size_t)(i+1));
+		if (poolThread[i] == (SDL_Thread*)0) {
+			SDL_mutexV(poolLock);
+			SDL_SetError("GfxSetThreads: Could not create worker thread");
+			return false;
+		}
+		++poolCount;
 	}
-
-	fout.close();
+	SDL_mutexV(poolLock);
 	return true;
 }
 
 //
-// Convert
-// Converts a non-native format to a native format.
-// Non-native formats are all formats loadable by
-// SDL and SDL_Image.
-// NOTE: If you are using SDL_image, include SDL_image.h
-// BEFORE gfx.h in your main.cpp/main.c.
+// GfxThreads
+// Returns the number of worker threads.
 //
-bool Image::Convert(const std::string &pFile)
+Sint32 GfxThreads( void )
 {
-	Free();
-	
-	SDL_Surface *src = APIIMGLOAD(pFile.c_str());
-	if (src == (SDL_Surface*)0) { return false; } // No need to set SDL error manually
-
-	if (Create(src->w, src->h)) {
-		const Sint32 SIZE = width*height;
-		Color32 *dst = pixels;
-		for (int y = 0; y < height; ++y) {
-			for (int x = 0; x < width; ++x) {
-				Uint8 *spix = (Uint8 *)src->pixels + y * src->pitch + x * src->format->BytesPerPixel;
-				SDL_GetRGBA(
-					*((Uint32*)spix),
-					src->format,
-					&dst->channels.red,
-					&dst->channels.green,
-					&dst->channels.blue,
-					&dst->channels.alpha
-				);
-				++dst;
-			}
-		}
-	}
-
-	SDL_FreeSurface(src);
-
-	return IsGood();
+	return poolCount;
 }
 
 //
-// ReverseByteorder
-// Reverses the byteorder in case Convert does not
-// accurately read the requested file.
+// GfxParallel
+// Splits [pBegin, pEnd) into bands and runs them on the
+// worker threads and the calling thread. Runs serially if
+// the range is small, if there are no workers, if called
+// from a worker (i.e. nested calls and background tasks), or
+// if the pool is already busy (concurrent calls).
 //
-void Image::ReverseByteorder( void )
+void GfxParallel(Sint32 pBegin, Sint32 pEnd, Sint32 pGrain, GfxParallelFunc pFunc, void *pData)
 {
-	for (Sint32 i = 0; i < width*height; ++i){
-		Uint8 *bytes = (Uint8*)&pixels[i];
-		Uint8 temp = bytes[0];
-		bytes[0] = bytes[3];
-		bytes[3] = temp;
-		temp = bytes[1];
-		bytes[1] = bytes[2];
-		bytes[2] = temp;
+	pGrain = pGrain > 0 ? pGrain : 1;
+	if (pEnd - pBegin < pGrain*2 || poolCount == 0) {
+		if (pEnd > pBegin) { pFunc(pData, pBegin, pEnd, PoolIndex()); }
+		return;
 	}
+	const Sint32 THREAD = PoolIndex();
+	if (THREAD != 0) {
+		pFunc(pData, pBegin, pEnd, THREAD);
+		return;
+	}
+	
+	SDL_mutexP(poolLock);
+	if (poolBusy) {
+		SDL_mutexV(poolLock);
+		pFunc(pData, pBegin, pEnd, PoolIndex());
+		return;
+	}
+	poolBusy = true;
+	const Sint32 BANDS = (poolCount+1)*4; // a few bands per thread evens out uneven rows
+	const Sint32 RANGE = pEnd - pBegin;
+	poolBand = (RANGE + BANDS - 1) / BANDS;
+	poolBand = poolBand > pGrain ? poolBand : pGrain;
+	poolPending = (RANGE + poolBand - 1) / poolBand;
+	poolFunc = pFunc;
+	poolData = pData;
+	poolNext = pBegin;
+	poolEnd = pEnd;
+	SDL_CondBroadcast(poolWake);
+	
+	Sint32 begin, end;
+	while (PoolTake(begin, end)) {
+		SDL_mutexV(poolLock);
+		pFunc(pData, begin, end, 0);
+		SDL_mutexP(poolLock);
+		--poolPending;
+	}
+	while (poolPending > 0) {
+		SDL_CondWait(poolDone, poolLock);
+	}
+	poolBusy = false;
+	SDL_mutexV(poolLock);
 }
 
 //
-// GetRGB
-// Returns floating point channels of specified
+// Row storage
+// Protected by poolLock while a job reserves it; the job
+// that holds it is the only one using it.
+//
+static Color32 *poolRows[GfxMaxThreads+1];
+static Sint32 poolRowSize[GfxMaxThreads+1];
+static bool poolRowsBusy = false;
+
+bool GfxReserveRows(Sint32 pCount)
+{
+	if (!PoolCreate()) { return false; }
+	SDL_mutexP(poolLock);
+	const bool BUSY = poolRowsBusy;
+	poolRowsBusy = true;
+	SDL_mutexV(poolLock);
+	if (BUSY) { return false; }
+	for (Sint32 i = 0; i <= poolCount; ++i){
+		if (poolRowSize[i] < pCount) {
+			delete [] poolRows[i];
+			poolRows[i] = (Color32*)0;
+			poolRowSize[i] = 0;
+			try {
+				poolRows[i] = new Color32[pCount];
+			} catch (std::exception&) {
+				GfxReleaseRows();
+				return false;
+			}
+			poolRowSize[i] = pCount;
+		}
+	}
+	return true;
+}
+
+Color32 *GfxThreadRows(Sint32 pThread)
+{
+	return poolRows[pThread];
+}
+
+void GfxReleaseRows( void )
+{
+	SDL_mutexP(poolLock);
+	poolRowsBusy = false;
+	SDL_mutexV(poolLock);
+}
+
+static void PoolRowsFree( void )
+{
+	for (Sint32 i = 0; i <= GfxMaxThreads; ++i){
+		delete [] poolRows[i];
+		poolRows[i] = (Color32*)0;
+		poolRowSize[i] = 0;
+	}
+}
+
+//
+// Stats
+// One slot per pool index, padded so threads never write to
+// the same cache line.
+//
+struct StatSlot
+{
+	GfxStats stats;
+	Uint8 pad[64 - sizeof(GfxStats)%64];
+};
+static StatSlot statSlot[GfxMaxThreads+1];
+
+GfxStats &GfxStatSlot( void )
+{
+	return statSlot[PoolIndex()].stats;
+}
+
+//
+// GfxGetStats
+// Returns the sum of the counters of all threads. Call it
+// between draw calls, when the pool is idle.
+//
+GfxStats GfxGetStats( void )
+{
+	GfxStats total;
+	memset((void*)&total, 0, sizeof(total));
+	for (Sint32 i = 0; i <= GfxMaxThreads; ++i){
+		const GfxStats &stats = statSlot[i].stats;
+		for (Sint32 j = 0; j < GfxStatBlenders; ++j){ total.pixels[j] += stats.pixels[j]; }
+		for (Sint32 j = 0; j < GfxStatSamplers; ++j){ total.blits[j] += stats.blits[j]; }
+		for (Sint32 j = 0; j < GfxStatTimers; ++j){
+			total.calls[j] += stats.calls[j];
+			total.micros[j] += stats.micros[j];
+		}
+		total.streamBytes += stats.streamBytes;
+	}
+	return total;
+}
+
+void GfxResetStats( void )
+{
+	for (Sint32 i = 0; i <= GfxMaxThreads; ++i){
+		memset((void*)&statSlot[i].stats, 0, sizeof(GfxStats));
+	}
+}
+
+//
+// GfxStatClock
+// Monotonic time in microseconds, falls back on SDL_GetTicks.
+//
+Uint64 GfxStatClock( void )
+{
+#if defined(GFX_MMAP_WIN32)
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (Uint64)(count.QuadPart / frequency.QuadPart * 1000000 + count.QuadPart % frequency.QuadPart * 1000000 / frequency.QuadPart);
+#elif defined(GFX_MMAP_POSIX) && defined(CLOCK_MONOTONIC)
+	timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (Uint64)now.tv_sec*1000000 + (Uint64)now.tv_nsec/1000;
+#else
+	return (Uint64)SDL_GetTicks()*1000;
+#endif
+}
+
+//
+// Color32
+//
+
+//
+// Color32 (ctor)
+//
+Color32::Color32( void ) : value(0) {}
+Color32::Color32(const Color32 &pColor) : value(pColor.value) {}
+Color32::Color32(const Color32 &pColor, Uint8 pAlpha) : value(pColor.value) { channels.alpha = pAlpha; }
+Color32::Color32(Uint32 pColor) : value(pColor) {}
+Color32::Color32(Uint8 pR, Uint8 pG, Uint8 pB, Uint8 pA)
+{
+	channels.red = pR;
+	channels.green = pG;
+	channels.blue = pB;
+	channels.alpha = pA;
+}
+
+//
+// Color arithmetic operators
+// Saturating arithmetic on all four channels of the packed
+// value at once (SWAR). The high bit of each channel is
+// handled separately so that carries and borrows never
+// cross into the neighboring channel.
+//
+static const Uint32 CHANNEL_HIGH = 0x80808080;
+static const Uint32 CHANNEL_LOW = 0x7f7f7f7f;
+
+Color32 &operator +=(Color32 &pLeft, const Color32 &pRight)
+{
+	const Uint32 a = pLeft.value;
+	const Uint32 b = pRight.value;
+	const Uint32 sum = (a & CHANNEL_LOW) + (b & CHANNEL_LOW);
+	const Uint32 carry = ((a & b) | ((a | b) & sum)) & CHANNEL_HIGH;
+	pLeft.value = (sum ^ ((a ^ b) & CHANNEL_HIGH)) | ((carry >> 7) * UCHAR_MAX);
+	return pLeft;
+}
+Color32 &operator -=(Color32 &pLeft, const Color32 &pRight)
+{
+	const Uint32 a = pLeft.value;
+	const Uint32 b = pRight.value;
+	const Uint32 diff = (a | CHANNEL_HIGH) - (b & CHANNEL_LOW);
+	const Uint32 borrow = ((~a & b) | (~(a ^ b) & ~diff)) & CHANNEL_HIGH;
+	pLeft.value = (diff ^ ((a ^ ~b) & CHANNEL_HIGH)) & ~((borrow >> 7) * UCHAR_MAX);
+	return pLeft;
+}
+
+//
+// Color multiplication
+// floor(a*b/255) per channel. The four products are packed
+// two per word in 16-bit lanes, and the division is done as
+// (x + 1 + (x >> 8)) >> 8 on both lanes at once; the sum
+// stays below 0xff01, so no lane carries into the next.
+//
+Color32 operator*(Color32 pLeft, const Color32 &pRight)
+{
+	const Uint32 a = pLeft.value;
+	const Uint32 b = pRight.value;
+	Uint32 rb = (a & 0xff) * (b & 0xff) | (((a >> 16) & 0xff) * ((b >> 16) & 0xff)) << 16;
+	Uint32 ag = ((a >> 8) & 0xff) * ((b >> 8) & 0xff) | ((a >> 24) * (b >> 24)) << 16;
+	rb = ((rb + 0x00010001 + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = (ag + 0x00010001 + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	pLeft.value = rb | ag;
+	return pLeft;
+}
+Color32 &operator *=(Color32 &pLeft, const Color32 &pRight)
+{
+	return (pLeft = pLeft * pRight);
+}
+Color32 &operator >>=(Color32 &pLeft, Sint32 pRight)
+{
+	pLeft.channels.red >>= pRight;
+	pLeft.channels.green >>= pRight;
+	pLeft.channels.blue >>= pRight;
+	pLeft.channels.alpha >>= pRight;
+	return pLeft;
+}
+Color32 &operator <<=(Color32 &pLeft, Sint32 pRight)
+{
+	pLeft.channels.red <<= pRight;
+	pLeft.channels.green <<= pRight;
+	pLeft.channels.blue <<= pRight;
+	pLeft.channels.alpha <<= pRight;
+	return pLeft;
+}
+bool operator ==(Color32 pLeft, Color32 pRight) // does not test alpha
+{
+	return (
+		pLeft.channels.red == pRight.channels.red &&
+		pLeft.channels.green == pRight.channels.green &&
+		pLeft.channels.blue == pRight.channels.blue
+		);
+}
+bool operator !=(const Color32 &pLeft, const Color32 &pRight)
+{
+	return !(pLeft == pRight);
+}
+Color32 operator+(Color32 pLeft, const Color32 &pRight) { return (pLeft += pRight); }
+Color32 operator-(Color32 pLeft, const Color32 &pRight) { return (pLeft -= pRight); }
+Color32 operator>>(Color32 pLeft, Sint32 pRight) { return (pLeft >>= pRight); }
+Color32 operator<<(Color32 pLeft, Sint32 pRight) { return (pLeft <<= pRight); }
+
+//
+// Span kernels
+//
+
+//
+// GfxSpanAlphaBlend
+// Same arithmetic as AlphaBlend. Channels are widened to
+// 16 bits; because the result wraps to 8 bits, only the low
+// 16 bits of alpha*(src-dst) are needed and mullo suffices.
+//
+void GfxSpanAlphaBlend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_AVX2
+	{
+		const __m256i ZERO = _mm256_setzero_si256();
+		const __m256i LOW = _mm256_set1_epi16(UCHAR_MAX);
+		for (; i+8 <= pCount; i+=8){
+			const __m256i s = _mm256_loadu_si256((const __m256i*)(pSrc+i));
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(pDst+i));
+			__m256i a = _mm256_and_si256(_mm256_srli_epi32(s, GFX_ALPHA_SHIFT), _mm256_set1_epi32(UCHAR_MAX));
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+			const __m256i dlo = _mm256_unpacklo_epi8(d, ZERO);
+			const __m256i dhi = _mm256_unpackhi_epi8(d, ZERO);
+			__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, ZERO), _mm256_sub_epi16(_mm256_unpacklo_epi8(s, ZERO), dlo));
+			__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, ZERO), _mm256_sub_epi16(_mm256_unpackhi_epi8(s, ZERO), dhi));
+			lo = _mm256_and_si256(_mm256_add_epi16(dlo, _mm256_srli_epi16(lo, 8)), LOW);
+			hi = _mm256_and_si256(_mm256_add_epi16(dhi, _mm256_srli_epi16(hi, 8)), LOW);
+			_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_packus_epi16(lo, hi));
+		}
+	}
+#endif
+#ifdef GFX_SSE2
+	{
+		const __m128i ZERO = _mm_setzero_si128();
+		const __m128i LOW = _mm_set1_epi16(UCHAR_MAX);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc+i));
+			const __m128i d = _mm_loadu_si128((const __m128i*)(pDst+i));
+			__m128i a = _mm_and_si128(_mm_srli_epi32(s, GFX_ALPHA_SHIFT), _mm_set1_epi32(UCHAR_MAX));
+			a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+			a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+			const __m128i dlo = _mm_unpacklo_epi8(d, ZERO);
+			const __m128i dhi = _mm_unpackhi_epi8(d, ZERO);
+			__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(a, ZERO), _mm_sub_epi16(_mm_unpacklo_epi8(s, ZERO), dlo));
+			__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(a, ZERO), _mm_sub_epi16(_mm_unpackhi_epi8(s, ZERO), dhi));
+			lo = _mm_and_si128(_mm_add_epi16(dlo, _mm_srli_epi16(lo, 8)), LOW);
+			hi = _mm_and_si128(_mm_add_epi16(dhi, _mm_srli_epi16(hi, 8)), LOW);
+			_mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(GFX_NEON)
+	for (; i+4 <= pCount; i+=4){
+		const uint8x16_t s = vld1q_u8((const uint8_t*)(pSrc+i));
+		const uint8x16_t d = vld1q_u8((const uint8_t*)(pDst+i));
+		uint32x4_t a32 = vandq_u32(vshrq_n_u32(vreinterpretq_u32_u8(s), GFX_ALPHA_SHIFT), vdupq_n_u32(UCHAR_MAX));
+		const uint8x16_t a = vreinterpretq_u8_u32(vmulq_n_u32(a32, 0x01010101));
+		const uint16x8_t dlo = vmovl_u8(vget_low_u8(d));
+		const uint16x8_t dhi = vmovl_u8(vget_high_u8(d));
+		const uint16x8_t lo = vmulq_u16(vmovl_u8(vget_low_u8(a)), vsubq_u16(vmovl_u8(vget_low_u8(s)), dlo));
+		const uint16x8_t hi = vmulq_u16(vmovl_u8(vget_high_u8(a)), vsubq_u16(vmovl_u8(vget_high_u8(s)), dhi));
+		vst1q_u8((uint8_t*)(pDst+i), vcombine_u8(vmovn_u16(vaddq_u16(dlo, vshrq_n_u16(lo, 8))), vmovn_u16(vaddq_u16(dhi, vshrq_n_u16(hi, 8)))));
+	}
+#endif
+	const AlphaBlend blend;
+	for (; i < pCount; ++i){
+		pDst[i] = blend(pDst[i], pSrc[i]);
+	}
+}
+
+//
+// GfxSpanPremultipliedBlend
+// Same arithmetic as PremultipliedBlend. dst*(255-alpha) is
+// divided by 255 exactly in 16-bit lanes, and the final pack
+// saturates like the scalar version.
+//
+void GfxSpanPremultipliedBlend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_AVX2
+	{
+		const __m256i ZERO = _mm256_setzero_si256();
+		const __m256i LOW = _mm256_set1_epi16(UCHAR_MAX);
+		const __m256i HALF = _mm256_set1_epi16(0x80);
+		for (; i+8 <= pCount; i+=8){
+			const __m256i s = _mm256_loadu_si256((const __m256i*)(pSrc+i));
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(pDst+i));
+			__m256i a = _mm256_and_si256(_mm256_srli_epi32(s, GFX_ALPHA_SHIFT), _mm256_set1_epi32(UCHAR_MAX));
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 8));
+			a = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+			__m256i lo = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(d, ZERO), _mm256_sub_epi16(LOW, _mm256_unpacklo_epi8(a, ZERO))), HALF);
+			__m256i hi = _mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(d, ZERO), _mm256_sub_epi16(LOW, _mm256_unpackhi_epi8(a, ZERO))), HALF);
+			lo = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)), 8), _mm256_unpacklo_epi8(s, ZERO));
+			hi = _mm256_add_epi16(_mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)), 8), _mm256_unpackhi_epi8(s, ZERO));
+			_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_packus_epi16(lo, hi));
+		}
+	}
+#endif
+#ifdef GFX_SSE2
+	{
+		const __m128i ZERO = _mm_setzero_si128();
+		const __m128i LOW = _mm_set1_epi16(UCHAR_MAX);
+		const __m128i HALF = _mm_set1_epi16(0x80);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc+i));
+			const __m128i d = _mm_loadu_si128((const __m128i*)(pDst+i));
+			__m128i a = _mm_and_si128(_mm_srli_epi32(s, GFX_ALPHA_SHIFT), _mm_set1_epi32(UCHAR_MAX));
+			a = _mm_or_si128(a, _mm_slli_epi32(a, 8));
+			a = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+			__m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(d, ZERO), _mm_sub_epi16(LOW, _mm_unpacklo_epi8(a, ZERO))), HALF);
+			__m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(d, ZERO), _mm_sub_epi16(LOW, _mm_unpackhi_epi8(a, ZERO))), HALF);
+			lo = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8), _mm_unpacklo_epi8(s, ZERO));
+			hi = _mm_add_epi16(_mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8), _mm_unpackhi_epi8(s, ZERO));
+			_mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(GFX_NEON)
+	for (; i+4 <= pCount; i+=4){
+		const uint8x16_t s = vld1q_u8((const uint8_t*)(pSrc+i));
+		const uint8x16_t d = vld1q_u8((const uint8_t*)(pDst+i));
+		uint32x4_t a32 = vandq_u32(vshrq_n_u32(vreinterpretq_u32_u8(s), GFX_ALPHA_SHIFT), vdupq_n_u32(UCHAR_MAX));
+		const uint8x16_t inv = vmvnq_u8(vreinterpretq_u8_u32(vmulq_n_u32(a32, 0x01010101)));
+		uint16x8_t lo = vaddq_u16(vmull_u8(vget_low_u8(d), vget_low_u8(inv)), vdupq_n_u16(0x80));
+		uint16x8_t hi = vaddq_u16(vmull_u8(vget_high_u8(d), vget_high_u8(inv)), vdupq_n_u16(0x80));
+		lo = vaddq_u16(vshrq_n_u16(vaddq_u16(lo, vshrq_n_u16(lo, 8)), 8), vmovl_u8(vget_low_u8(s)));
+		hi = vaddq_u16(vshrq_n_u16(vaddq_u16(hi, vshrq_n_u16(hi, 8)), 8), vmovl_u8(vget_high_u8(s)));
+		vst1q_u8((uint8_t*)(pDst+i), vcombine_u8(vqmovn_u16(lo), vqmovn_u16(hi)));
+	}
+#endif
+	const PremultipliedBlend blend;
+	for (; i < pCount; ++i){
+		pDst[i] = blend(pDst[i], pSrc[i]);
+	}
+}
+
+//
+// GfxSpanColorKey
+// Same comparison as ColorKey, i.e. alpha is not tested.
+//
+void GfxSpanColorKey(Color32 *pDst, const Color32 *pSrc, Sint32 pCount, Color32 pKey)
+{
+	Sint32 i = 0;
+	const Uint32 RGB_MASK = ~Color32(0, 0, 0, UCHAR_MAX).value;
+	const Uint32 KEY = pKey.value & RGB_MASK;
+#ifdef GFX_AVX2
+	{
+		const __m256i mask = _mm256_set1_epi32((int)RGB_MASK);
+		const __m256i key = _mm256_set1_epi32((int)KEY);
+		for (; i+8 <= pCount; i+=8){
+			const __m256i s = _mm256_loadu_si256((const __m256i*)(pSrc+i));
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(pDst+i));
+			const __m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(s, mask), key);
+			_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_or_si256(_mm256_and_si256(eq, d), _mm256_andnot_si256(eq, s)));
+		}
+	}
+#endif
+#ifdef GFX_SSE2
+	{
+		const __m128i mask = _mm_set1_epi32((int)RGB_MASK);
+		const __m128i key = _mm_set1_epi32((int)KEY);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc+i));
+			const __m128i d = _mm_loadu_si128((const __m128i*)(pDst+i));
+			const __m128i eq = _mm_cmpeq_epi32(_mm_and_si128(s, mask), key);
+			_mm_storeu_si128((__m128i*)(pDst+i), _mm_or_si128(_mm_and_si128(eq, d), _mm_andnot_si128(eq, s)));
+		}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint32x4_t mask = vdupq_n_u32(RGB_MASK);
+		const uint32x4_t key = vdupq_n_u32(KEY);
+		for (; i+4 <= pCount; i+=4){
+			const uint32x4_t s = vld1q_u32((const uint32_t*)(pSrc+i));
+			const uint32x4_t d = vld1q_u32((const uint32_t*)(pDst+i));
+			vst1q_u32((uint32_t*)(pDst+i), vbslq_u32(vceqq_u32(vandq_u32(s, mask), key), d, s));
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		pDst[i] = (pSrc[i].value & RGB_MASK) == KEY ? pDst[i] : pSrc[i];
+	}
+}
+
+//
+// GfxSpanAdd
+// Same as operator+= for every pixel in the span.
+//
+void GfxSpanAdd(Color32 *pDst, const Color32 *pSrc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_AVX2
+	for (; i+8 <= pCount; i+=8){
+		_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_adds_epu8(_mm256_loadu_si256((const __m256i*)(pDst+i)), _mm256_loadu_si256((const __m256i*)(pSrc+i))));
+	}
+#endif
+#ifdef GFX_SSE2
+	for (; i+4 <= pCount; i+=4){
+		_mm_storeu_si128((__m128i*)(pDst+i), _mm_adds_epu8(_mm_loadu_si128((const __m128i*)(pDst+i)), _mm_loadu_si128((const __m128i*)(pSrc+i))));
+	}
+#elif defined(GFX_NEON)
+	for (; i+4 <= pCount; i+=4){
+		vst1q_u8((uint8_t*)(pDst+i), vqaddq_u8(vld1q_u8((const uint8_t*)(pDst+i)), vld1q_u8((const uint8_t*)(pSrc+i))));
+	}
+#endif
+	for (; i < pCount; ++i){
+		pDst[i] += pSrc[i];
+	}
+}
+
+//
+// GfxSpanSub
+// Same as operator-= for every pixel in the span.
+//
+void GfxSpanSub(Color32 *pDst, const Color32 *pSrc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_AVX2
+	for (; i+8 <= pCount; i+=8){
+		_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_subs_epu8(_mm256_loadu_si256((const __m256i*)(pDst+i)), _mm256_loadu_si256((const __m256i*)(pSrc+i))));
+	}
+#endif
+#ifdef GFX_SSE2
+	for (; i+4 <= pCount; i+=4){
+		_mm_storeu_si128((__m128i*)(pDst+i), _mm_subs_epu8(_mm_loadu_si128((const __m128i*)(pDst+i)), _mm_loadu_si128((const __m128i*)(pSrc+i))));
+	}
+#elif defined(GFX_NEON)
+	for (; i+4 <= pCount; i+=4){
+		vst1q_u8((uint8_t*)(pDst+i), vqsubq_u8(vld1q_u8((const uint8_t*)(pDst+i)), vld1q_u8((const uint8_t*)(pSrc+i))));
+	}
+#endif
+	for (; i < pCount; ++i){
+		pDst[i] -= pSrc[i];
+	}
+}
+
+//
+// GfxSpanMul
+// Same as operator*= for every pixel in the span. The
+// division by 255 is done as (x + 1 + (x >> 8)) >> 8, which
+// fits in 16 bits for all products of two channels.
+//
+void GfxSpanMul(Color32 *pDst, const Color32 *pSrc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_AVX2
+	{
+		const __m256i ZERO = _mm256_setzero_si256();
+		const __m256i ONE = _mm256_set1_epi16(1);
+		for (; i+8 <= pCount; i+=8){
+			const __m256i d = _mm256_loadu_si256((const __m256i*)(pDst+i));
+			const __m256i s = _mm256_loadu_si256((const __m256i*)(pSrc+i));
+			__m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, ZERO), _mm256_unpacklo_epi8(s, ZERO));
+			__m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, ZERO), _mm256_unpackhi_epi8(s, ZERO));
+			lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(lo, ONE), _mm256_srli_epi16(lo, 8)), 8);
+			hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_add_epi16(hi, ONE), _mm256_srli_epi16(hi, 8)), 8);
+			_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_packus_epi16(lo, hi));
+		}
+	}
+#endif
+#ifdef GFX_SSE2
+	{
+		const __m128i ZERO = _mm_setzero_si128();
+		const __m128i ONE = _mm_set1_epi16(1);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i d = _mm_loadu_si128((const __m128i*)(pDst+i));
+			const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc+i));
+			__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, ZERO), _mm_unpacklo_epi8(s, ZERO));
+			__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, ZERO), _mm_unpackhi_epi8(s, ZERO));
+			lo = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(lo, ONE), _mm_srli_epi16(lo, 8)), 8);
+			hi = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(hi, ONE), _mm_srli_epi16(hi, 8)), 8);
+			_mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint16x8_t ONE = vdupq_n_u16(1);
+		for (; i+4 <= pCount; i+=4){
+			const uint8x16_t d = vld1q_u8((const uint8_t*)(pDst+i));
+			const uint8x16_t s = vld1q_u8((const uint8_t*)(pSrc+i));
+			const uint16x8_t lo = vmull_u8(vget_low_u8(d), vget_low_u8(s));
+			const uint16x8_t hi = vmull_u8(vget_high_u8(d), vget_high_u8(s));
+			vst1q_u8((uint8_t*)(pDst+i), vcombine_u8(vshrn_n_u16(vaddq_u16(vaddq_u16(lo, ONE), vshrq_n_u16(lo, 8)), 8), vshrn_n_u16(vaddq_u16(vaddq_u16(hi, ONE), vshrq_n_u16(hi, 8)), 8)));
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		pDst[i] *= pSrc[i];
+	}
+}
+
+//
+// GfxSpanFill
+// Writes pColor to every pixel in the span. Streaming stores
+// need aligned addresses, so the first pixels are written
+// one at a time until the span is aligned.
+//
+void GfxSpanFill(Color32 *pDst, Color32 pColor, Sint32 pCount, bool pStream)
+{
+	Sint32 i = 0;
+#if defined(GFX_SSE2) || defined(GFX_AVX2)
+	if (pStream) {
+		for (; i < pCount && ((size_t)(pDst+i) & 31) != 0; ++i){
+			pDst[i] = pColor;
+		}
+	}
+#endif
+#ifdef GFX_AVX2
+	{
+		const __m256i C = _mm256_set1_epi32((int)pColor.value);
+		if (pStream) {
+			for (; i+8 <= pCount; i+=8){
+				_mm256_stream_si256((__m256i*)(pDst+i), C);
+			}
+		} else {
+			for (; i+8 <= pCount; i+=8){
+				_mm256_storeu_si256((__m256i*)(pDst+i), C);
+			}
+		}
+	}
+#endif
+#ifdef GFX_SSE2
+	{
+		const __m128i C = _mm_set1_epi32((int)pColor.value);
+		if (pStream) {
+			for (; i+4 <= pCount; i+=4){
+				_mm_stream_si128((__m128i*)(pDst+i), C);
+			}
+			_mm_sfence(); // streamed stores are weakly ordered
+		} else {
+			for (; i+4 <= pCount; i+=4){
+				_mm_storeu_si128((__m128i*)(pDst+i), C);
+			}
+		}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint32x4_t C = vdupq_n_u32(pColor.value);
+		for (; i+4 <= pCount; i+=4){
+			vst1q_u32((uint32_t*)(pDst+i), C);
+		}
+	}
+#endif
+#if !defined(GFX_SSE2)
+	(void)pStream;
+#endif
+	for (; i < pCount; ++i){
+		pDst[i] = pColor;
+	}
+}
+
+//
+// Blenders
+//
+
+//
+// Blend
+// Span versions of the built-in blenders. Derived classes
+// go through the per-pixel loop of Blender::Blend.
+//
+void Assign::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	if (pDst != pSrc && pCount > 0) {
+		memmove((void*)pDst, (const void*)pSrc, pCount*sizeof(Color32));
+	}
+}
+void AlphaBlend::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	GfxSpanAlphaBlend(pDst, pSrc, pCount);
+}
+void ColorKey::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	GfxSpanColorKey(pDst, pSrc, pCount, key);
+}
+void PremultipliedBlend::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	GfxSpanPremultipliedBlend(pDst, pSrc, pCount);
+}
+void Grayscale::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	for (Sint32 i = 0; i < pCount; ++i){
+		pDst[i] = Grayscale::operator()(pDst[i], pSrc[i]);
+	}
+}
+void FillGrayscale::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	for (Sint32 i = 0; i < pCount; ++i){
+		pDst[i] = FillGrayscale::operator()(pDst[i], pSrc[i]);
+	}
+}
+void Additive::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	GfxSpanAdd(pDst, pSrc, pCount);
+}
+void Multiply::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	GfxSpanMul(pDst, pSrc, pCount);
+}
+void ScreenBlend::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	for (Sint32 i = 0; i < pCount; ++i){
+		pDst[i] = ScreenBlend::operator()(pDst[i], pSrc[i]);
+	}
+}
+void Modulate::Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+{
+	if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+	// assign, then multiply by a run of tints
+	const Sint32 RUN = 64;
+	Color32 tints[RUN];
+	for (Sint32 i = 0; i < RUN; ++i){ tints[i] = tint; }
+	if (pDst != pSrc && pCount > 0) {
+		memmove((void*)pDst, (const void*)pSrc, pCount*sizeof(Color32));
+	}
+	for (Sint32 i = 0; i < pCount; i += RUN){
+		GfxSpanMul(pDst + i, tints, pCount - i < RUN ? pCount - i : RUN);
+	}
+}
+
+//
+// Sampler
+//
+
+//
+// Sample
+// Converts fixed point texel coordinates to the normalized
+// coordinates expected by operator().
+//
+Color32 Sampler::Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY) const
+{
+	const float U_SCALE = pImage.GetWidth() > 1 ? 1.f / (float)(pImage.GetWidth()-1) : 0.f;
+	const float V_SCALE = pImage.GetHeight() > 1 ? 1.f / (float)(pImage.GetHeight()-1) : 0.f;
+	return (*this)(pImage, ((float)pX + (float)pFracX*(1.f/65536.f)) * U_SCALE, ((float)pY + (float)pFracY*(1.f/65536.f)) * V_SCALE);
+}
+
+//
+// Span
+// Samples a span by calling Sample once per pixel.
+//
+void Sampler::Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const
+{
+	for (Sint32 i = 0; i < pCount; ++i){
+		pOut[i] = Sample(pImage, (Sint32)(pU >> 16), (Sint32)(pV >> 16), (Sint32)(pU & 0xffff), (Sint32)(pV & 0xffff));
+		pU+=(Uint32)pDu;
+		pV+=(Uint32)pDv;
+	}
+}
+
+//
+// Nearest
+//
+
+//
+// operator()
+// Samples the nearest color. Looks pixelated
+// when stretched out, and looks aliased when
+// compressed to a smaller size than normal.
+//
+Color32 Nearest::operator()(const Image &pImage, float pU, float pV) const {
+	return pImage[(Sint32)((pImage.GetHeight()-1)*pV)][(Sint32)((pImage.GetWidth()-1)*pU)];
+}
+
+//
+// Sample
+// Fixed point version of operator().
+//
+Color32 Nearest::Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32, Sint32) const
+{
+	return pImage[pY][pX];
+}
+
+//
+// Span
+// Samples a span of colors. Horizontal spans read from a
+// single row.
+//
+void Nearest::Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const
+{
+	if (pDv == 0) {
+		const Color32 *row = pImage[(Sint32)(pV >> 16)];
+		if (pDu == 1 << 16) { // unscaled, the source may overlap pOut when an image is blitted onto itself
+			memmove((void*)pOut, (const void*)(row + (pU >> 16)), pCount*sizeof(Color32));
+		} else {
+			Sint32 i = 0;
+#if defined(GFX_SSE2) || defined(GFX_NEON)
+			if (pDu == 1 << 15 || pDu == 1 << 14) { // magnified exactly 2x or 4x, replicate four texels at a time
+				for (; i < pCount && (pU & 0xffff) >= (Uint32)pDu; ++i){ // up to the first pixel of a texel
+					pOut[i] = row[pU >> 16];
+					pU+=(Uint32)pDu;
+				}
+				if (pDu == 1 << 15) {
+					for (; i+8 <= pCount; i+=8, pU+=4 << 16){
+#ifdef GFX_SSE2
+						const __m128i T = _mm_loadu_si128((const __m128i*)(row + (pU >> 16)));
+						_mm_storeu_si128((__m128i*)(pOut+i), _mm_unpacklo_epi32(T, T));
+						_mm_storeu_si128((__m128i*)(pOut+i+4), _mm_unpackhi_epi32(T, T));
+#else
+						const uint32x4_t T = vld1q_u32((const uint32_t*)(row + (pU >> 16)));
+						const uint32x4x2_t PAIRS = vzipq_u32(T, T);
+						vst1q_u32((uint32_t*)(pOut+i), PAIRS.val[0]);
+						vst1q_u32((uint32_t*)(pOut+i+4), PAIRS.val[1]);
+#endif
+					}
+				} else {
+					for (; i+16 <= pCount; i+=16, pU+=4 << 16){
+#ifdef GFX_SSE2
+						const __m128i T = _mm_loadu_si128((const __m128i*)(row + (pU >> 16)));
+						_mm_storeu_si128((__m128i*)(pOut+i), _mm_shuffle_epi32(T, 0x00));
+						_mm_storeu_si128((__m128i*)(pOut+i+4), _mm_shuffle_epi32(T, 0x55));
+						_mm_storeu_si128((__m128i*)(pOut+i+8), _mm_shuffle_epi32(T, 0xaa));
+						_mm_storeu_si128((__m128i*)(pOut+i+12), _mm_shuffle_epi32(T, 0xff));
+#else
+						const uint32x4_t T = vld1q_u32((const uint32_t*)(row + (pU >> 16)));
+						vst1q_u32((uint32_t*)(pOut+i), vdupq_n_u32(vgetq_lane_u32(T, 0)));
+						vst1q_u32((uint32_t*)(pOut+i+4), vdupq_n_u32(vgetq_lane_u32(T, 1)));
+						vst1q_u32((uint32_t*)(pOut+i+8), vdupq_n_u32(vgetq_lane_u32(T, 2)));
+						vst1q_u32((uint32_t*)(pOut+i+12), vdupq_n_u32(vgetq_lane_u32(T, 3)));
+#endif
+					}
+				}
+			} else if (pDu == (1 << 16) / 3) { // magnified 3x, replicate four texels into twelve pixels
+				// pDu is a little short of a third, so a texel that starts at a fraction
+				// of 0 gets a fourth pixel and the next one starts at pDu - 1; groups
+				// are only taken when all four texel starts are at fractions of 1 or more
+				while (i+12 <= pCount) {
+					const Uint32 FRAC = pU & 0xffff;
+					if (FRAC >= (Uint32)pDu || FRAC < 4) {
+						pOut[i++] = row[pU >> 16];
+						pU+=(Uint32)pDu;
+						continue;
+					}
+#ifdef GFX_SSE2
+					const __m128i T = _mm_loadu_si128((const __m128i*)(row + (pU >> 16)));
+					_mm_storeu_si128((__m128i*)(pOut+i), _mm_shuffle_epi32(T, 0x40)); // a a a b
+					_mm_storeu_si128((__m128i*)(pOut+i+4), _mm_shuffle_epi32(T, 0xa5)); // b b c c
+					_mm_storeu_si128((__m128i*)(pOut+i+8), _mm_shuffle_epi32(T, 0xfe)); // c d d d
+#else
+					const uint32x4_t T = vld1q_u32((const uint32_t*)(row + (pU >> 16)));
+					const uint32x4x2_t PAIRS = vzipq_u32(T, T);
+					vst1q_u32((uint32_t*)(pOut+i), vextq_u32(vdupq_n_u32(vgetq_lane_u32(T, 0)), T, 2));
+					vst1q_u32((uint32_t*)(pOut+i+4), vextq_u32(PAIRS.val[0], PAIRS.val[1], 2));
+					vst1q_u32((uint32_t*)(pOut+i+8), vextq_u32(T, vdupq_n_u32(vgetq_lane_u32(T, 3)), 2));
+#endif
+					i+=12;
+					pU+=12*(Uint32)pDu;
+				}
+			}
+#endif
+			for (; i < pCount; ++i){
+				pOut[i] = row[pU >> 16];
+				pU+=(Uint32)pDu;
+			}
+		}
+	} else {
+		const Color32 *base = pImage[0];
+		const Sint32 PITCH = pImage.GetPitch();
+		for (Sint32 i = 0; i < pCount; ++i){
+			pOut[i] = base[(Sint64)(pV >> 16)*PITCH + (pU >> 16)];
+			pU+=(Uint32)pDu;
+			pV+=(Uint32)pDv;
+		}
+	}
+}
+
+//
+// Bilinear
+//
+
+//
+// ChannelLerp
+// Interpolates all four channels by pWeight/256, two
+// channels per multiply.
+//
+static inline Color32 ChannelLerp(Color32 pA, Color32 pB, Uint32 pWeight)
+{
+	const Uint32 W0 = 256 - pWeight;
+	Color32 c;
+	c.value =
+		((((pA.value & 0x00ff00ff) * W0 + (pB.value & 0x00ff00ff) * pWeight) >> 8) & 0x00ff00ff) |
+		((((pA.value >> 8) & 0x00ff00ff) * W0 + ((pB.value >> 8) & 0x00ff00ff) * pWeight) & 0xff00ff00);
+	return c;
+}
+
+//
+// Premultiplied
+// Multiplies the color channels by alpha (rounded, exact
+// division by 255).
+//
+static inline Color32 Premultiplied(Color32 pColor)
+{
+	const Uint32 A = (pColor.value >> GFX_ALPHA_SHIFT) & UCHAR_MAX;
+	const Uint32 ALPHA = (Uint32)UCHAR_MAX << GFX_ALPHA_SHIFT;
+	Uint32 rb = (pColor.value & 0x00ff00ff) * A + 0x00800080;
+	Uint32 ag = ((pColor.value >> 8) & 0x00ff00ff) * A + 0x00800080;
+	rb = ((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff;
+	ag = (ag + ((ag >> 8) & 0x00ff00ff)) & 0xff00ff00;
+	Color32 c;
+	c.value = ((rb | ag) & ~ALPHA) | (pColor.value & ALPHA);
+	return c;
+}
+
+//
+// Unpremultiplied
+// Divides the color channels by alpha, with one division
+// per color.
+//
+static inline Color32 Unpremultiplied(Color32 pColor)
+{
+	const Uint32 A = pColor.channels.alpha;
+	if (A == UCHAR_MAX) { return pColor; }
+	if (A == 0) { return Color32(0, 0, 0, 0); }
+	const Uint32 RECIP = ((Uint32)UCHAR_MAX * 65536 + A / 2) / A;
+	const Uint32 R = (pColor.channels.red * RECIP + 0x8000) >> 16;
+	const Uint32 G = (pColor.channels.green * RECIP + 0x8000) >> 16;
+	const Uint32 B = (pColor.channels.blue * RECIP + 0x8000) >> 16;
+	return Color32((Uint8)(R<UCHAR_MAX ? R : UCHAR_MAX), (Uint8)(G<UCHAR_MAX ? G : UCHAR_MAX), (Uint8)(B<UCHAR_MAX ? B : UCHAR_MAX), (Uint8)A);
+}
+
+//
+// BilinearKeyed
+// Weighs the non-key colors of c00, c10, c01, c11 by their
+// bilinear weights. Returns the key when the key colors
+// carry at least half of the weight.
+//
+static Color32 BilinearKeyed(const Color32 *pColor, Uint32 pWx, Uint32 pWy, Color32 pKey)
+{
+	const Uint32 RGB = ~Color32(0, 0, 0, UCHAR_MAX).value;
+	const Uint32 WEIGHT[4] = { (256-pWx)*(256-pWy), pWx*(256-pWy), (256-pWx)*pWy, pWx*pWy };
+	Uint32 cover = 0, r = 0, g = 0, b = 0, a = 0;
+	for (Sint32 i = 0; i < 4; ++i){
+		if ((pColor[i].value & RGB) != (pKey.value & RGB)) {
+			cover += WEIGHT[i];
+			r += pColor[i].channels.red * WEIGHT[i];
+			g += pColor[i].channels.green * WEIGHT[i];
+			b += pColor[i].channels.blue * WEIGHT[i];
+			a += pColor[i].channels.alpha * WEIGHT[i];
+		}
+	}
+	if (cover < 65536/2) { return pKey; }
+	return Color32((Uint8)((r + cover/2) / cover), (Uint8)((g + cover/2) / cover), (Uint8)((b + cover/2) / cover), (Uint8)((a + cover/2) / cover));
+}
+
+//
+// BilinearFilter
+// Interpolates c00, c10, c01, c11 according to pMode.
+//
+static inline Color32 BilinearFilter(const Color32 *pColor, Uint32 pWx, Uint32 pWy, Bilinear::Mode pMode, Color32 pKey)
+{
+	if (pMode == Bilinear::Keyed) {
+		return BilinearKeyed(pColor, pWx, pWy, pKey);
+	}
+	if (pMode == Bilinear::Premultiply && (pColor[0].channels.alpha & pColor[1].channels.alpha & pColor[2].channels.alpha & pColor[3].channels.alpha) != UCHAR_MAX) {
+		return Unpremultiplied(ChannelLerp(
+			ChannelLerp(Premultiplied(pColor[0]), Premultiplied(pColor[1]), pWx),
+			ChannelLerp(Premultiplied(pColor[2]), Premultiplied(pColor[3]), pWx),
+			pWy));
+	}
+	return ChannelLerp(ChannelLerp(pColor[0], pColor[1], pWx), ChannelLerp(pColor[2], pColor[3], pWx), pWy);
+}
+
+//
+// BilinearTexel
+// Samples pBase (pPitch pixels between rows, MAX_X and MAX_Y
+// the last column and row) at pX, pY with 16-bit fractions.
+// Texels are clamped against the edges.
+//
+static inline Color32 BilinearTexel(const Color32 *pBase, Sint32 pPitch, Sint32 MAX_X, Sint32 MAX_Y, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY, Bilinear::Mode pMode, Color32 pKey)
+{
+	pX = pX < 0 ? 0 : (pX < MAX_X ? pX : MAX_X);
+	pY = pY < 0 ? 0 : (pY < MAX_Y ? pY : MAX_Y);
+	const Sint32 X2 = pX < MAX_X ? pX+1 : pX;
+	const Color32 *row0 = pBase + (Sint64)pY*pPitch;
+	const Color32 *row1 = pY < MAX_Y ? row0 + pPitch : row0;
+	const Color32 c[4] = { row0[pX], row0[X2], row1[pX], row1[X2] };
+	return BilinearFilter(c, (Uint32)pFracX >> 8, (Uint32)pFracY >> 8, pMode, pKey);
+}
+
+//
+// operator()
+// Samples the four closest colors and
+// interpolates between the colors to get the
+// most accurate color.
+//
+Color32 Bilinear::operator()(const Image &pImage, float pU, float pV) const {	
+	const float fU = pU > 0.f ? pU * (pImage.GetWidth() - 1) : 0.f;
+	const float fV = pV > 0.f ? pV * (pImage.GetHeight() - 1) : 0.f;
+	const Sint32 iU = (Sint32)(fU * 65536.f);
+	const Sint32 iV = (Sint32)(fV * 65536.f);
+	return Bilinear::Sample(pImage, iU >> 16, iV >> 16, iU & 0xffff, iV & 0xffff);
+}
+
+//
+// Sample
+// Fixed point version of operator(). Texels are clamped
+// against the edges of the image.
+//
+Color32 Bilinear::Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY) const
+{
+	return BilinearTexel(pImage[0], pImage.GetPitch(), pImage.GetWidth() - 1, pImage.GetHeight() - 1, pX, pY, pFracX, pFracY, mode, key);
+}
+
+//
+// Span
+// Samples a span of colors. Horizontal spans interpolate
+// between the same two rows.
+//
+void Bilinear::Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const
+{
+	const Sint32 MAX_X = pImage.GetWidth() - 1;
+	const Sint32 MAX_Y = pImage.GetHeight() - 1;
+	if (pDv != 0) {
+		const Color32 *base = pImage[0];
+		const Sint32 PITCH = pImage.GetPitch();
+		for (Sint32 i = 0; i < pCount; ++i){
+			pOut[i] = BilinearTexel(base, PITCH, MAX_X, MAX_Y, (Sint32)(pU >> 16), (Sint32)(pV >> 16), (Sint32)(pU & 0xffff), (Sint32)(pV & 0xffff), mode, key);
+			pU+=(Uint32)pDu;
+			pV+=(Uint32)pDv;
+		}
+		return;
+	}
+	const Sint32 Y = (Sint32)(pV >> 16) < MAX_Y ? (Sint32)(pV >> 16) : MAX_Y;
+	const Color32 *row0 = pImage[Y];
+	const Color32 *row1 = pImage[Y < MAX_Y ? Y+1 : Y];
+	const Uint32 WY = (pV >> 8) & UCHAR_MAX;
+	for (Sint32 i = 0; i < pCount; ++i){
+		const Sint32 x = (Sint32)(pU >> 16) < MAX_X ? (Sint32)(pU >> 16) : MAX_X;
+		const Sint32 x2 = x < MAX_X ? x+1 : x;
+		const Uint32 WX = (pU >> 8) & UCHAR_MAX;
+		if (mode == Straight) {
+			pOut[i] = ChannelLerp(ChannelLerp(row0[x], row0[x2], WX), ChannelLerp(row1[x], row1[x2], WX), WY);
+		} else {
+			const Color32 c[4] = { row0[x], row0[x2], row1[x], row1[x2] };
+			pOut[i] = BilinearFilter(c, WX, WY, mode, key);
+		}
+		pU+=(Uint32)pDu;
+	}
+}
+
+//
+// FilterRow
+// Horizontal pass: interpolates source row pY (clamped) for
+// pCount destination pixels, premultiplied in Premultiply
+// mode. Not for Keyed.
+//
+void Bilinear::FilterRow(const Image &pImage, Uint32 pU, Sint32 pDu, Sint32 pY, Color32 *pOut, Sint32 pCount) const
+{
+	const Sint32 MAX_X = pImage.GetWidth() - 1;
+	const Sint32 MAX_Y = pImage.GetHeight() - 1;
+	const Color32 *row = pImage[pY < MAX_Y ? pY : MAX_Y];
+	for (Sint32 i = 0; i < pCount; ++i){
+		const Sint32 x = (Sint32)(pU >> 16) < MAX_X ? (Sint32)(pU >> 16) : MAX_X;
+		const Sint32 x2 = x < MAX_X ? x+1 : x;
+		const Uint32 WX = (pU >> 8) & UCHAR_MAX;
+		if (mode == Straight) {
+			pOut[i] = ChannelLerp(row[x], row[x2], WX);
+		} else {
+			pOut[i] = ChannelLerp(Premultiplied(row[x]), Premultiplied(row[x2]), WX);
+		}
+		pU+=(Uint32)pDu;
+	}
+}
+
+//
+// LerpRows
+// Vertical pass: ChannelLerp of two rows from FilterRow,
+// unpremultiplied again in Premultiply mode. Opaque texels
+// premultiply to themselves, so the result matches Span.
+//
+void Bilinear::LerpRows(const Color32 *pRow0, const Color32 *pRow1, Uint32 pWeight, Color32 *pOut, Sint32 pCount) const
+{
+	Sint32 i = 0;
+	if (pWeight == 0) {
+		if (pOut != pRow0) { memcpy((void*)pOut, (const void*)pRow0, pCount*sizeof(Color32)); }
+		i = pCount;
+	}
+#if defined(GFX_AVX2)
+	{
+		const __m256i ZERO = _mm256_setzero_si256();
+		const __m256i W0 = _mm256_set1_epi16((short)(256 - pWeight));
+		const __m256i W1 = _mm256_set1_epi16((short)pWeight);
+		for (; i+8 <= pCount; i+=8){
+			const __m256i a = _mm256_loadu_si256((const __m256i*)(pRow0+i));
+			const __m256i b = _mm256_loadu_si256((const __m256i*)(pRow1+i));
+			const __m256i lo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(a, ZERO), W0), _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, ZERO), W1)), 8);
+			const __m256i hi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(a, ZERO), W0), _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, ZERO), W1)), 8);
+			_mm256_storeu_si256((__m256i*)(pOut+i), _mm256_packus_epi16(lo, hi));
+		}
+	}
+#endif
+#if defined(GFX_SSE2)
+	{
+		const __m128i ZERO = _mm_setzero_si128();
+		const __m128i W0 = _mm_set1_epi16((short)(256 - pWeight));
+		const __m128i W1 = _mm_set1_epi16((short)pWeight);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i a = _mm_loadu_si128((const __m128i*)(pRow0+i));
+			const __m128i b = _mm_loadu_si128((const __m128i*)(pRow1+i));
+			const __m128i lo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(a, ZERO), W0), _mm_mullo_epi16(_mm_unpacklo_epi8(b, ZERO), W1)), 8);
+			const __m128i hi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(a, ZERO), W0), _mm_mullo_epi16(_mm_unpackhi_epi8(b, ZERO), W1)), 8);
+			_mm_storeu_si128((__m128i*)(pOut+i), _mm_packus_epi16(lo, hi));
+		}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint8x8_t W0 = vdup_n_u8((uint8_t)(256 - pWeight)); // pWeight is not 0 here
+		const uint8x8_t W1 = vdup_n_u8((uint8_t)pWeight);
+		for (; i+4 <= pCount; i+=4){
+			const uint8x16_t a = vld1q_u8((const uint8_t*)(pRow0+i));
+			const uint8x16_t b = vld1q_u8((const uint8_t*)(pRow1+i));
+			const uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(a), W0), vget_low_u8(b), W1);
+			const uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(a), W0), vget_high_u8(b), W1);
+			vst1q_u8((uint8_t*)(pOut+i), vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		pOut[i] = ChannelLerp(pRow0[i], pRow1[i], pWeight);
+	}
+	if (mode == Premultiply) {
+		for (i = 0; i < pCount; ++i){
+			pOut[i] = Unpremultiplied(pOut[i]);
+		}
+	}
+}
+
+//
+// Mip sampling
+//
+
+//
+// MipLevel
+// Picks the mip level where a destination pixel covers less
+// than two texels. pWeight is how far (0 to 255) the
+// footprint is towards the next level, which is 0 when
+// there is no next level or the blit magnifies.
+//
+static const Image &MipLevel(const Image &pImage, Sint32 pFootprint, Sint32 &pLevel, Sint32 &pWeight)
+{
+	const Image *level = &pImage;
+	pLevel = 0;
+	while (level->GetMip(1) != level && (pFootprint >> (17 + pLevel)) != 0) {
+		level = level->GetMip(1);
+		++pLevel;
+	}
+	const Sint32 SCALE = pFootprint >> pLevel; // texels per pixel at this level, 16.16
+	pWeight = (level->GetMip(1) != level && SCALE > 0x10000) ? ((SCALE - 0x10000) >> 8) : 0;
+	pWeight = pWeight < 255 ? pWeight : 255;
+	return *level;
+}
+
+//
+// Filter
+// Box: Reads the nearest texel of the closest level.
+//
+void Box::Filter(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Sint32 pFootprint, Color32 *pOut, Sint32 pCount) const
+{
+	Sint32 level, weight;
+	const Image *mip = &MipLevel(pImage, pFootprint, level, weight);
+	if (weight >= 128) {
+		mip = mip->GetMip(1);
+		++level;
+	}
+	if (level == 0) {
+		Span(pImage, pU, pV, pDu, pDv, pOut, pCount);
+		return;
+	}
+	const Sint32 SHIFT = 16 + level;
+	const Sint32 MAX_X = mip->GetWidth() - 1;
+	const Sint32 MAX_Y = mip->GetHeight() - 1;
+	for (Sint32 i = 0; i < pCount; ++i){
+		const Sint32 x = (Sint32)(pU >> SHIFT), y = (Sint32)(pV >> SHIFT); // odd sizes lose the last texel on every level
+		pOut[i] = (*mip)[y<MAX_Y ? y : MAX_Y][x<MAX_X ? x : MAX_X];
+		pU+=(Uint32)pDu;
+		pV+=(Uint32)pDv;
+	}
+}
+
+//
+// Filter
+// Trilinear: Blends bilinear samples of the two levels
+// around the footprint.
+//
+void Trilinear::Filter(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Sint32 pFootprint, Color32 *pOut, Sint32 pCount) const
+{
+	Sint32 level, weight;
+	const Image &fine = MipLevel(pImage, pFootprint, level, weight);
+	if (level == 0 && weight == 0) {
+		Span(pImage, pU, pV, pDu, pDv, pOut, pCount);
+		return;
+	}
+	const Image &coarse = *fine.GetMip(1);
+	for (Sint32 i = 0; i < pCount; ++i){
+		Color32 c[2];
+		for (Sint32 l = 0; l < (weight > 0 ? 2 : 1); ++l){
+			const Image &mip = l == 0 ? fine : coarse;
+			const Uint32 u = pU >> (level + l), v = pV >> (level + l);
+			const Sint32 x = (Sint32)(u >> 16) < mip.GetWidth() ? (Sint32)(u >> 16) : mip.GetWidth() - 1;
+			const Sint32 y = (Sint32)(v >> 16) < mip.GetHeight() ? (Sint32)(v >> 16) : mip.GetHeight() - 1;
+			c[l] = Bilinear::Sample(mip, x, y, (Sint32)(u & 0xffff), (Sint32)(v & 0xffff));
+		}
+		pOut[i] = weight > 0 ? ChannelLerp(c[0], c[1], (Uint32)weight) : c[0];
+		pU+=(Uint32)pDu;
+		pV+=(Uint32)pDv;
+	}
+}
+
+//
+// Native file format
+// Version 1 files start with a header of six 32-bit fields
+// (magic, version, flags, width, height, tile size), then
+// one 64-bit offset per tile plus an end offset, relative to
+// the first tile, and then the tiles in row order. Edge
+// tiles are cropped to the image. A tile that is smaller
+// than its raw size is compressed, otherwise it is stored.
+// Legacy files (type size, width, height, rows) start with
+// sizeof(Color32), which can never be the magic number.
+//
+static const Uint32 FileMagic = 0x54584647; // "GFXT"
+static const Uint32 FileVersion = 1;
+static const Uint32 FileCompressed = 1; // flag, tiles were written compressed where it paid off
+static const Uint32 FilePremultiplied = 2; // flag, colors are premultiplied by alpha
+
+struct FileHeader
+{
+	Sint32 width, height;
+	Sint32 tile; // 0 for legacy files
+	Sint32 tilesX, tilesY;
+	Uint32 flags;
+	Sint64 dataStart;
+};
+
+//
+// ReadHeader
+// Reads and validates the header of a native file, including
+// the tile index of tiled files. pFileSize is the size of the
+// file, used to reject truncated files.
+//
+static bool ReadHeader(std::ifstream &pIn, Uint64 pFileSize, FileHeader &pHeader, std::vector<Uint64> &pIndex)
+{
+	Uint32 field[6] = {0, 0, 0, 0, 0, 0};
+	pIn.read((char*)field, sizeof(Uint32)*3);
+	if (!pIn.good()) { return false; }
+	
+	pHeader.flags = 0;
+	pHeader.tile = 0;
+	pHeader.tilesX = pHeader.tilesY = 0;
+	pIndex.clear();
+	if (field[0] == sizeof(Color32)) {
+		pHeader.width = (Sint32)field[1];
+		pHeader.height = (Sint32)field[2];
+		pHeader.dataStart = sizeof(Uint32)*3;
+		if (pHeader.width <= 0 || pHeader.width > Image::MaxDimension || pHeader.height <= 0 || pHeader.height > Image::MaxDimension) { return false; }
+		return pFileSize >= (Uint64)(pHeader.dataStart + (Sint64)pHeader.width*pHeader.height*(Sint64)sizeof(Color32));
+	}
+	if (field[0] != FileMagic || field[1] == 0 || field[1] > FileVersion) { return false; }
+	
+	pIn.read((char*)(field+3), sizeof(Uint32)*3);
+	if (!pIn.good()) { return false; }
+	pHeader.flags = field[2];
+	pHeader.width = (Sint32)field[3];
+	pHeader.height = (Sint32)field[4];
+	pHeader.tile = (Sint32)field[5];
+	if (pHeader.width <= 0 || pHeader.width > Image::MaxDimension || pHeader.height <= 0 || pHeader.height > Image::MaxDimension || pHeader.tile <= 0 || pHeader.tile > Image::TileSize) { return false; }
+	pHeader.tilesX = (pHeader.width + pHeader.tile - 1) / pHeader.tile;
+	pHeader.tilesY = (pHeader.height + pHeader.tile - 1) / pHeader.tile;
+	
+	const Sint64 COUNT = (Sint64)pHeader.tilesX * pHeader.tilesY;
+	pHeader.dataStart = sizeof(Uint32)*6 + (COUNT+1)*(Sint64)sizeof(Uint64);
+	if (pFileSize < (Uint64)pHeader.dataStart) { return false; }
+	pIndex.resize((size_t)COUNT+1);
+	pIn.read((char*)&pIndex[0], (std::streamsize)(pIndex.size()*sizeof(Uint64)));
+	if (!pIn.good() || pIndex[0] != 0 || pIndex[(size_t)COUNT] > pFileSize - (Uint64)pHeader.dataStart) { return false; }
+	for (Sint64 i = 0; i < COUNT; ++i){
+		const Sint32 tx = (Sint32)(i % pHeader.tilesX), ty = (Sint32)(i / pHeader.tilesX);
+		const Sint32 tw = (pHeader.width - tx*pHeader.tile) < pHeader.tile ? (pHeader.width - tx*pHeader.tile) : pHeader.tile;
+		const Sint32 th = (pHeader.height - ty*pHeader.tile) < pHeader.tile ? (pHeader.height - ty*pHeader.tile) : pHeader.tile;
+		if (pIndex[(size_t)i+1] < pIndex[(size_t)i] || pIndex[(size_t)i+1] - pIndex[(size_t)i] > (Uint64)tw*th*sizeof(Color32)) { return false; }
+	}
+	return true;
+}
+
+//
+// Tile compression
+// Byte oriented LZ77 in the LZ4 block format: a token with
+// literal and match lengths, the literals, a 16-bit offset,
+// and 255-byte length extensions. The last 5 bytes are always
+// literals. Tiles are small, so a single pass greedy match
+// on a 4096 entry hash table is enough.
+//
+static const Sint32 LzMinMatch = 4;
+static const Sint32 LzLastLiterals = 5;
+static const Sint32 LzMatchLimit = 12; // no match starts in the last 12 bytes
+static const Sint32 LzHashBits = 12;
+
+static inline Uint32 LzRead32(const Uint8 *pSrc)
+{
+	Uint32 value;
+	memcpy(&value, pSrc, sizeof(value));
+	return value;
+}
+
+static inline bool LzLength(Uint8 *&pOut, const Uint8 *pEnd, Sint32 pLength)
+{
+	for (; pLength >= 255; pLength -= 255){
+		if (pOut >= pEnd) { return false; }
+		*pOut++ = 255;
+	}
+	if (pOut >= pEnd) { return false; }
+	*pOut++ = (Uint8)pLength;
+	return true;
+}
+
+//
+// LzCompress
+// Compresses pSize bytes into pOut. Returns the compressed
+// size, or 0 if it does not fit in pCapacity bytes.
+//
+static Sint32 LzCompress(const Uint8 *pSrc, Sint32 pSize, Uint8 *pOut, Sint32 pCapacity)
+{
+	Sint32 table[1<<LzHashBits];
+	for (Sint32 i = 0; i < (1<<LzHashBits); ++i){
+		table[i] = -1;
+	}
+	
+	Uint8 *out = pOut;
+	const Uint8 *END = pOut + pCapacity;
+	Sint32 ip = 0, anchor = 0;
+	const Sint32 LIMIT = pSize - LzMatchLimit;
+	while (ip < LIMIT) {
+		const Uint32 seq = LzRead32(pSrc + ip);
+		const Uint32 h = (seq * 2654435761u) >> (32 - LzHashBits);
+		const Sint32 ref = table[h];
+		table[h] = ip;
+		if (ref < 0 || ip - ref > 65535 || LzRead32(pSrc + ref) != seq) {
+			++ip;
+			continue;
+		}
+		Sint32 length = LzMinMatch;
+		while (ip + length < pSize - LzLastLiterals && pSrc[ref + length] == pSrc[ip + length]) { ++length; }
+		
+		const Sint32 literals = ip - anchor;
+		if (out >= END) { return 0; }
+		Uint8 *token = out++;
+		*token = (Uint8)(((literals < 15 ? literals : 15) << 4) | ((length - LzMinMatch) < 15 ? (length - LzMinMatch) : 15));
+		if (literals >= 15 && !LzLength(out, END, literals - 15)) { return 0; }
+		if (END - out < literals + 2) { return 0; }
+		memcpy(out, pSrc + anchor, literals);
+		out += literals;
+		*out++ = (Uint8)((ip - ref) & 0xFF);
+		*out++ = (Uint8)((ip - ref) >> 8);
+		if (length - LzMinMatch >= 15 && !LzLength(out, END, length - LzMinMatch - 15)) { return 0; }
+		ip += length;
+		anchor = ip;
+	}
+	
+	const Sint32 literals = pSize - anchor;
+	if (out >= END) { return 0; }
+	*out++ = (Uint8)((literals < 15 ? literals : 15) << 4);
+	if (literals >= 15 && !LzLength(out, END, literals - 15)) { return 0; }
+	if (END - out < literals) { return 0; }
+	memcpy(out, pSrc + anchor, literals);
+	out += literals;
+	return (Sint32)(out - pOut);
+}
+
+//
+// LzDecompress
+// Decompresses exactly pSize bytes into pOut. Every length
+// and offset is checked, so corrupt data fails instead of
+// reading or writing out of bounds.
+//
+static bool LzDecompress(const Uint8 *pSrc, Sint64 pCount, Uint8 *pOut, Sint32 pSize)
+{
+	const Uint8 *END = pSrc + pCount;
+	Sint32 op = 0;
+	for (;;) {
+		if (pSrc >= END) { return false; }
+		const Uint8 token = *pSrc++;
+		Sint32 literals = token >> 4;
+		if (literals == 15) {
+			Uint8 ext;
+			do {
+				if (pSrc >= END) { return false; }
+				ext = *pSrc++;
+				literals += ext;
+			} while (ext == 255 && literals < pSize);
+		}
+		if (literals > END - pSrc || literals > pSize - op) { return false; }
+		memcpy(pOut + op, pSrc, literals);
+		pSrc += literals;
+		op += literals;
+		if (pSrc == END) { return op == pSize; } // last sequence has no match
+		
+		if (END - pSrc < 2) { return false; }
+		const Sint32 offset = pSrc[0] | (pSrc[1] << 8);
+		pSrc += 2;
+		Sint32 length = token & 15;
+		if (length == 15) {
+			Uint8 ext;
+			do {
+				if (pSrc >= END) { return false; }
+				ext = *pSrc++;
+				length += ext;
+			} while (ext == 255 && length < pSize);
+		}
+		length += LzMinMatch;
+		if (offset == 0 || offset > op || length > pSize - op) { return false; }
+		const Uint8 *match = pOut + op - offset;
+		for (Sint32 i = 0; i < length; ++i){ // matches may overlap themselves
+			pOut[op+i] = match[i];
+		}
+		op += length;
+	}
+}
+
+//
+// DecodeTile
+// Unpacks one tile of pW x pH pixels from pData into pOut,
+// which is pPitch pixels between rows.
+//
+static bool DecodeTile(const Uint8 *pData, Uint64 pCount, Sint32 pW, Sint32 pH, Color32 *pOut, Sint32 pPitch)
+{
+	const Sint32 RAW = pW*pH*(Sint32)sizeof(Color32);
+	Color32 tile[Image::TileSize*Image::TileSize];
+	if (pCount != (Uint64)RAW) {
+		if (!LzDecompress(pData, (Sint64)pCount, (Uint8*)tile, RAW)) { return false; }
+		pData = (const Uint8*)tile;
+	}
+	for (Sint32 y = 0; y < pH; ++y){
+		memcpy((void*)(pOut + (Sint64)y*pPitch), pData + y*pW*sizeof(Color32), pW*sizeof(Color32));
+	}
+	return true;
+}
+
+//
+// TileJob
+// Decodes a range of tiles from memory into an image for
+// Image::Load and Image::Stream::DecodeBand. Job tiles are
+// numbered from tile (tx1, ty1) of the file, and index may
+// start at tile number first rather than at the first tile.
+// Failures are counted per thread so that workers never
+// write to the same memory.
+//
+struct TileJob
+{
+	const Uint8 *data;
+	const Uint64 *index;
+	size_t first;
+	Color32 *dst;
+	Sint32 pitch;
+	Sint32 width, height, tile, tilesX;
+	Sint32 tx1, ty1, columns;
+	Sint32 fail[GfxMaxThreads+1];
+};
+
+static void TileRows(void *pJob, Sint32 pT1, Sint32 pT2, Sint32 pThread)
+{
+	TileJob &job = *(TileJob*)pJob;
+	for (Sint32 t = pT1; t < pT2; ++t){
+		const Sint32 cx = t % job.columns, cy = t / job.columns;
+		const Sint32 tx = job.tx1 + cx, ty = job.ty1 + cy;
+		const Sint32 tw = (job.width - tx*job.tile) < job.tile ? (job.width - tx*job.tile) : job.tile;
+		const Sint32 th = (job.height - ty*job.tile) < job.tile ? (job.height - ty*job.tile) : job.tile;
+		const size_t i = (size_t)ty*job.tilesX + tx - job.first;
+		Color32 *out = job.dst + (Sint64)cy*job.tile*job.pitch + cx*job.tile;
+		if (!DecodeTile(job.data + job.index[i], job.index[i+1] - job.index[i], tw, th, out, job.pitch)) {
+			++job.fail[pThread];
+		}
+	}
+}
+
+static bool TileFailed(const TileJob &pJob)
+{
+	for (Sint32 i = 0; i <= GfxMaxThreads; ++i){
+		if (pJob.fail[i] != 0) { return true; }
+	}
+	return false;
+}
+
+//
+// Surface conversion
+//
+
+//
+// PixelSwizzle
+// How Convert turns surface pixels into Color32. index[k] is
+// the byte of a source pixel that goes to byte k of a Color32
+// (-1 for opaque alpha); shift, mask and loss describe the
+// channels of packed 16-bit pixels in SDL terms, in red,
+// green, blue, alpha order.
+//
+struct PixelSwizzle
+{
+	Sint32 index[4];
+	Sint32 channel[4]; // channel (0-3 for red to alpha) held by byte k of a Color32
+	Uint32 shift[4], mask[4], loss[4];
+	Color32 palette[256];
+	const SDL_PixelFormat *format;
+};
+
+typedef void (*ConvertFunc)(const PixelSwizzle &pSwizzle, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount);
+
+//
+// SwizzleBytes
+// Moves the bytes of pCount pixels of pBytes bytes each into
+// Color32 pixels. pDst may be pSrc for 4-byte pixels. A
+// pshufb (or NEON deinterleave) per 4 pixels where available.
+//
+static void SwizzleBytes(const Sint32 *pIndex, Sint32 pBytes, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount)
+{
+	Sint32 i = 0;
+#if defined(GFX_SSSE3)
+	{
+		Uint8 control[32];
+		Uint8 fill[16];
+		for (Sint32 p = 0; p < 4; ++p){
+			for (Sint32 k = 0; k < 4; ++k){
+				control[p*4+k] = pIndex[k] < 0 ? 0x80 : (Uint8)(p*pBytes + pIndex[k]);
+				control[16+p*4+k] = control[p*4+k];
+				fill[p*4+k] = pIndex[k] < 0 ? UCHAR_MAX : 0;
+			}
+		}
+		const __m128i CONTROL = _mm_loadu_si128((const __m128i*)control);
+		const __m128i FILL = _mm_loadu_si128((const __m128i*)fill);
+		if (pBytes == 4) {
+#ifdef GFX_AVX2
+			const __m256i CONTROL2 = _mm256_loadu_si256((const __m256i*)control);
+			const __m256i FILL2 = _mm256_inserti128_si256(_mm256_castsi128_si256(FILL), FILL, 1);
+			for (; i+8 <= pCount; i+=8){
+				const __m256i s = _mm256_loadu_si256((const __m256i*)(pSrc + i*4));
+				_mm256_storeu_si256((__m256i*)(pDst+i), _mm256_or_si256(_mm256_shuffle_epi8(s, CONTROL2), FILL2));
+			}
+#endif
+			for (; i+4 <= pCount; i+=4){
+				const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i*4));
+				_mm_storeu_si128((__m128i*)(pDst+i), _mm_or_si128(_mm_shuffle_epi8(s, CONTROL), FILL));
+			}
+		} else {
+			for (; i+6 <= pCount; i+=4){ // the 16-byte load reads 4 bytes past the 4 pixels
+				const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i*3));
+				_mm_storeu_si128((__m128i*)(pDst+i), _mm_or_si128(_mm_shuffle_epi8(s, CONTROL), FILL));
+			}
+		}
+	}
+#elif defined(GFX_SSE2)
+	if (pBytes == 4) {
+		__m128i fill = _mm_setzero_si128();
+		for (Sint32 k = 0; k < 4; ++k){
+			if (pIndex[k] < 0) { fill = _mm_or_si128(fill, _mm_set1_epi32((int)(0xffu << (k*8)))); }
+		}
+		const __m128i BYTE = _mm_set1_epi32(UCHAR_MAX);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i s = _mm_loadu_si128((const __m128i*)(pSrc + i*4));
+			__m128i d = fill;
+			for (Sint32 k = 0; k < 4; ++k){
+				if (pIndex[k] < 0) { continue; }
+				const __m128i c = _mm_and_si128(_mm_srl_epi32(s, _mm_cvtsi32_si128(pIndex[k]*8)), BYTE);
+				d = _mm_or_si128(d, _mm_sll_epi32(c, _mm_cvtsi32_si128(k*8)));
+			}
+			_mm_storeu_si128((__m128i*)(pDst+i), d);
+		}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint8x16_t OPAQUE = vdupq_n_u8(UCHAR_MAX);
+		if (pBytes == 4) {
+			for (; i+16 <= pCount; i+=16){
+				const uint8x16x4_t s = vld4q_u8(pSrc + i*4);
+				uint8x16x4_t d;
+				for (Sint32 k = 0; k < 4; ++k){
+					d.val[k] = pIndex[k] < 0 ? OPAQUE : s.val[pIndex[k]];
+				}
+				vst4q_u8((uint8_t*)(pDst+i), d);
+			}
+		} else {
+			for (; i+16 <= pCount; i+=16){
+				const uint8x16x3_t s = vld3q_u8(pSrc + i*3);
+				uint8x16x4_t d;
+				for (Sint32 k = 0; k < 4; ++k){
+					d.val[k] = pIndex[k] < 0 ? OPAQUE : s.val[pIndex[k]];
+				}
+				vst4q_u8((uint8_t*)(pDst+i), d);
+			}
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		Uint8 s[4];
+		memcpy(s, pSrc + i*pBytes, pBytes);
+		Uint8 *d = (Uint8*)(pDst+i);
+		for (Sint32 k = 0; k < 4; ++k){
+			d[k] = pIndex[k] < 0 ? UCHAR_MAX : s[pIndex[k]];
+		}
+	}
+}
+
+static void ConvertBytes(const PixelSwizzle &pSwizzle, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount)
+{
+	SwizzleBytes(pSwizzle.index, pSwizzle.format->BytesPerPixel, pSrc, pDst, pCount);
+}
+
+//
+// ConvertPalette
+// 8-bit pixels through a table built from the palette.
+//
+static void ConvertPalette(const PixelSwizzle &pSwizzle, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount)
+{
+	for (Sint32 i = 0; i < pCount; ++i){
+		pDst[i] = pSwizzle.palette[pSrc[i]];
+	}
+}
+
+//
+// ConvertPacked
+// 16-bit pixels (565, 555, 4444 and the like). Channels are
+// widened to 8 bits the way SDL_GetRGBA does, eight pixels
+// at a time where available.
+//
+static void ConvertPacked(const PixelSwizzle &pSwizzle, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount)
+{
+	Sint32 i = 0;
+#if defined(GFX_SSE2)
+	for (; i+8 <= pCount; i+=8){
+		const __m128i p = _mm_loadu_si128((const __m128i*)(pSrc + i*2));
+		__m128i c[4];
+		for (Sint32 k = 0; k < 4; ++k){
+			if (pSwizzle.mask[k] == 0) {
+				c[k] = _mm_set1_epi16(UCHAR_MAX);
+				continue;
+			}
+			const __m128i v = _mm_srl_epi16(_mm_and_si128(p, _mm_set1_epi16((short)pSwizzle.mask[k])), _mm_cvtsi32_si128(pSwizzle.shift[k]));
+			c[k] = _mm_or_si128(_mm_sll_epi16(v, _mm_cvtsi32_si128(pSwizzle.loss[k])), _mm_srl_epi16(v, _mm_cvtsi32_si128(8 - 2*pSwizzle.loss[k])));
+		}
+		const __m128i LO = _mm_or_si128(c[pSwizzle.channel[0]], _mm_slli_epi16(c[pSwizzle.channel[1]], 8));
+		const __m128i HI = _mm_or_si128(c[pSwizzle.channel[2]], _mm_slli_epi16(c[pSwizzle.channel[3]], 8));
+		_mm_storeu_si128((__m128i*)(pDst+i), _mm_unpacklo_epi16(LO, HI));
+		_mm_storeu_si128((__m128i*)(pDst+i+4), _mm_unpackhi_epi16(LO, HI));
+	}
+#elif defined(GFX_NEON)
+	for (; i+8 <= pCount; i+=8){
+		const uint16x8_t p = vld1q_u16((const uint16_t*)(pSrc + i*2));
+		uint8x8_t c[4];
+		for (Sint32 k = 0; k < 4; ++k){
+			if (pSwizzle.mask[k] == 0) {
+				c[k] = vdup_n_u8(UCHAR_MAX);
+				continue;
+			}
+			const uint16x8_t v = vshlq_u16(vandq_u16(p, vdupq_n_u16((uint16_t)pSwizzle.mask[k])), vdupq_n_s16(-(int16_t)pSwizzle.shift[k]));
+			c[k] = vmovn_u16(vorrq_u16(vshlq_u16(v, vdupq_n_s16((int16_t)pSwizzle.loss[k])), vshlq_u16(v, vdupq_n_s16((int16_t)(2*pSwizzle.loss[k]) - 8))));
+		}
+		uint8x8x4_t d;
+		for (Sint32 k = 0; k < 4; ++k){
+			d.val[k] = c[pSwizzle.channel[k]];
+		}
+		vst4_u8((uint8_t*)(pDst+i), d);
+	}
+#endif
+	for (; i < pCount; ++i){
+		Uint16 p;
+		memcpy(&p, pSrc + i*2, sizeof(p));
+		Uint8 c[4];
+		for (Sint32 k = 0; k < 4; ++k){
+			const Uint32 V = (p & pSwizzle.mask[k]) >> pSwizzle.shift[k];
+			c[k] = pSwizzle.mask[k] == 0 ? UCHAR_MAX : (Uint8)((V << pSwizzle.loss[k]) | (V >> (8 - 2*pSwizzle.loss[k])));
+		}
+		pDst[i] = Color32(c[0], c[1], c[2], c[3]);
+	}
+}
+
+//
+// ConvertGeneric
+// Any other format, one SDL_GetRGBA per pixel. Pixels are read
+// with their actual size.
+//
+static void ConvertGeneric(const PixelSwizzle &pSwizzle, const Uint8 *pSrc, Color32 *pDst, Sint32 pCount)
+{
+	const Sint32 BYTES = pSwizzle.format->BytesPerPixel;
+	for (Sint32 i = 0; i < pCount; ++i){
+		const Uint8 *spix = pSrc + i*BYTES;
+		Uint32 value = 0;
+		switch (BYTES) {
+		case 1: value = *spix; break;
+		case 2: { Uint16 v; memcpy(&v, spix, sizeof(v)); value = v; } break;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+		case 3: value = spix[0] | (spix[1] << 8) | (spix[2] << 16); break;
+#else
+		case 3: value = (spix[0] << 16) | (spix[1] << 8) | spix[2]; break;
+#endif
+		default: memcpy(&value, spix, sizeof(value)); break;
+		}
+		SDL_GetRGBA(value, pSwizzle.format, &pDst[i].channels.red, &pDst[i].channels.green, &pDst[i].channels.blue, &pDst[i].channels.alpha);
+	}
+}
+
+//
+// ChannelByte
+// Byte of a pixel of pBytes bytes holding the 8-bit channel
+// pMask (SDL masks are in the native byte order). Returns -1
+// if the channel is not a whole byte.
+//
+static Sint32 ChannelByte(Uint32 pMask, Uint32 pShift, Sint32 pBytes)
+{
+	if (pShift % 8 != 0 || pMask != (Uint32)UCHAR_MAX << pShift || (Sint32)pShift/8 >= pBytes) { return -1; }
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+	return (Sint32)pShift/8;
+#else
+	return pBytes - 1 - (Sint32)pShift/8;
+#endif
+}
+
+//
+// PickConverter
+// Fills pSwizzle for pFormat and returns the row converter.
+//
+static ConvertFunc PickConverter(const SDL_PixelFormat *pFormat, PixelSwizzle &pSwizzle)
+{
+	pSwizzle.format = pFormat;
+	const Uint32 MASK[4] = { pFormat->Rmask, pFormat->Gmask, pFormat->Bmask, pFormat->Amask };
+	const Uint32 SHIFT[4] = { pFormat->Rshift, pFormat->Gshift, pFormat->Bshift, pFormat->Ashift };
+	const Uint32 LOSS[4] = { pFormat->Rloss, pFormat->Gloss, pFormat->Bloss, pFormat->Aloss };
+	Color32 probe;
+	Uint8 *channel[4] = { &probe.channels.red, &probe.channels.green, &probe.channels.blue, &probe.channels.alpha };
+	for (Sint32 c = 0; c < 4; ++c){
+		pSwizzle.channel[channel[c] - (Uint8*)&probe] = c;
+		pSwizzle.shift[c] = SHIFT[c];
+		pSwizzle.mask[c] = MASK[c];
+		pSwizzle.loss[c] = LOSS[c];
+	}
+	
+	const Sint32 BYTES = pFormat->BytesPerPixel;
+	if (BYTES == 1 && pFormat->palette != (SDL_Palette*)0) {
+		for (Sint32 i = 0; i < 256; ++i){
+			pSwizzle.palette[i] = Color32(0, 0, 0);
+		}
+		const Sint32 COUNT = pFormat->palette->ncolors < 256 ? pFormat->palette->ncolors : 256;
+		for (Sint32 i = 0; i < COUNT; ++i){
+			const SDL_Color &c = pFormat->palette->colors[i];
+			pSwizzle.palette[i] = Color32(c.r, c.g, c.b); // SDL_GetRGBA reports palette colors as opaque
+		}
+		return ConvertPalette;
+	}
+	if (BYTES == 2) {
+		for (Sint32 c = 0; c < 4; ++c){
+			if (MASK[c] != 0 && LOSS[c] > 4) { return ConvertGeneric; }
+		}
+		return ConvertPacked;
+	}
+	if (BYTES == 3 || BYTES == 4) {
+		for (Sint32 k = 0; k < 4; ++k){
+			const Sint32 C = pSwizzle.channel[k];
+			if (C == 3 && MASK[3] == 0) {
+				pSwizzle.index[k] = -1;
+				continue;
+			}
+			pSwizzle.index[k] = ChannelByte(MASK[C], SHIFT[C], BYTES);
+			if (pSwizzle.index[k] < 0) { return ConvertGeneric; }
+		}
+		return ConvertBytes;
+	}
+	return ConvertGeneric;
+}
+
+//
+// ConvertJob
+// Converts a band of surface rows for Image::Convert.
+//
+struct ConvertJob
+{
+	const Uint8 *src;
+	Sint32 pitch;
+	ImageView dst;
+	const PixelSwizzle *swizzle;
+	ConvertFunc convert;
+};
+
+static void ConvertRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const ConvertJob &job = *(const ConvertJob*)pJob;
+	for (Sint32 y = pY1; y < pY2; ++y){
+		job.convert(*job.swizzle, job.src + (Sint64)y*job.pitch, job.dst[y], job.dst.GetWidth());
+	}
+}
+
+//
+// Image
+//
+
+//
+// Release
+// Returns the pixel memory. Memory given to SetMemory was
+// allocated by the caller with new [].
+//
+void Image::Release( void )
+{
+	if (memory != (void*)0) {
+		GfxRelease(memory, capacity);
+	} else {
+		delete [] pixels;
+	}
+	memory = (void*)0;
+	capacity = 0;
+}
+
+//
+// Free
+// Frees the data allocated for the image.
+//
+void Image::Free( void )
+{
+	Release();
+	pixels = (Color32*)0;
+	width = 0;
+	height = 0;
+	pitch = 0;
+	damage.clear();
+	FreeMips();
+	premultiplied = false;
+}
+
+//
+// Create
+// Allocated data for the image. Rows are padded to a multiple
+// of RowAlign pixels, and a buffer of the same size that was
+// recently freed is reused.
+//
+bool Image::Create(Sint32 pWidth, Sint32 pHeight)
+{
+	Free();
+	if (pWidth > 0 && pWidth <= Image::MaxDimension && pHeight > 0 && pHeight <= Image::MaxDimension) {
+		const Sint32 PITCH = (pWidth + Image::RowAlign - 1) / Image::RowAlign * Image::RowAlign;
+		const Uint64 BYTES = (Uint64)PITCH*(Uint64)pHeight*sizeof(Color32);
+		if (BYTES == (Uint64)(size_t)BYTES) {
+			memory = GfxAllocate((size_t)BYTES);
+		}
+		if (memory != (void*)0) {
+			capacity = (size_t)BYTES;
+			pixels = (Color32*)memory;
+			width = pWidth;
+			height = pHeight;
+			pitch = PITCH;
+			Damage(0, 0, width, height);
+		} else {
+			std::ostringstream sout;
+			sout << "0x" << this << ": Out of memory";
+			SDL_SetError(sout.str().c_str());
+		}
+	} else {
+		std::ostringstream sout;
+		sout << "0x" << this << ": Invalid size";
+		SDL_SetError(sout.str().c_str());
+	}
+	return IsGood();
+}
+
+//
+// SetMemory
+// Force a specific memory in image. pPitch is the distance
+// between rows in pixels (0 means pWidth).
+// Note: Does not free previous memory and can result
+// in memory leakage when used improperly.
+//
+void Image::SetMemory(Color32 *pPix, Sint32 pWidth, Sint32 pHeight, Sint32 pPitch)
+{
+	memory = (void*)0;
+	capacity = 0;
+	pixels = pPix;
+	width = pWidth;
+	height = pHeight;
+	pitch = pPitch > 0 ? pPitch : pWidth;
+	FreeMips();
+	damage.clear();
+	Damage(0, 0, width, height);
+}
+
+//
+// Copy
+// Copies the data from an existing image.
+//
+bool Image::Copy(const Image &pImage)
+{
+	if (Create(pImage.width, pImage.height)) {
+		premultiplied = pImage.premultiplied;
+		for (Sint32 y = 0; y < height; ++y){
+			memcpy((void*)(*this)[y], (const void*)pImage[y], (size_t)width*sizeof(Color32));
+		}
+		return true;
+	}
+	return false;
+}
+
+//
+// Swap
+// Exchanges pixels, mips, damage and state with pImage
+// without copying. Not for images that do not own their
+// memory through Image (GfxScreen).
+//
+void Image::Swap(Image &pImage)
+{
+	std::swap(pixels, pImage.pixels);
+	std::swap(width, pImage.width);
+	std::swap(height, pImage.height);
+	std::swap(pitch, pImage.pitch);
+	std::swap(memory, pImage.memory);
+	std::swap(capacity, pImage.capacity);
+	std::swap(trackDamage, pImage.trackDamage);
+	damage.swap(pImage.damage);
+	std::swap(mip, pImage.mip);
+	std::swap(premultiplied, pImage.premultiplied);
+}
+
+//
+// MoveJob
+// Copies a band of rows for Move when the source and
+// destination rows do not overlap.
+//
+struct MoveJob
+{
+	Color32 *dst;
+	const Color32 *src;
+	Sint32 pitch, width;
+};
+
+static void MoveRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const MoveJob &job = *(const MoveJob*)pJob;
+	for (Sint32 y = pY1; y < pY2; ++y){
+		memcpy((void*)(job.dst + (Sint64)y*job.pitch), (const void*)(job.src + (Sint64)y*job.pitch), job.width*sizeof(Color32));
+	}
+}
+
+//
+// Move
+// Moves the block pSx1..pSy2 so that its top left corner
+// lands on pDx, pDy, clipped to the image, without an
+// intermediate buffer. Rows are walked away from the overlap
+// and moved with memmove, so overlapping blocks are moved
+// intact. Pixels the block leaves are not touched.
+//
+void Image::Move(Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2, Sint32 pDx, Sint32 pDy)
+{
+	// clip the source, then the destination, to the image
+	if (pSx1 < 0) { pDx -= pSx1; pSx1 = 0; }
+	if (pSy1 < 0) { pDy -= pSy1; pSy1 = 0; }
+	pSx2 = width<pSx2 ? width : pSx2;
+	pSy2 = height<pSy2 ? height : pSy2;
+	if (pDx < 0) { pSx1 -= pDx; pDx = 0; }
+	if (pDy < 0) { pSy1 -= pDy; pDy = 0; }
+	if (pDx + (pSx2 - pSx1) > width) { pSx2 = pSx1 + width - pDx; }
+	if (pDy + (pSy2 - pSy1) > height) { pSy2 = pSy1 + height - pDy; }
+	const Sint32 W = pSx2 - pSx1;
+	const Sint32 H = pSy2 - pSy1;
+	if (W <= 0 || H <= 0 || IsBad() || (pDx == pSx1 && pDy == pSy1)) { return; }
+	
+	Damage(pDx, pDy, pDx + W, pDy + H);
+	if (pDy >= pSy1 + H || pDy + H <= pSy1) { // rows do not overlap, copy them in parallel
+		MoveJob job;
+		job.dst = (*this)[pDy] + pDx;
+		job.src = (*this)[pSy1] + pSx1;
+		job.pitch = pitch;
+		job.width = W;
+		GfxParallel(0, H, Image::ParallelSize / W + 1, MoveRows, &job);
+	} else if (pDy > pSy1) { // moving down, start at the bottom
+		for (Sint32 y = H - 1; y >= 0; --y){
+			memmove((void*)((*this)[pDy + y] + pDx), (const void*)((*this)[pSy1 + y] + pSx1), W*sizeof(Color32));
+		}
+	} else {
+		for (Sint32 y = 0; y < H; ++y){
+			memmove((void*)((*this)[pDy + y] + pDx), (const void*)((*this)[pSy1 + y] + pSx1), W*sizeof(Color32));
+		}
+	}
+}
+
+//
+// Load
+// Allocates data for image and loads a native format
+// from a file. Tiles are decoded in parallel. With
+// pPremultiply, straight alpha files are premultiplied.
+//
+bool Image::Load(const std::string &pFile, bool pPremultiply)
+{
+	GFX_STAT_SCOPE(GfxStatLoad);
+	std::ifstream fin(pFile.c_str(), std::ios::binary);
+	if (!fin.is_open()) {
+		std::ostringstream sout;
+		sout << "0x" << this << ": Could not open file";
+		SDL_SetError(sout.str().c_str());
+		return false;
+	}
+
+	Uint32 flags = 0;
+	try {
+		fin.seekg(0, std::ios::end);
+		const Uint64 SIZE = (Uint64)fin.tellg();
+		fin.seekg(0, std::ios::beg);
+		FileHeader header;
+		std::vector<Uint64> index;
+		if (!ReadHeader(fin, SIZE, header, index)) {
+			std::ostringstream sout;
+			sout << "0x" << this << ": Format not recognized";
+			SDL_SetError(sout.str().c_str());
+			Free();
+		} else if (Create(header.width, header.height)) {
+			flags = header.flags;
+			if (header.tile == 0) {
+				for (Sint32 y = 0; y < height; ++y){
+					fin.read((char*)(*this)[y], width*sizeof(Color32));
+				}
+			} else {
+				std::vector<Uint8> data((size_t)index.back());
+				fin.read((char*)&data[0], (std::streamsize)data.size());
+				TileJob job;
+				job.data = &data[0];
+				job.index = &index[0];
+				job.first = 0;
+				job.dst = pixels;
+				job.pitch = pitch;
+				job.width = width;
+				job.height = height;
+				job.tile = header.tile;
+				job.tilesX = header.tilesX;
+				job.tx1 = 0;
+				job.ty1 = 0;
+				job.columns = header.tilesX;
+				memset(job.fail, 0, sizeof(job.fail));
+				if (fin.good()) {
+					GfxParallel(0, header.tilesX*header.tilesY, Image::ParallelSize / (header.tile*header.tile) + 1, TileRows, &job);
+				}
+				if (!fin.good() || TileFailed(job)) {
+					std::ostringstream sout;
+					sout << "0x" << this << ": Corrupt tile data";
+					SDL_SetError(sout.str().c_str());
+					Free();
+				}
+			}
+		} else {
+			fin.close();
+			return false;
+		}
+	} catch (std::exception &pEx) {
+		std::ostringstream sout;
+		sout << "0x" << this << ": " << pEx.what();
+		SDL_SetError(sout.str().c_str());
+		Free();
+	}
+
+	fin.close();
+	if (IsGood() && (flags & FilePremultiplied) != 0) {
+		premultiplied = true;
+	} else if (IsGood() && pPremultiply) {
+		Premultiply();
+	}
+	return IsGood();
+}
+
+//
+// Save
+// Saves the current image to a file in a native format.
+// With pCompress, tiles are stored compressed whenever
+// that makes them smaller.
+//
+static Sint32 CacheRenew(const std::string &pFile);
+
+bool Image::Save(const std::string &pFile, bool pCompress) const
+{
+	if (width*height == 0 || pixels == NULL) { return false; }
+	std::ofstream fout(pFile.c_str(), std::ios::binary);
+	if (!fout.is_open()) {
+		std::ostringstream sout;
+		sout << "0x" << this << ": Could not open file";
+		SDL_SetError(sout.str().c_str());
+		return false;
+	}
+	CacheRenew(pFile); // streamed tiles of the old file are stale
+
+	try {
+		const Sint32 TILE = Image::TileSize;
+		const Sint32 TILES_X = (width + TILE - 1) / TILE;
+		const Sint32 TILES_Y = (height + TILE - 1) / TILE;
+		const Uint32 header[6] = { FileMagic, FileVersion, (pCompress ? FileCompressed : 0) | (premultiplied ? FilePremultiplied : 0), (Uint32)width, (Uint32)height, (Uint32)TILE };
+		std::vector<Uint64> index((size_t)TILES_X*TILES_Y + 1, 0);
+		fout.write((const char*)header, sizeof(header));
+		fout.write((const char*)&index[0], (std::streamsize)(index.size()*sizeof(Uint64))); // patched below
+		
+		Color32 tile[Image::TileSize*Image::TileSize];
+		Uint8 packed[Image::TileSize*Image::TileSize*sizeof(Color32)];
+		for (Sint32 ty = 0; ty < TILES_Y; ++ty){
+			for (Sint32 tx = 0; tx < TILES_X; ++tx){
+				const Sint32 tw = (width - tx*TILE) < TILE ? (width - tx*TILE) : TILE;
+				const Sint32 th = (height - ty*TILE) < TILE ? (height - ty*TILE) : TILE;
+				for (Sint32 y = 0; y < th; ++y){
+					memcpy((void*)(tile + y*tw), (const void*)((*this)[ty*TILE + y] + tx*TILE), tw*sizeof(Color32));
+				}
+				const Sint32 RAW = tw*th*(Sint32)sizeof(Color32);
+				const Sint32 size = pCompress ? LzCompress((const Uint8*)tile, RAW, packed, RAW-1) : 0;
+				if (size > 0) {
+					fout.write((const char*)packed, size);
+				} else {
+					fout.write((const char*)tile, RAW);
+				}
+				const size_t i = (size_t)ty*TILES_X + tx;
+				index[i+1] = index[i] + (Uint64)(size > 0 ? size : RAW);
+			}
+		}
+		fout.seekp(sizeof(header));
+		fout.write((const char*)&index[0], (std::streamsize)(index.size()*sizeof(Uint64)));
+		if (!fout.good()) {
+			std::ostringstream sout;
+			sout << "0x" << this << ": Could not write file";
+			SDL_SetError(sout.str().c_str());
+			fout.close();
+			return false;
+		}
+	} catch (std::exception &pEx) {
+		std::ostringstream sout;
+		sout << "0x" << this << ": " << pEx.what();
+		SDL_SetError(sout.str().c_str());
+		fout.close();
+		return false;
+	}
+
+	fout.close();
+	return true;
+}
+
+//
+// Convert
+// Converts a non-native format to a native format.
+// Non-native formats are all formats loadable by
+// SDL and SDL_Image. Rows are converted in parallel by
+// whole-row swizzles for byte-aligned 24/32-bit, packed
+// 16-bit and paletted surfaces, and by SDL_GetRGBA for
+// anything else.
+// NOTE: If you are using SDL_image, include SDL_image.h
+// BEFORE gfx.h in your main.cpp/main.c.
+//
+bool Image::Convert(const std::string &pFile, bool pPremultiply)
+{
+	GFX_STAT_SCOPE(GfxStatConvert);
+	Free();
+	
+	SDL_Surface *src = APIIMGLOAD(pFile.c_str());
+	if (src == (SDL_Surface*)0) { return false; } // No need to set SDL error manually
+
+	if (Create(src->w, src->h)) {
+		PixelSwizzle swizzle;
+		ConvertJob job;
+		job.src = (const Uint8*)src->pixels;
+		job.pitch = src->pitch;
+		job.dst = ImageView(*this);
+		job.swizzle = &swizzle;
+		job.convert = PickConverter(src->format, swizzle);
+		GfxParallel(0, height, Image::ParallelSize / width + 1, ConvertRows, &job);
+	}
+
+	SDL_FreeSurface(src);
+
+	if (IsGood() && pPremultiply) {
+		Premultiply();
+	}
+	return IsGood();
+}
+
+//
+// ReverseByteorder
+// Reverses the byteorder in case Convert does not
+// accurately read the requested file.
+//
+void Image::ReverseByteorder( void )
+{
+	const Sint32 REVERSE[4] = { 3, 2, 1, 0 };
+	const ImageView VIEW(*this);
+	for (Sint32 y = 0; y < VIEW.GetHeight(); ++y){
+		SwizzleBytes(REVERSE, 4, (const Uint8*)VIEW[y], VIEW[y], VIEW.GetWidth());
+	}
+	Damage(0, 0, width, height);
+}
+
+//
+// PremultiplyRows
+// Converts a band of rows to or from premultiplied alpha.
+//
+template < bool Premultiply_b >
+static void PremultiplyRows(void *pImage, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	Image &image = *(Image*)pImage;
+	const Sint32 WIDTH = image.GetWidth();
+	for (Sint32 y = pY1; y < pY2; ++y){
+		Color32 *row = image[y];
+		for (Sint32 x = 0; x < WIDTH; ++x){
+			row[x] = Premultiply_b ? Premultiplied(row[x]) : Unpremultiplied(row[x]);
+		}
+	}
+}
+
+//
+// Premultiply
+// Multiplies the color channels by alpha, unless the image
+// already is premultiplied.
+//
+void Image::Premultiply( void )
+{
+	if (premultiplied || IsBad()) { return; }
+	GfxParallel(0, height, Image::ParallelSize / width + 1, PremultiplyRows<true>, this);
+	Damage(0, 0, width, height);
+	premultiplied = true;
+}
+
+//
+// Unpremultiply
+// Converts a premultiplied image back to straight alpha.
+// Colors with low alpha lose precision.
+//
+void Image::Unpremultiply( void )
+{
+	if (!premultiplied || IsBad()) { return; }
+	GfxParallel(0, height, Image::ParallelSize / width + 1, PremultiplyRows<false>, this);
+	Damage(0, 0, width, height);
+	premultiplied = false;
+}
+
+//
+// GetRGB
+// Returns floating point channels of specified
+// pixel coordinate
+//
+void Image::GetRGB(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB) const
+{
+	const Color32 C = pixels[(Sint64)pY*pitch + pX];
+	pR = u8chan_to_fchan[C.channels.red];
+	pG = u8chan_to_fchan[C.channels.green];
+	pB = u8chan_to_fchan[C.channels.blue];
+}
+
+//
+// GetRGBA
+// Returns floating point channels of specified
 // pixel coordinate
 //
-void Image::GetRGB(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB) const
+void Image::GetRGBA(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB, float &pA) const
+{
+	const Color32 C = pixels[(Sint64)pY*pitch + pX];
+	pR = u8chan_to_fchan[C.channels.red];
+	pG = u8chan_to_fchan[C.channels.green];
+	pB = u8chan_to_fchan[C.channels.blue];
+	pA = u8chan_to_fchan[C.channels.alpha];
+}
+
+//
+// SetRGB
+// Sets the specified pixel in accordance with
+// the given color channels
+//
+void Image::SetRGB(Sint32 pX, Sint32 pY, float pR, float pG, float pB)
+{
+	Color32 &c = pixels[(Sint64)pY*pitch + pX];
+	c.channels.red = (Uint8)(pR*255.f);
+	c.channels.green = (Uint8)(pG*255.f);
+	c.channels.blue = (Uint8)(pB*255.f);
+	Damage(pX, pY, pX+1, pY+1);
+}
+
+//
+// SetRGBA
+// Sets the specified pixel in accordance with
+// the given color channels
+//
+void Image::SetRGBA(Sint32 pX, Sint32 pY, float pR, float pG, float pB, float pA)
+{
+	Color32 &c = pixels[(Sint64)pY*pitch + pX];
+	c.channels.red = (Uint8)(pR*255.f);
+	c.channels.green = (Uint8)(pG*255.f);
+	c.channels.blue = (Uint8)(pB*255.f);
+	c.channels.alpha = (Uint8)(pA*255.f);
+	Damage(pX, pY, pX+1, pY+1);
+}
+
+//
+// GenerateMips
+// Builds the mip chain with the 2x resolve, halving the size
+// until either side would drop below one pixel.
+//
+bool Image::GenerateMips( void )
+{
+	FreeMips();
+	if (IsBad()) { return false; }
+	Image *level = this;
+	while (level->width >= 2 && level->height >= 2) {
+		Image *next = new Image(level->width / 2, level->height / 2);
+		if (next->IsBad() || !Image::Resolve(*next, *level, 2)) {
+			delete next;
+			FreeMips();
+			return false;
+		}
+		level->mip = next;
+		level = next;
+	}
+	return true;
+}
+
+//
+// GetMip
+// Returns the specified level, or the smallest level if the
+// chain is shorter.
+//
+const Image *Image::GetMip(Sint32 pLevel) const
+{
+	const Image *level = this;
+	for (; pLevel > 0 && level->mip != (Image*)0; --pLevel){
+		level = level->mip;
+	}
+	return level;
+}
+
+//
+// GetMipCount
+// Returns the number of levels, including the image itself.
+//
+Sint32 Image::GetMipCount( void ) const
+{
+	Sint32 count = 1;
+	for (const Image *level = mip; level != (Image*)0; level = level->mip){
+		++count;
+	}
+	return count;
+}
+
+//
+// TrackDamage
+// Turns damage tracking on or off. Turning it on marks the
+// whole image as damaged, since nothing is known about what
+// has been presented before.
+//
+void Image::TrackDamage(bool pTrack)
+{
+	trackDamage = pTrack;
+	damage.clear();
+	Damage(0, 0, width, height);
+}
+
+//
+// AddDamage
+// Clips a rectangle to the image and adds it to the damage
+// list. Rectangles are merged whenever their bounding box
+// covers no more pixels than the two do separately, and the
+// merge is repeated since the bounding box may now qualify
+// with others. Past MaxDamage the new rectangle is forced
+// into the one it grows the least.
+//
+static inline Sint64 DamageArea(const Image::Rect &pRect)
+{
+	return (Sint64)(pRect.x2 - pRect.x1) * (Sint64)(pRect.y2 - pRect.y1);
+}
+
+static inline Image::Rect DamageUnion(const Image::Rect &pA, const Image::Rect &pB)
+{
+	Image::Rect r;
+	r.x1 = pA.x1<pB.x1 ? pA.x1 : pB.x1;
+	r.y1 = pA.y1<pB.y1 ? pA.y1 : pB.y1;
+	r.x2 = pA.x2>pB.x2 ? pA.x2 : pB.x2;
+	r.y2 = pA.y2>pB.y2 ? pA.y2 : pB.y2;
+	return r;
+}
+
+void Image::AddDamage(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2)
+{
+	Rect r;
+	r.x1 = 0>pX1 ? 0 : pX1;
+	r.y1 = 0>pY1 ? 0 : pY1;
+	r.x2 = width<pX2 ? width : pX2;
+	r.y2 = height<pY2 ? height : pY2;
+	if (r.x2 <= r.x1 || r.y2 <= r.y1) { return; }
+	
+	for (size_t i = damage.size(); i > 0; --i){ // newest first, as consecutive writes tend to be close
+		const Rect u = DamageUnion(damage[i-1], r);
+		if (DamageArea(u) <= DamageArea(damage[i-1]) + DamageArea(r)) {
+			if (DamageArea(u) == DamageArea(damage[i-1])) { return; } // already covered
+			r = u;
+			damage[i-1] = damage.back();
+			damage.pop_back();
+			i = damage.size() + 1; // start over
+		}
+	}
+	
+	if ((Sint32)damage.size() >= Image::MaxDamage) {
+		size_t best = 0;
+		Sint64 bestGrowth = DamageArea(DamageUnion(damage[0], r)) - DamageArea(damage[0]);
+		for (size_t i = 1; i < damage.size(); ++i){
+			const Sint64 growth = DamageArea(DamageUnion(damage[i], r)) - DamageArea(damage[i]);
+			if (growth < bestGrowth) {
+				best = i;
+				bestGrowth = growth;
+			}
+		}
+		damage[best] = DamageUnion(damage[best], r);
+		return;
+	}
+	damage.push_back(r);
+}
+
+//
+// operator=
+//
+Image &Image::operator =(const Image &pImage)
+{
+	if (this != &pImage) {
+		Copy(pImage);
+	}
+	return *this;
+}
+
+#ifdef GFX_MOVE
+//
+// Image (move)
+// Takes over the pixels, mips and damage of pImage, which is
+// left empty. Memory that pImage does not own from GfxAllocate
+// (the screen, or memory given to SetMemory) is copied instead.
+//
+Image::Image(Image &&pImage) : pixels((Color32*)0), width(0), height(0), pitch(0), memory((void*)0), capacity(0), trackDamage(false), mip((Image*)0), premultiplied(false)
+{
+	*this = static_cast<Image&&>(pImage);
+}
+
+//
+// operator= (move)
+//
+Image &Image::operator =(Image &&pImage)
+{
+	if (this == &pImage) { return *this; }
+	if (pImage.memory == (void*)0) {
+		if (pImage.IsGood()) {
+			Copy(pImage);
+		} else {
+			Free();
+		}
+		return *this;
+	}
+	Free();
+	Swap(pImage);
+	return *this;
+}
+#endif
+
+//
+// ImageView
+//
+
+//
+// ImageView
+// Views the part of pView inside pX1, pY1, pX2, pY2. The
+// view is empty if nothing is left.
+//
+ImageView::ImageView(const ImageView &pView, Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2) : pixels((Color32*)0), width(0), height(0), pitch(pView.pitch)
+{
+	pX1 = 0>pX1 ? 0 : pX1;
+	pY1 = 0>pY1 ? 0 : pY1;
+	pX2 = pView.width<pX2 ? pView.width : pX2;
+	pY2 = pView.height<pY2 ? pView.height : pY2;
+	if (pView.IsBad() || pX2 <= pX1 || pY2 <= pY1) { return; }
+	pixels = pView[pY1] + pX1;
+	width = pX2 - pX1;
+	height = pY2 - pY1;
+}
+
+//
+// Resolve
+//
+
+//
+// Resolve storage
+// Persistent interleaved accumulators (four Uint16 channels
+// per source pixel), one row per thread slot. Each slot is
+// only touched by its own thread. Freed by GfxQuit.
+//
+static Uint16 *resolveRow[GfxMaxThreads+1];
+static Sint32 resolveSize[GfxMaxThreads+1];
+
+static bool ResolveReserve(Sint32 pThread, Sint32 pSize)
+{
+	if (resolveSize[pThread] < pSize) {
+		delete [] resolveRow[pThread];
+		resolveRow[pThread] = (Uint16*)0;
+		resolveSize[pThread] = 0;
+		try {
+			resolveRow[pThread] = new Uint16[pSize];
+		} catch (std::exception &pEx) {
+			SDL_SetError(pEx.what());
+			return false;
+		}
+		resolveSize[pThread] = pSize;
+	}
+	return true;
+}
+
+static void ResolveFree( void )
+{
+	for (Sint32 i = 0; i <= GfxMaxThreads; ++i){
+		delete [] resolveRow[i];
+		resolveRow[i] = (Uint16*)0;
+		resolveSize[i] = 0;
+	}
+}
+
+//
+// ResolveAccumulate
+// Adds (or stores when pFirst is set) one row of colors to
+// the accumulator, widening every channel to 16 bits.
+//
+static void ResolveAccumulate(Uint16 *pAcc, const Color32 *pSrc, Sint32 pCount, bool pFirst)
+{
+	Sint32 i = 0;
+#ifdef GFX_SSE2
+	const __m128i ZERO = _mm_setzero_si128();
+	for (; i+4 <= pCount; i+=4){
+		const __m128i c = _mm_loadu_si128((const __m128i*)(pSrc+i));
+		__m128i lo = _mm_unpacklo_epi8(c, ZERO);
+		__m128i hi = _mm_unpackhi_epi8(c, ZERO);
+		if (!pFirst) {
+			lo = _mm_add_epi16(lo, _mm_loadu_si128((const __m128i*)(pAcc+i*4)));
+			hi = _mm_add_epi16(hi, _mm_loadu_si128((const __m128i*)(pAcc+i*4+8)));
+		}
+		_mm_storeu_si128((__m128i*)(pAcc+i*4), lo);
+		_mm_storeu_si128((__m128i*)(pAcc+i*4+8), hi);
+	}
+#elif defined(GFX_NEON)
+	for (; i+4 <= pCount; i+=4){
+		const uint8x16_t c = vld1q_u8((const uint8_t*)(pSrc+i));
+		if (pFirst) {
+			vst1q_u16(pAcc+i*4, vmovl_u8(vget_low_u8(c)));
+			vst1q_u16(pAcc+i*4+8, vmovl_u8(vget_high_u8(c)));
+		} else {
+			vst1q_u16(pAcc+i*4, vaddw_u8(vld1q_u16(pAcc+i*4), vget_low_u8(c)));
+			vst1q_u16(pAcc+i*4+8, vaddw_u8(vld1q_u16(pAcc+i*4+8), vget_high_u8(c)));
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		const Uint8 *c = (const Uint8*)(pSrc+i);
+		Uint16 *acc = pAcc+i*4;
+		for (Sint32 n = 0; n < 4; ++n){
+			acc[n] = pFirst ? (Uint16)c[n] : (Uint16)(acc[n] + c[n]);
+		}
+	}
+}
+
+//
+// ResolveReduce
+// Sums neighboring pairs of accumulated pixels in place,
+// leaving pCount pixels.
+//
+static void ResolveReduce(Uint16 *pAcc, Sint32 pCount)
+{
+	Sint32 i = 0;
+#ifdef GFX_SSE2
+	for (; i+2 <= pCount; i+=2){
+		const __m128i a = _mm_loadu_si128((const __m128i*)(pAcc+i*8));
+		const __m128i b = _mm_loadu_si128((const __m128i*)(pAcc+i*8+8));
+		_mm_storeu_si128((__m128i*)(pAcc+i*4), _mm_add_epi16(_mm_unpacklo_epi64(a, b), _mm_unpackhi_epi64(a, b)));
+	}
+#elif defined(GFX_NEON)
+	for (; i+2 <= pCount; i+=2){
+		const uint16x8_t a = vld1q_u16(pAcc+i*8);
+		const uint16x8_t b = vld1q_u16(pAcc+i*8+8);
+		vst1q_u16(pAcc+i*4, vaddq_u16(vcombine_u16(vget_low_u16(a), vget_low_u16(b)), vcombine_u16(vget_high_u16(a), vget_high_u16(b))));
+	}
+#endif
+	for (; i < pCount; ++i){
+		for (Sint32 n = 0; n < 4; ++n){
+			pAcc[i*4+n] = (Uint16)(pAcc[i*8+n] + pAcc[i*8+4+n]);
+		}
+	}
+}
+
+//
+// ResolvePack
+// Normalizes accumulated pixels and packs them to colors.
+//
+static void ResolvePack(Color32 *pDst, const Uint16 *pAcc, Sint32 pCount, Sint32 pShift)
+{
+	Sint32 i = 0;
+#ifdef GFX_SSE2
+	const __m128i SHIFT = _mm_cvtsi32_si128(pShift);
+	for (; i+4 <= pCount; i+=4){
+		const __m128i lo = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pAcc+i*4)), SHIFT);
+		const __m128i hi = _mm_srl_epi16(_mm_loadu_si128((const __m128i*)(pAcc+i*4+8)), SHIFT);
+		_mm_storeu_si128((__m128i*)(pDst+i), _mm_packus_epi16(lo, hi));
+	}
+#elif defined(GFX_NEON)
+	const int16x8_t SHIFT = vdupq_n_s16((int16_t)-pShift);
+	for (; i+4 <= pCount; i+=4){
+		const uint16x8_t lo = vshlq_u16(vld1q_u16(pAcc+i*4), SHIFT);
+		const uint16x8_t hi = vshlq_u16(vld1q_u16(pAcc+i*4+8), SHIFT);
+		vst1q_u8((uint8_t*)(pDst+i), vcombine_u8(vmovn_u16(lo), vmovn_u16(hi)));
+	}
+#endif
+	for (; i < pCount; ++i){
+		Uint8 *c = (Uint8*)(pDst+i);
+		for (Sint32 n = 0; n < 4; ++n){
+			c[n] = (Uint8)(pAcc[i*4+n] >> pShift);
+		}
+	}
+}
+
+//
+// ResolveJob
+// Box filters a band of destination rows for Resolve.
+//
+struct ResolveJob
+{
+	const Image *src;
+	Image *dst;
+	Sint32 shift, width;
+};
+
+static void ResolveRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32 pThread)
+{
+	const ResolveJob &job = *(const ResolveJob*)pJob;
+	const Sint32 SCALE = 1 << job.shift;
+	const Sint32 SRC_WIDTH = job.width << job.shift;
+	Uint16 *acc = resolveRow[pThread];
+	for (Sint32 y = pY1; y < pY2; ++y){
+		for (Sint32 y0 = 0; y0 < SCALE; ++y0){
+			ResolveAccumulate(acc, (*job.src)[y*SCALE + y0], SRC_WIDTH, y0 == 0);
+		}
+		for (Sint32 n = SRC_WIDTH >> 1; n >= job.width; n >>= 1){
+			ResolveReduce(acc, n);
+		}
+		ResolvePack((*job.dst)[y], acc, job.width, job.shift*2);
+	}
+}
+
+//
+// Resolve
+// Box filters pSrc down by pFactor (a power of two from 2 to
+// 16) into the top left corner of pDst. Uses per-thread
+// storage that is kept between calls, so it should only be
+// called from one thread outside the worker pool at a time.
+//
+bool Image::Resolve(Image &pDst, const Image &pSrc, Sint32 pFactor)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Resolve: Bad source/destination");
+		return false;
+	}
+	if (pFactor < 2 || pFactor > 16 || (pFactor & (pFactor - 1)) != 0) {
+		SDL_SetError("Resolve: Unsupported factor");
+		return false;
+	}
+	
+	ResolveJob job;
+	job.src = &pSrc;
+	job.dst = &pDst;
+	job.shift = 0;
+	while ((1 << job.shift) < pFactor) { ++job.shift; }
+	job.width = pSrc.GetWidth() >> job.shift;
+	job.width = job.width < pDst.GetWidth() ? job.width : pDst.GetWidth();
+	Sint32 height = pSrc.GetHeight() >> job.shift;
+	height = height < pDst.GetHeight() ? height : pDst.GetHeight();
+	if (job.width <= 0 || height <= 0) { return true; }
+	
+	// reserve before dispatching so workers never allocate
+	for (Sint32 i = 0; i <= GfxThreads(); ++i){
+		if (!ResolveReserve(i, (job.width << job.shift)*4)) { return false; }
+	}
+	pDst.Damage(0, 0, job.width, height);
+	GfxParallel(0, height, (Image::ParallelSize >> (job.shift*2)) / job.width + 1, ResolveRows, &job);
+	return true;
+}
+
+//
+// Stream cache
+//
+
+static void CacheLock( void )			{ if (cacheLock != (SDL_mutex*)0) { SDL_mutexP(cacheLock); } }
+static void CacheUnlock( void )			{ if (cacheLock != (SDL_mutex*)0) { SDL_mutexV(cacheLock); } }
+
+static Uint64 CacheKey(Sint32 pId, Sint32 pTx, Sint32 pTy)
+{
+	return ((Uint64)pId << 40) | ((Uint64)pTy << 20) | (Uint64)pTx;
+}
+
+//
+// CacheEvict
+// Frees the least recently used unpinned tiles until the
+// cache fits its budget, or every tile without cacheLock.
+// Caller must hold cacheLock.
+//
+static void CacheEvict(size_t pBudget)
+{
+	std::list<CacheTile*>::iterator i = cacheLru.end();
+	while (cacheBytes > pBudget && i != cacheLru.begin()) {
+		--i;
+		if ((*i)->pins > 0) { continue; }
+		CacheTile *tile = *i;
+		i = cacheLru.erase(i);
+		cacheTiles.erase(tile->key);
+		cacheBytes -= tile->bytes;
+		++cacheStats.evictions;
+		GfxRelease((void*)tile->pixels, tile->bytes);
+		delete tile;
+	}
+}
+
+static void CacheEvict( void )
+{
+	CacheEvict(cacheLock != (SDL_mutex*)0 ? cacheBudget : 0);
+}
+
+//
+// CacheDrop
+// Frees the unpinned tiles of file id pId, pinned ones are
+// left to be evicted. Caller must hold cacheLock.
+//
+static void CacheDrop(Sint32 pId)
+{
+	std::map<Uint64, CacheTile*>::iterator i = cacheTiles.lower_bound(CacheKey(pId, 0, 0));
+	const std::map<Uint64, CacheTile*>::iterator END = cacheTiles.lower_bound(CacheKey(pId + 1, 0, 0));
+	while (i != END) {
+		CacheTile *tile = i->second;
+		if (tile->pins > 0) {
+			++i;
+			continue;
+		}
+		cacheTiles.erase(i++);
+		cacheLru.erase(tile->lru);
+		cacheBytes -= tile->bytes;
+		GfxRelease((void*)tile->pixels, tile->bytes);
+		delete tile;
+	}
+}
+
+//
+// CacheAttach
+// Returns the id of pFile for a Stream associating to it.
+// Files get a new id whenever no Stream is associated, as
+// they may have been rewritten since.
+//
+static Sint32 CacheAttach(const std::string &pFile)
+{
+	CacheLock();
+	CacheFile &file = cacheFiles[pFile];
+	if (file.streams++ == 0) { file.id = ++cacheNextId; }
+	const Sint32 ID = file.id;
+	CacheUnlock();
+	return ID;
+}
+
+//
+// CacheDetach
+// Drops the tiles of pFile when its last Stream is freed.
+//
+static void CacheDetach(const std::string &pFile)
+{
+	CacheLock();
+	std::map<std::string, CacheFile>::iterator i = cacheFiles.find(pFile);
+	if (i != cacheFiles.end() && --i->second.streams <= 0) {
+		CacheDrop(i->second.id);
+		cacheFiles.erase(i);
+	}
+	CacheUnlock();
+}
+
+//
+// CacheRenew
+// Drops the tiles of pFile, which has changed, and returns
+// its new id (0 if no Stream is associated to it).
+//
+static Sint32 CacheRenew(const std::string &pFile)
+{
+	CacheLock();
+	Sint32 id = 0;
+	std::map<std::string, CacheFile>::iterator i = cacheFiles.find(pFile);
+	if (i != cacheFiles.end()) {
+		CacheDrop(i->second.id);
+		id = i->second.id = ++cacheNextId;
+	}
+	CacheUnlock();
+	return id;
+}
+
+//
+// CacheCurrent
+// Returns the id of pFile, 0 if no Stream is associated to it.
+//
+static Sint32 CacheCurrent(const std::string &pFile)
+{
+	CacheLock();
+	std::map<std::string, CacheFile>::iterator i = cacheFiles.find(pFile);
+	const Sint32 ID = i != cacheFiles.end() ? i->second.id : 0;
+	CacheUnlock();
+	return ID;
+}
+
+//
+// CacheBand
+// Looks up the tiles pTx1 to pTx2 (exclusive) of tile row
+// pTy of pStream, decoding runs of missing tiles a band at a
+// time outside the lock. With pTiles the tiles are pinned and
+// returned (for a Blit), without they are only decoded (for
+// a prefetch). Nothing stays pinned on failure.
+//
+static bool CacheBand(const Image::Stream &pStream, Sint32 pId, Sint32 pTy, Sint32 pTx1, Sint32 pTx2, const Color32 **pTiles)
+{
+	const Sint32 TILE = pStream.GetCacheTileSize();
+	const size_t BYTES = (size_t)TILE*TILE*sizeof(Color32);
+	std::vector<Sint32> missing;
+	if (pTiles != (const Color32**)0) { memset((void*)pTiles, 0, (size_t)(pTx2 - pTx1)*sizeof(const Color32*)); }
+	CacheLock();
+	for (Sint32 tx = pTx1; tx < pTx2; ++tx){
+		const std::map<Uint64, CacheTile*>::iterator FOUND = cacheTiles.find(CacheKey(pId, tx, pTy));
+		if (FOUND == cacheTiles.end()) {
+			missing.push_back(tx);
+			if (pTiles != (const Color32**)0) { ++cacheStats.misses; }
+		} else if (pTiles != (const Color32**)0) {
+			CacheTile *tile = FOUND->second;
+			++tile->pins;
+			pTiles[tx - pTx1] = tile->pixels;
+			cacheLru.splice(cacheLru.begin(), cacheLru, tile->lru);
+			++cacheStats.hits;
+		}
+	}
+	CacheUnlock();
+	
+	bool ok = true;
+	std::vector<Color32> band;
+	for (size_t m = 0; m < missing.size() && ok; ){
+		size_t e = m + 1;
+		while (e < missing.size() && missing[e] == missing[e-1] + 1) { ++e; }
+		const Sint32 TX1 = missing[m];
+		const Sint32 COLUMNS = missing[e-1] + 1 - TX1;
+		band.resize((size_t)COLUMNS*TILE*TILE);
+		ok = pStream.DecodeBand(pTy, TX1, TX1 + COLUMNS, &band[0], COLUMNS*TILE);
+		CacheLock();
+		for (Sint32 tx = TX1; tx < TX1 + COLUMNS && ok; ++tx){
+			const Uint64 KEY = CacheKey(pId, tx, pTy);
+			const std::map<Uint64, CacheTile*>::iterator FOUND = cacheTiles.find(KEY);
+			CacheTile *tile = FOUND != cacheTiles.end() ? FOUND->second : (CacheTile*)0;
+			if (tile == (CacheTile*)0) { // not decoded by another thread meanwhile
+				Color32 *pixels = (Color32*)GfxAllocate(BYTES);
+				if (pixels == (Color32*)0) {
+					ok = false;
+					break;
+				}
+				for (Sint32 y = 0; y < TILE; ++y){
+					memcpy((void*)(pixels + y*TILE), (const void*)(&band[0] + ((size_t)y*COLUMNS + (tx - TX1))*TILE), TILE*sizeof(Color32));
+				}
+				tile = new CacheTile;
+				tile->key = KEY;
+				tile->pixels = pixels;
+				tile->bytes = BYTES;
+				tile->pins = 0;
+				cacheLru.push_front(tile);
+				tile->lru = cacheLru.begin();
+				cacheTiles[KEY] = tile;
+				cacheBytes += BYTES;
+				if (pTiles == (const Color32**)0) { ++cacheStats.prefetches; }
+			}
+			if (pTiles != (const Color32**)0) {
+				++tile->pins;
+				pTiles[tx - pTx1] = tile->pixels;
+			}
+		}
+		CacheEvict();
+		CacheUnlock();
+		m = e;
+	}
+	if (!ok && pTiles != (const Color32**)0) { // unpin what was pinned
+		CacheLock();
+		for (Sint32 tx = pTx1; tx < pTx2; ++tx){
+			const std::map<Uint64, CacheTile*>::iterator FOUND = cacheTiles.find(CacheKey(pId, tx, pTy));
+			if (pTiles[tx - pTx1] != (const Color32*)0 && FOUND != cacheTiles.end() && FOUND->second->pixels == pTiles[tx - pTx1]) {
+				--FOUND->second->pins;
+			}
+		}
+		CacheEvict();
+		CacheUnlock();
+	}
+	return ok;
+}
+
+//
+// PrefetchTask
+// Background task of Image::Stream::Prefetch, decodes the
+// tiles of a source rectangle with a Stream of its own.
+//
+struct PrefetchTask
+{
+	std::string file;
+	Sint32 id;
+	Sint32 tx1, ty1, tx2, ty2;
+	
+	static void Run(void *pTask)
+	{
+		PrefetchTask *task = (PrefetchTask*)pTask;
+		Image::Stream stream;
+		if (stream.Load(task->file) && CacheCurrent(task->file) == task->id) { // the file has not changed meanwhile
+			for (Sint32 ty = task->ty1; ty < task->ty2; ++ty){
+				if (!CacheBand(stream, task->id, ty, task->tx1, task->tx2, (const Color32**)0)) { break; }
+			}
+		}
+		delete task;
+	}
+	
+	static void Drop(void *pTask)
+	{
+		delete (PrefetchTask*)pTask;
+	}
+};
+
+//
+// GfxSetStreamBudget
+// Sets how many bytes of decoded tiles are kept.
+//
+void GfxSetStreamBudget(size_t pBytes)
+{
+	CacheLock();
+	cacheBudget = pBytes;
+	CacheEvict();
+	CacheUnlock();
+}
+
+//
+// GfxTrimStreamCache
+// Frees every tile not in use by a Blit.
+//
+void GfxTrimStreamCache( void )
+{
+	CacheLock();
+	CacheEvict(0);
+	CacheUnlock();
+}
+
+GfxStreamStats GfxGetStreamStats( void )
+{
+	CacheLock();
+	GfxStreamStats stats = cacheStats;
+	stats.bytes = cacheBytes;
+	CacheUnlock();
+	return stats;
+}
+
+void GfxResetStreamStats( void )
+{
+	CacheLock();
+	cacheStats.hits = cacheStats.misses = cacheStats.prefetches = cacheStats.evictions = 0;
+	CacheUnlock();
+}
+
+//
+// Stream
+//
+
+//
+// StreamMap
+// Maps an entire file read only. Returns null when the file
+// can not be mapped, in which case pSize is still set to the
+// file size when it could be determined.
+//
+static const Uint8 *StreamMap(const std::string &pFile, Uint64 &pSize)
+{
+	pSize = 0;
+#if defined(GFX_MMAP_WIN32)
+	HANDLE file = CreateFileA(pFile.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) { return (const Uint8*)0; }
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size)) {
+		CloseHandle(file);
+		return (const Uint8*)0;
+	}
+	pSize = (Uint64)size.QuadPart;
+	const Uint8 *view = (const Uint8*)0;
+	if (pSize > 0 && pSize <= (Uint64)((size_t)-1)) {
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping != NULL) {
+			view = (const Uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping); // the view keeps the mapping alive
+		}
+	}
+	CloseHandle(file);
+	return view;
+#elif defined(GFX_MMAP_POSIX)
+	int file = open(pFile.c_str(), O_RDONLY);
+	if (file == -1) { return (const Uint8*)0; }
+	struct stat info;
+	if (fstat(file, &info) == -1) {
+		close(file);
+		return (const Uint8*)0;
+	}
+	pSize = (Uint64)info.st_size;
+	void *view = MAP_FAILED;
+	if (pSize > 0 && pSize <= (Uint64)((size_t)-1)) {
+		view = mmap(NULL, (size_t)pSize, PROT_READ, MAP_SHARED, file, 0);
+	}
+	close(file); // the mapping stays valid
+	return view != MAP_FAILED ? (const Uint8*)view : (const Uint8*)0;
+#else
+	std::ifstream fin(pFile.c_str(), std::ios::binary);
+	if (fin.is_open()) {
+		fin.seekg(0, std::ios::end);
+		pSize = (Uint64)fin.tellg();
+	}
+	return (const Uint8*)0;
+#endif
+}
+
+//
+// StreamUnmap
+// Releases a mapping made by StreamMap.
+//
+static void StreamUnmap(const Uint8 *pMap, Uint64 pSize)
+{
+#if defined(GFX_MMAP_WIN32)
+	UnmapViewOfFile((LPCVOID)pMap);
+	(void)pSize;
+#elif defined(GFX_MMAP_POSIX)
+	munmap((void*)pMap, (size_t)pSize);
+#else
+	(void)pMap;
+	(void)pSize;
+#endif
+}
+
+//
+// Free
+// Frees file from file association.
+//
+void Image::Stream::Free( void )
+{
+	if (map != (const Uint8*)0) {
+		StreamUnmap(map, mapSize);
+	}
+	map = (const Uint8*)0;
+	mapSize = 0;
+	width = 0;
+	height = 0;
+	tile = 0;
+	tilesX = 0;
+	tilesY = 0;
+	index.clear();
+	premultiplied = false;
+	if (cacheId != 0) {
+		CacheDetach(file);
+	}
+	file.clear();
+	dataStart = 0;
+	cacheId = 0;
+}
+
+//
+// Load
+// Associate to a file. The header (and tile index) is
+// validated against the file size so that data can be
+// addressed without checks.
+//
+bool Image::Stream::Load(const std::string &pFile)
+{
+	const std::string name = pFile; // pFile may be our own file
+	Free();
+	
+	map = StreamMap(name, mapSize);
+	std::ifstream fin(name.c_str(), std::ios::binary);
+	if (!fin.is_open()){
+		SDL_SetError("Stream: Could not open file");
+		Free();
+		return false;
+	}
+	FileHeader header;
+	const bool HEADER = ReadHeader(fin, mapSize, header, index);
+	fin.close();
+	if (!HEADER) {
+		SDL_SetError("Stream: Format not recognized");
+		Free();
+		return false;
+	}
+	width = header.width;
+	height = header.height;
+	tile = header.tile;
+	tilesX = header.tilesX;
+	tilesY = header.tilesY;
+	premultiplied = (header.flags & FilePremultiplied) != 0;
+	file = name;
+	dataStart = header.dataStart;
+	cacheId = CacheAttach(name); // streams of the same file share tiles
+	return true;
+}
+
+//
+// DecodeBand
+// Decodes the tiles pTx1 to pTx2 (exclusive) of tile row pTy
+// into pOut, which is pPitch pixels between rows. Mapped
+// files are decoded in parallel, straight from the mapping.
+// Untiled files are read in GetCacheTileSize squares.
+//
+bool Image::Stream::DecodeBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2, Color32 *pOut, Sint32 pPitch) const
+{
+	if (tile == 0) {
+		const Sint32 TILE = GetCacheTileSize();
+		const Sint32 X1 = pTx1*TILE;
+		const Sint32 X2 = pTx2*TILE < width ? pTx2*TILE : width;
+		const Sint32 Y1 = pTy*TILE;
+		const Sint32 Y2 = Y1 + TILE < height ? Y1 + TILE : height;
+		GFX_STAT(GfxStatSlot().streamBytes += (Uint64)(Y2 - Y1)*(X2 - X1)*sizeof(Color32));
+		if (map != (const Uint8*)0) {
+			for (Sint32 y = Y1; y < Y2; ++y){
+				memcpy((void*)(pOut + (Sint64)(y - Y1)*pPitch), (const void*)(GetRow(y) + X1), (X2 - X1)*sizeof(Color32));
+			}
+			return true;
+		}
+		std::ifstream fin(file.c_str(), std::ios::binary);
+		for (Sint32 y = Y1; y < Y2 && fin.good(); ++y){
+			fin.seekg((std::streamoff)(dataStart + ((Sint64)y*width + X1)*(Sint64)sizeof(Color32)));
+			fin.read((char*)(pOut + (Sint64)(y - Y1)*pPitch), (std::streamsize)((X2 - X1)*sizeof(Color32)));
+		}
+		return fin.good();
+	}
+	
+	TileJob job;
+	job.index = &index[0];
+	job.first = 0;
+	job.dst = pOut;
+	job.pitch = pPitch;
+	job.width = width;
+	job.height = height;
+	job.tile = tile;
+	job.tilesX = tilesX;
+	job.tx1 = pTx1;
+	job.ty1 = pTy;
+	job.columns = pTx2 - pTx1;
+	memset(job.fail, 0, sizeof(job.fail));
+	GFX_STAT(GfxStatSlot().streamBytes += index[(size_t)pTy*tilesX + pTx2] - index[(size_t)pTy*tilesX + pTx1]);
+	
+	if (map != (const Uint8*)0) {
+		job.data = map + dataStart;
+		GfxParallel(0, job.columns, 1, TileRows, &job);
+		return !TileFailed(job);
+	}
+	
+	// unmapped, read the compressed band in one go
+	const size_t FIRST = (size_t)pTy*tilesX + pTx1;
+	const size_t LAST = (size_t)pTy*tilesX + pTx2;
+	std::vector<Uint8> data((size_t)(index[LAST] - index[FIRST]));
+	std::vector<Uint64> local(index.begin() + FIRST, index.begin() + LAST + 1);
+	std::ifstream fin(file.c_str(), std::ios::binary);
+	fin.seekg((std::streamoff)(dataStart + (Sint64)index[FIRST]));
+	fin.read((char*)&data[0], (std::streamsize)data.size());
+	if (!fin.good()) { return false; }
+	for (size_t i = 0; i < local.size(); ++i){
+		local[i] -= index[FIRST];
+	}
+	job.data = &data[0];
+	job.index = &local[0];
+	job.first = FIRST;
+	TileRows(&job, 0, job.columns, 0);
+	return !TileFailed(job);
+}
+
+//
+// IsGood
+// Returns true if the stream is associated to a valid file.
+//
+bool Image::Stream::IsGood( void ) const
+{
+	return (width > 0 && height > 0);
+}
+
+//
+// Refresh
+// If changes have been made to a file after it has been
+// loaded it could need refreshing. The tiles cached for the
+// file are dropped.
+//
+bool Image::Stream::Refresh( void )
+{
+	if (!Load(file)) { return false; }
+	cacheId = CacheRenew(file);
+	return true;
+}
+
+//
+// PinBand
+// Returns the cached tiles pTx1 to pTx2 (exclusive) of tile
+// row pTy in pTiles, decoding the missing ones. Each tile is
+// GetCacheTileSize pixels square and stays valid until
+// UnpinBand.
+//
+bool Image::Stream::PinBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2, const Color32 **pTiles) const
+{
+	return CacheBand(*this, cacheId, pTy, pTx1, pTx2, pTiles);
+}
+
+void Image::Stream::UnpinBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2) const
+{
+	CacheLock();
+	for (Sint32 tx = pTx1; tx < pTx2; ++tx){
+		const std::map<Uint64, CacheTile*>::iterator FOUND = cacheTiles.find(CacheKey(cacheId, tx, pTy));
+		if (FOUND != cacheTiles.end() && FOUND->second->pins > 0) {
+			--FOUND->second->pins;
+		}
+	}
+	CacheEvict();
+	CacheUnlock();
+}
+
+//
+// Prefetch
+// Queues decoding the tiles of source rectangle pSx1..pSy2
+// behind other background tasks. A newer prefetch of the
+// same file replaces one that has not started, and areas
+// larger than half the budget are not prefetched, as they
+// would evict each other.
+//
+void Image::Stream::Prefetch(Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2) const
+{
+	pSx1 = 0>pSx1 ? 0 : pSx1;
+	pSy1 = 0>pSy1 ? 0 : pSy1;
+	pSx2 = width<pSx2 ? width : pSx2;
+	pSy2 = height<pSy2 ? height : pSy2;
+	if (pSx2 <= pSx1 || pSy2 <= pSy1 || poolLock == (SDL_mutex*)0 || (IsMapped() && !IsTiled())) { return; } // mapped rows are read in place
+	
+	const Sint32 TILE = GetCacheTileSize();
+	const Sint32 TX1 = pSx1 / TILE, TX2 = (pSx2 - 1) / TILE + 1;
+	const Sint32 TY1 = pSy1 / TILE, TY2 = (pSy2 - 1) / TILE + 1;
+	CacheLock();
+	const bool FITS = (Uint64)(TX2 - TX1)*(TY2 - TY1)*TILE*TILE*sizeof(Color32) <= (Uint64)cacheBudget / 2;
+	CacheUnlock();
+	if (!FITS) { return; }
+	
+	SDL_mutexP(poolLock);
+	if (poolCount == 0) {
+		SDL_mutexV(poolLock);
+		return;
+	}
+	PrefetchTask *task = (PrefetchTask*)0;
+	for (size_t i = 0; i < taskQueue.size() && task == (PrefetchTask*)0; ++i){
+		if (taskQueue[i].func == PrefetchTask::Run && ((PrefetchTask*)taskQueue[i].data)->id == cacheId) {
+			task = (PrefetchTask*)taskQueue[i].data;
+		}
+	}
+	if (task == (PrefetchTask*)0) {
+		task = new PrefetchTask;
+		task->file = file;
+		task->id = cacheId;
+		PoolQueue(PrefetchTask::Run, task, INT_MIN, PrefetchTask::Drop);
+	}
+	task->tx1 = TX1;
+	task->ty1 = TY1;
+	task->tx2 = TX2;
+	task->ty2 = TY2;
+	SDL_mutexV(poolLock);
+}
+
+//
+// Clip
+// Clips a blit of the source rectangle pSx1..pSy2 to the
+// destination rectangle pDx1..pDy2 and sets up its fixed
+// point stepping. Returns false if nothing is drawn. Every
+// blit goes through here, so a blit split into pieces (by
+// rows or tiles) samples exactly the same texels.
+//
+bool Image::Clip(Sint32 pDstW, Sint32 pDstH, Sint32 pSrcW, Sint32 pSrcH, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2, Image::BlitArea &pArea)
+{
+	// clip pSrcRect against max borders
+	pSx1 = 0>pSx1 ? 0 : pSx1;
+	pSy1 = 0>pSy1 ? 0 : pSy1;
+	pSx2 = pSrcW<pSx2 ? pSrcW : pSx2;
+	pSy2 = pSrcH<pSy2 ? pSrcH : pSy2;
+	if (pSx2 <= pSx1 || pSy2 <= pSy1 || pDx1 == pDx2 || pDy1 == pDy2) { return false; } // nothing to read or write
+	
+	// 16.16 fixed point texel coordinates, stepped exactly once per destination pixel
+	const Sint32 du = (Sint32)(((Sint64)(pSx2 - pSx1) << 16) / (pDx2 - pDx1));
+	const Sint32 dv = (Sint32)(((Sint64)(pSy2 - pSy1) << 16) / (pDy2 - pDy1));
+	Sint64 u1 = (Sint64)pSx1 << 16;
+	Sint64 v1 = (Sint64)pSy1 << 16;
+	
+	// enable a negative writable area on pDst (flips blit direction)
+	if (pDx2 < pDx1) {
+		Sint32 itemp = pDx1;
+		pDx1 = pDx2;
+		pDx2 = itemp;
+		u1 = ((Sint64)pSx2 << 16) - 1; // start just inside the last texel
+	}
+	if (pDx1 < 0) { // make read offset for pSrc + clip against min borders
+		u1 += (Sint64)du * -pDx1;
+		pDx1 = 0;
+	}
+	if (pDy2 < pDy1) {
+		Sint32 itemp = pDy1;
+		pDy1 = pDy2;
+		pDy2 = itemp;
+		v1 = ((Sint64)pSy2 << 16) - 1; // start just inside the last texel
+	}
+	if (pDy1 < 0) { // make read offset for pSrc + clip against min borders
+		v1 += (Sint64)dv * -pDy1;
+		pDy1 = 0;
+	}
+	
+	// clip pDstRect agains max borders
+	pDx2 = pDstW<pDx2 ? pDstW : pDx2;
+	pDy2 = pDstH<pDy2 ? pDstH : pDy2;
+	
+	// determine writable area
+	if (pDx2 <= pDx1 || pDy2 <= pDy1) { return false; } // readable area is negative (probably because pSrc is offscreen)
+	pArea.x = pDx1;
+	pArea.y = pDy1;
+	pArea.width = pDx2 - pDx1;
+	pArea.height = pDy2 - pDy1;
+	pArea.u = (Uint32)u1;
+	pArea.v = (Uint32)v1;
+	pArea.du = du;
+	pArea.dv = dv;
+	pArea.footprint = (du<0 ? -du : du) > (dv<0 ? -dv : dv) ? (du<0 ? -du : du) : (dv<0 ? -dv : dv);
+	pArea.sx1 = pSx1;
+	pArea.sy1 = pSy1;
+	pArea.sx2 = pSx2;
+	pArea.sy2 = pSy2;
+	return true;
+}
+
+//
+// SortBatch
+// Orders a batch by source position so that consecutive
+// commands read neighbouring atlas memory. The sort is stable,
+// but it does change the draw order of commands that overlap
+// on the destination, so only use it when that does not
+// matter (e.g. opaque sprites that do not overlap).
+//
+static bool BatchLess(const Image::BlitCommand &pA, const Image::BlitCommand &pB)
+{
+	return pA.src.y1 < pB.src.y1 || (pA.src.y1 == pB.src.y1 && pA.src.x1 < pB.src.x1);
+}
+
+void Image::SortBatch(Image::BlitCommand *pCommands, Sint32 pCount)
+{
+	if (pCount > 1) { std::stable_sort(pCommands, pCommands + pCount, BatchLess); }
+}
+
+//
+// TriangleSetup
+//
+
+//
+// FloorDiv16
+// Floor of pA/16 for negative values too.
+//
+static Sint64 FloorDiv16(Sint64 pA)
+{
+	return pA >= 0 ? pA / 16 : -((-pA + 15) / 16);
+}
+
+//
+// CoverageMask
+// Bit x (0..7) is set when pE + x*pDx >= 0, i.e. when pixel x
+// of a block row is inside the edge.
+//
+static Uint32 CoverageMask(Sint32 pE, Sint32 pDx)
+{
+#if defined(GFX_AVX2)
+	const __m256i E = _mm256_add_epi32(_mm256_set1_epi32(pE), _mm256_mullo_epi32(_mm256_set1_epi32(pDx), _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7)));
+	return (Uint32)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(E, _mm256_set1_epi32(-1))));
+#elif defined(GFX_SSE2)
+	const __m128i D = _mm_set1_epi32(pDx);
+	const __m128i E0 = _mm_add_epi32(_mm_set1_epi32(pE), _mm_setr_epi32(0, pDx, 2*pDx, 3*pDx));
+	const __m128i E1 = _mm_add_epi32(E0, _mm_slli_epi32(D, 2));
+	const __m128i NEG = _mm_set1_epi32(-1);
+	return (Uint32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(E0, NEG))) | ((Uint32)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(E1, NEG))) << 4);
+#elif defined(GFX_NEON)
+	static const Uint32 BITS0[4] = { 1, 2, 4, 8 };
+	static const Uint32 BITS1[4] = { 16, 32, 64, 128 };
+	static const Sint32 STEPS[4] = { 0, 1, 2, 3 };
+	const int32x4_t E0 = vmlaq_n_s32(vdupq_n_s32(pE), vld1q_s32(STEPS), pDx);
+	const int32x4_t E1 = vaddq_s32(E0, vdupq_n_s32(4*pDx));
+	const uint32x4_t M = vorrq_u32(vandq_u32(vcgeq_s32(E0, vdupq_n_s32(0)), vld1q_u32(BITS0)), vandq_u32(vcgeq_s32(E1, vdupq_n_s32(0)), vld1q_u32(BITS1)));
+	const uint32x2_t S = vpadd_u32(vget_low_u32(M), vget_high_u32(M));
+	return vget_lane_u32(vpadd_u32(S, S), 0);
+#else
+	Uint32 mask = 0;
+	for (Sint32 x = 0; x < 8; ++x, pE += pDx){
+		mask |= (Uint32)(pE >= 0) << x;
+	}
+	return mask;
+#endif
+}
+
+//
+// Setup
+// Snaps the vertices, sets up the edge functions, bounds
+// (clipped to pClip) and attribute planes. Returns false if
+// the triangle covers no pixels.
+//
+bool TriangleSetup::Setup(const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Image::Rect &pClip)
+{
+	const Image::Vertex *v[3] = { &pA, &pB, &pC };
+	Sint64 X[3], Y[3];
+	for (int i = 0; i < 3; ++i){
+		if (!(fabs(v[i]->x) <= (float)Image::MaxDimension && fabs(v[i]->y) <= (float)Image::MaxDimension)) { return false; } // also rejects NaN
+		X[i] = (Sint64)floor(v[i]->x*16.f + 0.5f);
+		Y[i] = (Sint64)floor(v[i]->y*16.f + 0.5f);
+	}
+	Sint64 area = (X[1] - X[0])*(Y[2] - Y[0]) - (Y[1] - Y[0])*(X[2] - X[0]);
+	if (area == 0) { return false; }
+	if (area < 0) { // make the inside positive for all edges
+		const Image::Vertex *tv = v[1]; v[1] = v[2]; v[2] = tv;
+		Sint64 t;
+		t = X[1]; X[1] = X[2]; X[2] = t;
+		t = Y[1]; Y[1] = Y[2]; Y[2] = t;
+		area = -area;
+	}
+	
+	// pixel bounds: pixels whose centers lie within the snapped bounds
+	const Sint64 MINX = X[0] < X[1] ? (X[0] < X[2] ? X[0] : X[2]) : (X[1] < X[2] ? X[1] : X[2]);
+	const Sint64 MAXX = X[0] > X[1] ? (X[0] > X[2] ? X[0] : X[2]) : (X[1] > X[2] ? X[1] : X[2]);
+	const Sint64 MINY = Y[0] < Y[1] ? (Y[0] < Y[2] ? Y[0] : Y[2]) : (Y[1] < Y[2] ? Y[1] : Y[2]);
+	const Sint64 MAXY = Y[0] > Y[1] ? (Y[0] > Y[2] ? Y[0] : Y[2]) : (Y[1] > Y[2] ? Y[1] : Y[2]);
+	Sint64 bx1 = -FloorDiv16(8 - MINX), bx2 = FloorDiv16(MAXX - 8) + 1;
+	Sint64 by1 = -FloorDiv16(8 - MINY), by2 = FloorDiv16(MAXY - 8) + 1;
+	bx1 = bx1 > pClip.x1 ? bx1 : pClip.x1;
+	by1 = by1 > pClip.y1 ? by1 : pClip.y1;
+	bx2 = bx2 < pClip.x2 ? bx2 : pClip.x2;
+	by2 = by2 < pClip.y2 ? by2 : pClip.y2;
+	if (bx2 <= bx1 || by2 <= by1) { return false; }
+	x1 = (Sint32)bx1;
+	y1 = (Sint32)by1;
+	x2 = (Sint32)bx2;
+	y2 = (Sint32)by2;
+	
+	// edge functions, evaluated at pixel centers
+	const Sint64 PX = (Sint64)x1*16 + 8;
+	const Sint64 PY = (Sint64)y1*16 + 8;
+	for (int i = 0; i < 3; ++i){
+		const int j = (i + 1) % 3;
+		const Sint64 DX = X[j] - X[i];
+		const Sint64 DY = Y[j] - Y[i];
+		const bool TOPLEFT = DY < 0 || (DY == 0 && DX > 0);
+		edge[i] = DX*(PY - Y[i]) - DY*(PX - X[i]) - (TOPLEFT ? 0 : 1);
+		edgeDx[i] = (Sint32)(-DY*16);
+		edgeDy[i] = (Sint32)(DX*16);
+	}
+	
+	// attribute planes, in pixels
+	const double AX = X[0]/16.0, AY = Y[0]/16.0;
+	const double BX = X[1]/16.0 - AX, BY = Y[1]/16.0 - AY;
+	const double CX = X[2]/16.0 - AX, CY = Y[2]/16.0 - AY;
+	const double DET = BX*CY - BY*CX;
+	const double OX = x1 + 0.5 - AX, OY = y1 + 0.5 - AY;
+	for (int a = 0; a < 6; ++a){
+		double f[3];
+		for (int i = 0; i < 3; ++i){
+			const Image::Vertex &p = *v[i];
+			f[i] = a == 0 ? p.u : a == 1 ? p.v : a == 2 ? p.color.channels.red : a == 3 ? p.color.channels.green : a == 4 ? p.color.channels.blue : p.color.channels.alpha;
+		}
+		const double DFDX = ((f[1] - f[0])*CY - (f[2] - f[0])*BY) / DET;
+		const double DFDY = ((f[2] - f[0])*BX - (f[1] - f[0])*CX) / DET;
+		attr[a] = (float)(f[0] + DFDX*OX + DFDY*OY);
+		attrDx[a] = (float)DFDX;
+		attrDy[a] = (float)DFDY;
+	}
+	return true;
+}
+
+//
+// Band
+// Finds the covered pixels [pX1[r], pX2[r]) of the rows pY+r,
+// r < BlockSize (and pY+r < y2). Empty rows get pX1 >= pX2.
+// The covered part of a band is convex, so the walk stops at
+// the first block outside an edge after a covered one.
+//
+void TriangleSetup::Band(Sint32 pY, Sint32 *pX1, Sint32 *pX2) const
+{
+	const Sint32 ROWS = y2 - pY < BlockSize ? y2 - pY : BlockSize;
+	for (Sint32 r = 0; r < BlockSize; ++r){
+		pX1[r] = x2;
+		pX2[r] = x1;
+	}
+	Sint64 e[3];
+	for (int i = 0; i < 3; ++i){
+		e[i] = edge[i] + (Sint64)(pY - y1)*edgeDy[i];
+	}
+	bool covered = false;
+	for (Sint32 bx = x1; bx < x2; bx += BlockSize){
+		const Sint32 COLS = x2 - bx < BlockSize ? x2 - bx : BlockSize;
+		bool reject = false;
+		int crossing = 0;
+		int cross[3];
+		for (int i = 0; i < 3; ++i){
+			const Sint64 SX = (Sint64)edgeDx[i]*(COLS - 1);
+			const Sint64 SY = (Sint64)edgeDy[i]*(ROWS - 1);
+			const Sint64 LO = e[i] + (SX < 0 ? SX : 0) + (SY < 0 ? SY : 0);
+			const Sint64 HI = e[i] + (SX > 0 ? SX : 0) + (SY > 0 ? SY : 0);
+			if (HI < 0) { reject = true; }
+			else if (LO < 0) { cross[crossing++] = i; }
+		}
+		
+		bool any = false;
+		if (!reject && crossing == 0) { // whole block inside
+			for (Sint32 r = 0; r < ROWS; ++r){
+				pX1[r] = bx < pX1[r] ? bx : pX1[r];
+				pX2[r] = bx + COLS;
+			}
+			any = true;
+		} else if (!reject) { // on an edge, test every pixel of the edges crossing it
+			const Uint32 COLMASK = (1u << COLS) - 1;
+			for (Sint32 r = 0; r < ROWS; ++r){
+				Uint32 mask = COLMASK;
+				for (int c = 0; c < crossing && mask != 0; ++c){
+					const int i = cross[c];
+					mask &= CoverageMask((Sint32)(e[i] + (Sint64)r*edgeDy[i]), edgeDx[i]); // within a crossed block the values are small
+				}
+				if (mask == 0) { continue; }
+				Sint32 first = 0, last = 7;
+				while (!(mask & (1u << first))) { ++first; }
+				while (!(mask & (1u << last))) { --last; }
+				pX1[r] = bx + first < pX1[r] ? bx + first : pX1[r];
+				pX2[r] = bx + last + 1 > pX2[r] ? bx + last + 1 : pX2[r];
+				any = true;
+			}
+		}
+		if (reject && covered) { break; }
+		covered = covered || any;
+		for (int i = 0; i < 3; ++i){
+			e[i] += (Sint64)edgeDx[i]*BlockSize;
+		}
+	}
+}
+
+//
+// Sprite
+//
+
+//
+// Free
+// Frees the runs.
+//
+void Image::Sprite::Free( void )
+{
+	width = 0;
+	height = 0;
+	runs.clear();
+	rows.clear();
+	pixels.clear();
+	premultiplied = false;
+}
+
+//
+// SpriteClass
+// Pixel classes used while building runs.
+//
+enum SpriteClass { SpriteSkip, SpriteCopy, SpriteBlend };
+
+//
+// SpriteBuild
+// Builds the runs of pImage, classifying pixels with
+// pClassify.
+//
+template < typename Classify_t >
+static void SpriteBuild(const Image &pImage, const Classify_t &pClassify, std::vector<Image::Sprite::Run> &pRuns, std::vector<Sint32> &pRows, std::vector<Color32> &pPixels)
+{
+	pRows.reserve(pImage.GetHeight() + 1);
+	for (Sint32 y = 0; y < pImage.GetHeight(); ++y){
+		pRows.push_back((Sint32)pRuns.size());
+		const Color32 *row = pImage[y];
+		for (Sint32 x = 0; x < pImage.GetWidth(); ){
+			const SpriteClass CLASS = pClassify(row[x]);
+			Sint32 end = x + 1;
+			while (end < pImage.GetWidth() && pClassify(row[end]) == CLASS) { ++end; }
+			if (CLASS != SpriteSkip) {
+				Image::Sprite::Run run;
+				run.x = x;
+				run.count = end - x;
+				run.offset = (Sint32)pPixels.size();
+				run.blend = (CLASS == SpriteBlend);
+				pRuns.push_back(run);
+				pPixels.insert(pPixels.end(), row + x, row + end);
+			}
+			x = end;
+		}
+	}
+	pRows.push_back((Sint32)pRuns.size());
+}
+
+struct SpriteKeyClass
+{
+	Uint32 mask, key;
+	SpriteClass operator()(Color32 pColor) const { return (pColor.value & mask) == key ? SpriteSkip : SpriteCopy; }
+};
+
+struct SpriteAlphaClass
+{
+	Uint8 threshold;
+	SpriteClass operator()(Color32 pColor) const { return pColor.channels.alpha <= threshold ? SpriteSkip : (pColor.channels.alpha == UCHAR_MAX ? SpriteCopy : SpriteBlend); }
+};
+
+//
+// Build
+// Builds runs from a color keyed image (alpha is not
+// compared, like ColorKey).
+//
+bool Image::Sprite::Build(const Image &pImage, Color32 pColorKey)
+{
+	Free();
+	if (pImage.IsBad()) { return false; }
+	SpriteKeyClass classify;
+	classify.mask = ~Color32(0, 0, 0, UCHAR_MAX).value;
+	classify.key = pColorKey.value & classify.mask;
+	SpriteBuild(pImage, classify, runs, rows, pixels);
+	width = pImage.GetWidth();
+	height = pImage.GetHeight();
+	premultiplied = pImage.IsPremultiplied();
+	return true;
+}
+
+//
+// BuildAlpha
+// Builds runs from the alpha channel of an image.
+//
+bool Image::Sprite::BuildAlpha(const Image &pImage, Uint8 pThreshold)
+{
+	Free();
+	if (pImage.IsBad()) { return false; }
+	SpriteAlphaClass classify;
+	classify.threshold = pThreshold;
+	SpriteBuild(pImage, classify, runs, rows, pixels);
+	width = pImage.GetWidth();
+	height = pImage.GetHeight();
+	premultiplied = pImage.IsPremultiplied();
+	return true;
+}
+
+//
+// SpriteJob
+// Draws a band of sprite rows for the Sprite Blit. Rows are
+// relative to the first row of the sprite.
+//
+struct SpriteJob
+{
+	const ImageView *dst;
+	const Image::Sprite *src;
+	Sint32 x, y;
+};
+
+static void SpriteRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const SpriteJob &job = *(const SpriteJob*)pJob;
+	const Sint32 WIDTH = job.dst->GetWidth();
+	const bool PREMULTIPLIED = job.src->IsPremultiplied();
+	for (Sint32 y = pY1; y < pY2; ++y){
+		Color32 *dpix = (*job.dst)[job.y + y];
+		const Image::Sprite::Run *run = job.src->GetRuns(y);
+		const Sint32 COUNT = job.src->GetRunCount(y);
+		for (Sint32 r = 0; r < COUNT; ++r){
+			Sint32 x1 = job.x + run[r].x;
+			Sint32 x2 = x1 + run[r].count;
+			const Color32 *spix = job.src->GetPixels(run[r]);
+			if (x1 < 0) {
+				spix -= x1;
+				x1 = 0;
+			}
+			x2 = x2 < WIDTH ? x2 : WIDTH;
+			if (x2 <= x1) { continue; }
+			if (!run[r].blend) {
+				memcpy((void*)(dpix + x1), (const void*)spix, (x2 - x1)*sizeof(Color32));
+			} else if (PREMULTIPLIED) {
+				GfxSpanPremultipliedBlend(dpix + x1, spix, x2 - x1);
+			} else {
+				GfxSpanAlphaBlend(dpix + x1, spix, x2 - x1);
+			}
+		}
+	}
+}
+
+//
+// Blit
+// Blits a sprite 1:1 with its top left corner at (pX, pY).
+// Transparent runs are skipped, opaque runs copied and only
+// translucent runs are blended.
+//
+void Image::Blit(const ImageView &pDst, Sint32 pX, Sint32 pY, const Image::Sprite &pSrc)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return;
+	}
+	const Sint32 Y1 = pY < 0 ? -pY : 0;
+	const Sint32 Y2 = (pDst.GetHeight() - pY) < pSrc.GetHeight() ? (pDst.GetHeight() - pY) : pSrc.GetHeight();
+	if (Y2 <= Y1 || pX >= pDst.GetWidth() || pX + pSrc.GetWidth() <= 0) { return; }
+	
+	SpriteJob job;
+	job.dst = &pDst;
+	job.src = &pSrc;
+	job.x = pX;
+	job.y = pY;
+	GfxParallel(Y1, Y2, Image::ParallelSize / pSrc.GetWidth() + 1, SpriteRows, &job);
+}
+
+void Image::Blit(Image &pDst, Sint32 pX, Sint32 pY, const Image::Sprite &pSrc)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return;
+	}
+	const Sint32 Y1 = pY < 0 ? -pY : 0;
+	const Sint32 Y2 = (pDst.GetHeight() - pY) < pSrc.GetHeight() ? (pDst.GetHeight() - pY) : pSrc.GetHeight();
+	if (Y2 <= Y1 || pX >= pDst.GetWidth() || pX + pSrc.GetWidth() <= 0) { return; }
+	pDst.Damage(pX, pY + Y1, pX + pSrc.GetWidth(), pY + Y2);
+	Image::Blit(ImageView(pDst), pX, pY, pSrc);
+}
+
+//
+// Screen
+//
+
+//
+// GfxSetVideo
+// Creates a screen surface for drawing. No direct screen
+// manipulation allowed (might solve instancing problems).
+//
+bool GfxSetVideo(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen)
+{
+	SDL_FreeSurface(SDL_GetVideoSurface());
+	if (pScreenW != 0 && pScreenW < 640 && pScreenH != 0 && pScreenH < 480 && pFullscreen){
+		std::ostringstream sout;
+		sout << "GfxScreen: Cannot allocate screen size of less than 640x480 in fullscreen mode";
+		SDL_SetError(sout.str().c_str());
+		return false;
+	}
+	if (((pScreenW == 0 && pScreenH == 0) || (pScreenW > 0 && pScreenH > 0)) &&
+		SDL_SetVideoMode(pScreenW, pScreenH, 32, SDL_SWSURFACE|SDL_DOUBLEBUF|(SDL_FULLSCREEN *Sint32(pFullscreen))) != (SDL_Surface*)0)
+	{
+		if (SDL_GetVideoSurface()->format->BytesPerPixel != sizeof(Color32)){
+			std::ostringstream sout;
+			sout << "GfxScreen: Cannot allocate pixel of byte size " << sizeof(Color32) << " (SDL limitation)";
+			SDL_SetError(sout.str().c_str());
+			SDL_FreeSurface(SDL_GetVideoSurface());
+			return false;
+		}
+	}
+	return true;
+}
+
+//
+// FlipJob
+// Transfers a band of screen rows from the back buffer for
+// GfxFlip.
+//
+struct FlipJob
+{
+	const Image *src;
+	Image *dst;
+};
+
+static void FlipCopyRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const FlipJob &job = *(const FlipJob*)pJob;
+	const Sint32 WIDTH = job.dst->GetWidth();
+	for (Sint32 y = pY1; y < pY2; ++y){
+		memcpy((void*)(*job.dst)[y], (const void*)(*job.src)[y], WIDTH*sizeof(Color32));
+	}
+}
+
+//
+// GfxFlip
+// Transfers the data from one image to
+// the screen.
+//
+bool GfxFlip(const Image &pSrc)
+{
+	GfxScreen screen;
+	if (!screen.Lock()) { return false; }
+
+	if (pSrc.GetWidth() == screen.GetWidth() && pSrc.GetHeight() == screen.GetHeight()){
+		if (pSrc[0] == screen[0]) { // pSrc already is the screen
+			screen.Unlock();
+			return GfxFlip();
+		}
+		GFX_STAT_SCOPE(GfxStatFlipCopy);
+		FlipJob job;
+		job.src = &pSrc;
+		job.dst = &screen;
+		GfxParallel(0, screen.GetHeight(), Image::ParallelSize / screen.GetWidth() + 1, FlipCopyRows, &job);
+	} else {
+		GFX_STAT_SCOPE(GfxStatFlipCopy);
+		const Sint32 xscale = pSrc.GetWidth()/screen.GetWidth();
+		const bool RESOLVE = // Resolve only takes powers of two from 2 to 16
+			pSrc.GetWidth() == xscale*screen.GetWidth() && pSrc.GetHeight() == xscale*screen.GetHeight() &&
+			xscale >= 2 && xscale <= 16 && (xscale & (xscale - 1)) == 0;
+		if (!RESOLVE || !Image::Resolve(screen, pSrc, xscale)) {
+			Image::Blit(screen, 0, 0, screen.GetWidth(), screen.GetHeight(), pSrc);
+		}
+	}
+	
+	screen.Unlock();
+
+	return GfxFlip();
+}
+
+//
+// GfxFlip
+// Presents the screen surface as is. Use after drawing
+// directly into a GfxScreen.
+//
+bool GfxFlip( void )
+{
+	GFX_STAT_SCOPE(GfxStatSDLFlip);
+	return (SDL_Flip(SDL_GetVideoSurface()) != -1);
+}
+
+//
+// GfxFlipDamage
+// Transfers only the damaged parts of an image to the screen
+// and presents them with SDL_UpdateRects, then clears the
+// damage. Falls back on GfxFlip when the image does not track
+// damage, does not match the screen size, or when the screen
+// is page flipped (which needs the entire frame every time).
+//
+bool GfxFlipDamage(Image &pSrc)
+{
+	GfxScreen screen;
+	if (!screen.Lock()) { return false; }
+	
+	SDL_Surface *surface = SDL_GetVideoSurface();
+	if (!pSrc.IsTrackingDamage() || pSrc.GetWidth() != screen.GetWidth() || pSrc.GetHeight() != screen.GetHeight() || (surface->flags & SDL_DOUBLEBUF) != 0) {
+		screen.Unlock();
+		pSrc.ClearDamage();
+		return GfxFlip(pSrc);
+	}
+	
+	const std::vector<Image::Rect> &damage = pSrc.GetDamage();
+	if (damage.empty()) {
+		screen.Unlock();
+		return true;
+	}
+	
+	std::vector<SDL_Rect> rects(damage.size());
+	const bool COPY = (pSrc[0] != screen[0]); // pSrc might already be the screen
+	{
+		GFX_STAT_SCOPE(GfxStatFlipCopy);
+		for (size_t i = 0; i < damage.size(); ++i){
+			const Image::Rect &d = damage[i];
+			if (COPY) {
+				for (Sint32 y = d.y1; y < d.y2; ++y){
+					memcpy((void*)(screen[y] + d.x1), (const void*)(pSrc[y] + d.x1), (d.x2 - d.x1)*sizeof(Color32));
+				}
+			}
+			rects[i].x = (Sint16)d.x1;
+			rects[i].y = (Sint16)d.y1;
+			rects[i].w = (Uint16)(d.x2 - d.x1);
+			rects[i].h = (Uint16)(d.y2 - d.y1);
+		}
+	}
+	
+	screen.Unlock();
+	{
+		GFX_STAT_SCOPE(GfxStatSDLFlip);
+		SDL_UpdateRects(surface, (int)rects.size(), &rects[0]);
+	}
+	pSrc.ClearDamage();
+	return true;
+}
+
+//
+// Atlas
+//
+
+//
+// Atlas (ctor)
+//
+Atlas::Atlas( void ) : Image(), padding(0)
+{}
+
+//
+// Atlas (ctor)
+// Create is virtual, so it is called here rather than
+// through the Image constructor.
+//
+Atlas::Atlas(Sint32 pWidth, Sint32 pHeight, Sint32 pPadding) : Image(), padding(pPadding < 0 ? 0 : pPadding)
+{
+	Create(pWidth, pHeight);
+}
+
+//
+// Free
+// Frees the image and everything packed into it.
+//
+void Atlas::Free( void )
+{
+	Image::Free();
+	skyline.clear();
+}
+
+//
+// Create
+// Allocates an empty (transparent) atlas.
+//
+bool Atlas::Create(Sint32 pWidth, Sint32 pHeight)
+{
+	if (!Image::Create(pWidth, pHeight)) {
+		skyline.clear();
+		return false;
+	}
+	Reset();
+	return true;
+}
+
+//
+// Reset
+// Forgets all packed rectangles and clears the pixels.
+//
+void Atlas::Reset( void )
+{
+	skyline.clear();
+	if (IsBad()) { return; }
+	for (Sint32 y = 0; y < height; ++y){
+		memset((void*)(*this)[y], 0, (size_t)width*sizeof(Color32));
+	}
+	Damage(0, 0, width, height);
+	Segment seg = { 0, 0, width };
+	skyline.push_back(seg);
+}
+
+//
+// Reserve
+// Finds room for a pWidth*pHeight rectangle and marks it as
+// used. Returns false (and leaves the atlas unchanged) if the
+// rectangle does not fit.
+//
+bool Atlas::Reserve(Sint32 pWidth, Sint32 pHeight, Image::Rect &pRect)
+{
+	if (IsBad() || pWidth <= 0 || pHeight <= 0) {
+		SDL_SetError("Atlas: Invalid size");
+		return false;
+	}
+	const Sint32 W = pWidth + padding;
+	const Sint32 H = pHeight + padding;
+	
+	// bottom-left skyline: lowest top edge, then the tightest segment
+	size_t best = skyline.size();
+	Sint32 bestY = 0, bestTop = height + 1, bestWidth = 0;
+	for (size_t i = 0; i < skyline.size(); ++i){
+		const Sint32 X = skyline[i].x;
+		if (X + pWidth > width) { break; } // segments are sorted by x
+		Sint32 y = 0;
+		Sint32 left = W;
+		for (size_t j = i; j < skyline.size() && left > 0; ++j){
+			y = skyline[j].y > y ? skyline[j].y : y;
+			left -= skyline[j].width;
+		}
+		const Sint32 TOP = y + H;
+		if (y + pHeight > height) { continue; }
+		if (TOP < bestTop || (TOP == bestTop && skyline[i].width < bestWidth)) {
+			best = i;
+			bestY = y;
+			bestTop = TOP;
+			bestWidth = skyline[i].width;
+		}
+	}
+	if (best == skyline.size()) {
+		SDL_SetError("Atlas: Out of space");
+		return false;
+	}
+	
+	// raise the skyline under the new rectangle (padding may hang over the edges)
+	const Sint32 X1 = skyline[best].x;
+	const Sint32 X2 = X1 + W < width ? X1 + W : width;
+	Segment seg = { X1, bestY + H, X2 - X1 };
+	skyline.insert(skyline.begin() + best, seg);
+	for (size_t i = best + 1; i < skyline.size(); ){
+		if (skyline[i].x >= X2) { break; }
+		const Sint32 END = skyline[i].x + skyline[i].width;
+		if (END <= X2) {
+			skyline.erase(skyline.begin() + i);
+		} else {
+			skyline[i].width = END - X2;
+			skyline[i].x = X2;
+			break;
+		}
+	}
+	for (size_t i = 1; i < skyline.size(); ){ // merge neighbours of equal height
+		if (skyline[i-1].y == skyline[i].y) {
+			skyline[i-1].width += skyline[i].width;
+			skyline.erase(skyline.begin() + i);
+		} else {
+			++i;
+		}
+	}
+	
+	pRect.x1 = X1;
+	pRect.y1 = bestY;
+	pRect.x2 = X1 + pWidth;
+	pRect.y2 = bestY + pHeight;
+	return true;
+}
+
+//
+// Insert
+// Reserves room for pSrc and copies its pixels there.
+//
+bool Atlas::Insert(const Image &pSrc, Image::Rect &pRect)
+{
+	if (pSrc.IsBad() || !Reserve(pSrc.GetWidth(), pSrc.GetHeight(), pRect)) { return false; }
+	Image::Blit(*this, pRect.x1, pRect.y1, pRect.x2, pRect.y2, pSrc);
+	return true;
+}
+
+//
+// DrawList
+//
+
+//
+// DrawJob
+// The binned commands of one Execute. Tiles are numbered
+// row by row, and tile t draws commands[bins[binStart[t]..
+// binStart[t+1]]].
+//
+struct DrawList::DrawJob
+{
+	Image *target;
+	Sint32 tilesX;
+	Command * const *commands;
+	const Sint32 *bins;
+	const Sint32 *binStart;
+};
+
+//
+// DrawTiles
+// Draws a range of tiles through a view of the target.
+//
+void DrawList::DrawTiles(void *pJob, Sint32 pTile1, Sint32 pTile2, Sint32)
+{
+	const DrawJob &job = *(const DrawJob*)pJob;
+	const ImageView DST(*job.target);
+	for (Sint32 t = pTile1; t < pTile2; ++t){
+		if (job.binStart[t] == job.binStart[t+1]) { continue; }
+		const Sint32 X = (t % job.tilesX) * DrawList::TileSize;
+		const Sint32 Y = (t / job.tilesX) * DrawList::TileSize;
+		const ImageView TILE(DST, X, Y, X + DrawList::TileSize, Y + DrawList::TileSize);
+		for (Sint32 i = job.binStart[t]; i < job.binStart[t+1]; ++i){
+			job.commands[job.bins[i]]->Draw(TILE, X, Y);
+		}
+	}
+}
+
+//
+// Clip
+// Clips pRect against the target. Returns false if nothing
+// is left.
+//
+bool DrawList::Clip(Image::Rect &pRect) const
+{
+	pRect.x1 = 0>pRect.x1 ? 0 : pRect.x1;
+	pRect.y1 = 0>pRect.y1 ? 0 : pRect.y1;
+	pRect.x2 = target->GetWidth()<pRect.x2 ? target->GetWidth() : pRect.x2;
+	pRect.y2 = target->GetHeight()<pRect.y2 ? target->GetHeight() : pRect.y2;
+	return target->IsGood() && pRect.x2 > pRect.x1 && pRect.y2 > pRect.y1;
+}
+
+//
+// Blit (DrawList)
+// Records a sprite blit.
+//
+void DrawList::Blit(Sint32 pX, Sint32 pY, const Image::Sprite &pSrc)
+{
+	if (pSrc.IsBad()) { return; }
+	Image::Rect bounds = { pX, pY, pX + pSrc.GetWidth(), pY + pSrc.GetHeight() };
+	if (!Clip(bounds)) { return; }
+	SpriteCommand *cmd = new SpriteCommand;
+	cmd->bounds = bounds;
+	cmd->x = pX;
+	cmd->y = pY;
+	cmd->src = &pSrc;
+	commands.push_back(cmd);
+}
+
+//
+// Execute
+// Draws and then clears the recorded commands.
+//
+void DrawList::Execute( void )
+{
+	if (commands.empty()) { return; }
+	if (target->IsBad()) {
+		Clear();
+		return;
+	}
+	
+	// bin commands by the tiles their bounds touch, keeping recording order within each tile
+	const Sint32 TILESX = (target->GetWidth() + TileSize - 1) / TileSize;
+	const Sint32 TILESY = (target->GetHeight() + TileSize - 1) / TileSize;
+	const Sint32 TILES = TILESX*TILESY;
+	std::vector<Sint32> binStart((size_t)TILES + 1, 0);
+	for (size_t i = 0; i < commands.size(); ++i){
+		const Image::Rect &r = commands[i]->bounds;
+		for (Sint32 ty = r.y1 / TileSize; ty <= (r.y2 - 1) / TileSize; ++ty){
+			for (Sint32 tx = r.x1 / TileSize; tx <= (r.x2 - 1) / TileSize; ++tx){
+				++binStart[ty*TILESX + tx + 1];
+			}
+		}
+		target->Damage(r.x1, r.y1, r.x2, r.y2);
+	}
+	for (Sint32 t = 0; t < TILES; ++t){ binStart[t+1] += binStart[t]; }
+	std::vector<Sint32> bins((size_t)binStart[TILES]);
+	std::vector<Sint32> fill(binStart.begin(), binStart.end() - 1);
+	for (size_t i = 0; i < commands.size(); ++i){
+		const Image::Rect &r = commands[i]->bounds;
+		for (Sint32 ty = r.y1 / TileSize; ty <= (r.y2 - 1) / TileSize; ++ty){
+			for (Sint32 tx = r.x1 / TileSize; tx <= (r.x2 - 1) / TileSize; ++tx){
+				bins[fill[ty*TILESX + tx]++] = (Sint32)i;
+			}
+		}
+	}
+	
+	DrawJob job;
+	job.target = target;
+	job.tilesX = TILESX;
+	job.commands = &commands[0];
+	job.bins = &bins[0];
+	job.binStart = &binStart[0];
+	GfxParallel(0, TILES, 1, DrawTiles, &job);
+	Clear();
+}
+
+//
+// Clear
+// Discards the recorded commands without drawing them.
+//
+void DrawList::Clear( void )
+{
+	for (size_t i = 0; i < commands.size(); ++i){
+		delete commands[i];
+	}
+	commands.clear();
+}
+
+//
+// ImageLoader
+//
+
+//
+// Task
+// One submitted file. The worker only touches the task while
+// it runs, and state changes are made under poolLock.
+//
+struct ImageLoader::Task
+{
+	Sint32 ticket;
+	std::string file;
+	Image *target;
+	Image image;
+	Sint32 priority;
+	bool premultiply;
+	bool success;
+	bool cancelled;
+	ImageLoader::State state;
+};
+
+//
+// Run
+// Loads the file of a task. Native files go through Load,
+// everything else through Convert.
+//
+void ImageLoader::Run(void *pTask)
 {
-	pR = u8chan_to_fchan[(*this)[pY][pX].channels.red];
-	pG = u8chan_to_fchan[(*this)[pY][pX].channels.green];
-	pB = u8chan_to_fchan[(*this)[pY][pX].channels.blue];
+	Task &task = *(Task*)pTask;
+	if (poolLock != (SDL_mutex*)0) { SDL_mutexP(poolLock); }
+	task.state = Loading;
+	const bool CANCELLED = task.cancelled;
+	if (poolLock != (SDL_mutex*)0) { SDL_mutexV(poolLock); }
+	
+	const bool success = !CANCELLED && (task.image.Load(task.file, task.premultiply) || task.image.Convert(task.file, task.premultiply));
+	
+	if (poolLock != (SDL_mutex*)0) { SDL_mutexP(poolLock); }
+	task.success = success;
+	task.state = Ready;
+	if (poolLock != (SDL_mutex*)0) { SDL_mutexV(poolLock); }
 }
 
 //
-// GetRGBA
-// Returns floating point channels of specified
-// pixel coordinate
+// Drop
+// Marks a task that GfxQuit took off the queue as failed.
+// The workers are gone by then, so no lock is needed.
 //
-void Image::GetRGBA(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB, float &pA) const
+void ImageLoader::Drop(void *pTask)
 {
-	pR = u8chan_to_fchan[(*this)[pY][pX].channels.red];
-	pG = u8chan_to_fchan[(*this)[pY][pX].channels.green];
-	pB = u8chan_to_fchan[(*this)[pY][pX].channels.blue];
-	pA = u8chan_to_fchan[(*this)[pY][pX].channels.alpha];
+	Task &task = *(Task*)pTask;
+	task.success = false;
+	task.state = Ready;
 }
 
 //
-// SetRGB
-// Sets the specified pixel in accordance with
-// the given color channels
+// ~ImageLoader
+// Drops queued files and waits for the ones being loaded.
+// After GfxQuit nothing is queued or loading any more.
 //
-void Image::SetRGB(Sint32 pX, Sint32 pY, float pR, float pG, float pB)
+ImageLoader::~ImageLoader( void )
 {
-	(*this)[pY][pX].channels.red = (Uint8)(pR*255.f);
-	(*this)[pY][pX].channels.green = (Uint8)(pG*255.f);
-	(*this)[pY][pX].channels.blue = (Uint8)(pB*255.f);
+	if (poolLock == (SDL_mutex*)0) {
+		for (size_t i = 0; i < tasks.size(); ++i){
+			delete tasks[i];
+		}
+		return;
+	}
+	for (size_t i = 0; i < tasks.size(); ++i){
+		SDL_mutexP(poolLock);
+		if (!PoolUnqueue(tasks[i])) {
+			while (tasks[i]->state != Ready) { // can only be running on a worker
+				SDL_CondWait(taskDone, poolLock);
+			}
+		}
+		SDL_mutexV(poolLock);
+		delete tasks[i];
+	}
 }
 
 //
-// SetRGBA
-// Sets the specified pixel in accordance with
-// the given color channels
+// Find
+// Returns the task of a ticket, or 0.
 //
-void Image::SetRGBA(Sint32 pX, Sint32 pY, float pR, float pG, float pB, float pA)
+ImageLoader::Task *ImageLoader::Find(Sint32 pTicket) const
 {
-	(*this)[pY][pX].channels.red = (Uint8)(pR*255.f);
-	(*this)[pY][pX].channels.green = (Uint8)(pG*255.f);
-	(*this)[pY][pX].channels.blue = (Uint8)(pB*255.f);
-	(*this)[pY][pX].channels.alpha = (Uint8)(pA*255.f);
+	for (size_t i = 0; i < tasks.size(); ++i){
+		if (tasks[i]->ticket == pTicket) { return tasks[i]; }
+	}
+	return (Task*)0;
 }
 
 //
-// operator=
+// Deliver
+// Moves a finished image into its target, reports it and
+// forgets the task. Cancelled tasks are only forgotten.
 //
-Image &Image::operator =(const Image &pImage)
+bool ImageLoader::Deliver(Sint32 pIndex)
 {
-	if (this != &pImage) {
-		Copy(pImage);
+	Task *task = tasks[pIndex];
+	tasks.erase(tasks.begin() + pIndex);
+	const bool SUCCESS = task->success && !task->cancelled;
+	if (SUCCESS) {
+		const bool TRACK = task->target->IsTrackingDamage();
+		task->target->Free();
+		task->target->Swap(task->image);
+		task->target->TrackDamage(TRACK); // the whole image is new
 	}
-	return *this;
+	if (!task->cancelled && callback != (Callback)0) {
+		callback(task->ticket, *task->target, SUCCESS, user);
+	}
+	delete task;
+	return SUCCESS;
 }
 
 //
-// Stream
+// Submit
+// Queues pFile for pTarget. Returns the ticket, or 0 if the
+// pool could not be set up.
 //
+Sint32 ImageLoader::Submit(const std::string &pFile, Image &pTarget, Sint32 pPriority, bool pPremultiply)
+{
+	if (!PoolCreate()) { return 0; }
+	Task *task = new Task;
+	task->ticket = next++;
+	task->file = pFile;
+	task->target = &pTarget;
+	task->priority = pPriority;
+	task->premultiply = pPremultiply;
+	task->success = false;
+	task->cancelled = false;
+	task->state = Queued;
+	tasks.push_back(task);
+	SDL_mutexP(poolLock);
+	PoolQueue(ImageLoader::Run, task, pPriority, ImageLoader::Drop);
+	SDL_mutexV(poolLock);
+	return task->ticket;
+}
 
 //
-// Free
-// Frees file from file association.
+// SetPriority
+// Changes the priority of a ticket that has not started.
 //
-void Image::Stream::Free( void )
+bool ImageLoader::SetPriority(Sint32 pTicket, Sint32 pPriority)
 {
-	width = 0;
-	height = 0;
-	file.clear();
-	dataStart = 0;
+	Task *task = Find(pTicket);
+	if (task == (Task*)0) { return false; }
+	SDL_mutexP(poolLock);
+	const bool QUEUED = PoolReprioritize(task, pPriority);
+	SDL_mutexV(poolLock);
+	if (QUEUED) { task->priority = pPriority; }
+	return QUEUED;
 }
 
 //
-// Load
-// Associate to a file.
+// Cancel
+// Forgets a ticket. A file that is being loaded finishes in
+// the background and is then thrown away; the target is
+// never touched.
 //
-bool Image::Stream::Load(const std::string &pFile)
+bool ImageLoader::Cancel(Sint32 pTicket)
 {
-	std::ifstream fin(pFile.c_str(), std::ios::binary);
-	if (!fin.is_open()){
-		Free();
-		return false;
+	for (size_t i = 0; i < tasks.size(); ++i){
+		if (tasks[i]->ticket != pTicket) { continue; }
+		SDL_mutexP(poolLock);
+		const bool QUEUED = PoolUnqueue(tasks[i]);
+		tasks[i]->cancelled = true;
+		SDL_mutexV(poolLock);
+		if (QUEUED) {
+			delete tasks[i];
+			tasks.erase(tasks.begin() + i);
+		}
+		return true;
 	}
+	return false;
+}
 
-	fin.read((char*)(&width), sizeof(width));
-	fin.read((char*)(&height), sizeof(height));
-	file = pFile;
-	dataStart = sizeof(width)+sizeof(height);
+//
+// GetState
+// None for unknown, cancelled and delivered tickets.
+//
+ImageLoader::State ImageLoader::GetState(Sint32 pTicket) const
+{
+	const Task *task = Find(pTicket);
+	if (task == (Task*)0 || task->cancelled) { return None; }
+	SDL_mutexP(poolLock);
+	const State STATE = task->state;
+	SDL_mutexV(poolLock);
+	return STATE;
+}
 
-	fin.close();
-	return true;
+//
+// Wait
+// Finishes and delivers one ticket. A queued file is loaded
+// on the calling thread. Returns true if the target was
+// loaded.
+//
+bool ImageLoader::Wait(Sint32 pTicket)
+{
+	for (size_t i = 0; i < tasks.size(); ++i){
+		Task *task = tasks[i];
+		if (task->ticket != pTicket || task->cancelled) { continue; }
+		SDL_mutexP(poolLock);
+		if (PoolUnqueue(task)) {
+			SDL_mutexV(poolLock);
+			ImageLoader::Run(task);
+		} else {
+			while (task->state != Ready) {
+				SDL_CondWait(taskDone, poolLock);
+			}
+			SDL_mutexV(poolLock);
+		}
+		return Deliver((Sint32)i);
+	}
+	return false;
 }
 
 //
-// IsGood
-// Returns true if current file is a valid file.
+// Poll
+// Delivers every finished ticket. Returns how many were
+// delivered (including failures).
 //
-bool Image::Stream::IsGood( void ) const
+Sint32 ImageLoader::Poll( void )
 {
-	std::ifstream fin(file.c_str(), std::ios::binary);
-	bool good = fin.is_open();
-	fin.close();
-	return good;
+	if (tasks.empty()) { return 0; }
+	if (GfxThreads() == 0) { // nobody else will load the queue
+		size_t best = tasks.size();
+		for (size_t i = 0; i < tasks.size(); ++i){
+			if (tasks[i]->state == Queued && (best == tasks.size() || tasks[i]->priority > tasks[best]->priority)) { best = i; }
+		}
+		SDL_mutexP(poolLock);
+		const bool QUEUED = best < tasks.size() && PoolUnqueue(tasks[best]);
+		SDL_mutexV(poolLock);
+		if (QUEUED) { ImageLoader::Run(tasks[best]); }
+	}
+	
+	Sint32 count = 0;
+	for (size_t i = 0; i < tasks.size(); ){
+		SDL_mutexP(poolLock);
+		const bool READY = tasks[i]->state == Ready;
+		const bool CANCELLED = tasks[i]->cancelled;
+		SDL_mutexV(poolLock);
+		if (!READY) {
+			++i;
+			continue;
+		}
+		Deliver((Sint32)i);
+		count += CANCELLED ? 0 : 1;
+	}
+	return count;
 }
 
 //
-// Refresh
-// If changes have been made to a file after it has been
-// loaded it could need refreshing.
+// FloatImage
 //
-bool Image::Stream::Refresh( void )
+
+//
+// FloatImage (ctor)
+//
+FloatImage::FloatImage(Sint32 pWidth, Sint32 pHeight) : planes((float*)0), capacity(0), width(0), height(0), pitch(0)
 {
-	return Load(file);
+	Create(pWidth, pHeight);
 }
 
 //
-// Screen
+// Free
+// Returns the planes to GfxRelease.
 //
+void FloatImage::Free( void )
+{
+	if (planes != (float*)0) {
+		GfxRelease((void*)planes, capacity);
+	}
+	planes = (float*)0;
+	capacity = 0;
+	width = 0;
+	height = 0;
+	pitch = 0;
+}
 
 //
-// GfxSetVideo
-// Creates a screen surface for drawing. No direct screen
-// manipulation allowed (might solve instancing problems).
+// Create
+// Allocates the planes, cleared to 0.
 //
-bool GfxSetVideo(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen)
+bool FloatImage::Create(Sint32 pWidth, Sint32 pHeight)
 {
-	SDL_FreeSurface(SDL_GetVideoSurface());
-	if (pScreenW != 0 && pScreenW < 640 && pScreenH != 0 && pScreenH < 480 && pFullscreen){
+	Free();
+	if (pWidth <= 0 || pWidth > Image::MaxDimension || pHeight <= 0 || pHeight > Image::MaxDimension) {
 		std::ostringstream sout;
-		sout << "GfxScreen: Cannot allocate screen size of less than 640x480 in fullscreen mode";
+		sout << "0x" << this << ": Invalid size";
 		SDL_SetError(sout.str().c_str());
 		return false;
 	}
-	if (((pScreenW == 0 && pScreenH == 0) || (pScreenW > 0 && pScreenH > 0)) &&
-		SDL_SetVideoMode(pScreenW, pScreenH, 32, SDL_SWSURFACE|SDL_DOUBLEBUF|(SDL_FULLSCREEN *Sint32(pFullscreen))) != (SDL_Surface*)0)
-	{
-		if (SDL_GetVideoSurface()->format->BytesPerPixel != sizeof(Color32)){
-			std::ostringstream sout;
-			sout << "GfxScreen: Cannot allocate pixel of byte size " << sizeof(Color32) << " (SDL limitation)";
-			SDL_SetError(sout.str().c_str());
-			SDL_FreeSurface(SDL_GetVideoSurface());
-			return false;
-		}
+	const Sint32 PITCH = (pWidth + RowAlign - 1) / RowAlign * RowAlign;
+	const Uint64 BYTES = (Uint64)PITCH*(Uint64)pHeight*Channels*sizeof(float);
+	if (BYTES == (Uint64)(size_t)BYTES) {
+		planes = (float*)GfxAllocate((size_t)BYTES);
 	}
+	if (planes == (float*)0) {
+		std::ostringstream sout;
+		sout << "0x" << this << ": Out of memory";
+		SDL_SetError(sout.str().c_str());
+		return false;
+	}
+	memset((void*)planes, 0, (size_t)BYTES);
+	capacity = (size_t)BYTES;
+	width = pWidth;
+	height = pHeight;
+	pitch = PITCH;
 	return true;
 }
 
 //
-// GfxFlip
-// Transfers the data from one image to
-// the screen.
+// ChannelShift
+// Bit offset of a channel within Color32::value.
 //
-bool GfxFlip(const Image &pSrc)
+static Sint32 ChannelShift(FloatImage::Channel pChannel)
 {
-	class Screen : public Image
-	{
-	public:
-		Screen( void ) : Image() {
-			pixels = (Color32*)SDL_GetVideoSurface()->pixels;
-			width = SDL_GetVideoSurface()->w;
-			height = SDL_GetVideoSurface()->h;
-		}
-		~Screen( void ) {
-			pixels = (Color32*)0;
+	const Color32 MASK(
+		(Uint8)(pChannel == FloatImage::Red ? UCHAR_MAX : 0),
+		(Uint8)(pChannel == FloatImage::Green ? UCHAR_MAX : 0),
+		(Uint8)(pChannel == FloatImage::Blue ? UCHAR_MAX : 0),
+		(Uint8)(pChannel == FloatImage::Alpha ? UCHAR_MAX : 0));
+	Sint32 shift = 0;
+	while ((MASK.value >> shift) != UCHAR_MAX) { shift += CHAR_BIT; }
+	return shift;
+}
+
+//
+// FloatJob
+// A Fill, Blit or Quantize of a FloatImage. Rows are
+// relative to the first row of the area.
+//
+struct FloatJob
+{
+	FloatImage *dst;
+	const FloatImage *src;
+	const Color32 *in; // Image rows read by Blit
+	Color32 *out; // Image rows written by Quantize
+	Sint32 pitch;
+	Sint32 x, y, width;
+	Sint32 shift[FloatImage::Channels];
+	float color[FloatImage::Channels];
+	float scale;
+	bool add, dither;
+};
+
+static void FloatFillRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const FloatJob &job = *(const FloatJob*)pJob;
+	for (Sint32 y = pY1; y < pY2; ++y){
+		for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+			float *row = job.dst->GetRow(job.y + y, (FloatImage::Channel)c) + job.x;
+			const float C = job.color[c];
+			if (job.add) {
+				for (Sint32 x = 0; x < job.width; ++x){ row[x] += C; }
+			} else {
+				for (Sint32 x = 0; x < job.width; ++x){ row[x] = C; }
+			}
 		}
-	public:
-		void Lock( void ) {
-			if (SDL_MUSTLOCK(SDL_GetVideoSurface()) && SDL_GetVideoSurface()->locked == 0) {
-				SDL_LockSurface(SDL_GetVideoSurface());
+	}
+}
+
+//
+// ExpandSpan
+// Channels of pSrc times pScale into the planes pOut,
+// assigned or added.
+//
+static void ExpandSpan(const Color32 *pSrc, float *const *pOut, const Sint32 *pShift, Sint32 pCount, float pScale, bool pAdd)
+{
+	Sint32 i = 0;
+#if defined(GFX_SSE2)
+	{
+		const __m128i MASK = _mm_set1_epi32(UCHAR_MAX);
+		const __m128 SCALE = _mm_set1_ps(pScale);
+		for (; i+4 <= pCount; i+=4){
+			const __m128i p = _mm_loadu_si128((const __m128i*)(pSrc+i));
+			for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+				__m128 f = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srl_epi32(p, _mm_cvtsi32_si128(pShift[c])), MASK)), SCALE);
+				if (pAdd) { f = _mm_add_ps(f, _mm_loadu_ps(pOut[c]+i)); }
+				_mm_storeu_ps(pOut[c]+i, f);
 			}
 		}
-		void Unlock( void ) {
-			if (SDL_MUSTLOCK(SDL_GetVideoSurface())) {
-				while (SDL_GetVideoSurface()->locked > 0) {
-					SDL_UnlockSurface(SDL_GetVideoSurface());
-				}
+	}
+#elif defined(GFX_NEON)
+	{
+		const uint32x4_t MASK = vdupq_n_u32(UCHAR_MAX);
+		const float32x4_t SCALE = vdupq_n_f32(pScale);
+		for (; i+4 <= pCount; i+=4){
+			const uint32x4_t p = vld1q_u32((const uint32_t*)(pSrc+i));
+			for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+				float32x4_t f = vmulq_f32(vcvtq_f32_u32(vandq_u32(vshlq_u32(p, vdupq_n_s32(-pShift[c])), MASK)), SCALE);
+				if (pAdd) { f = vaddq_f32(f, vld1q_f32(pOut[c]+i)); }
+				vst1q_f32(pOut[c]+i, f);
 			}
 		}
-		void Release( void ) {
-			pixels = (Color32*)0;
+	}
+#endif
+	for (; i < pCount; ++i){
+		for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+			const float F = (float)(Sint32)((pSrc[i].value >> pShift[c]) & UCHAR_MAX) * pScale;
+			pOut[c][i] = pAdd ? pOut[c][i] + F : F;
 		}
-	};
+	}
+}
 
-	Screen screen;
-	screen.Lock();
+static void FloatBlitRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	const FloatJob &job = *(const FloatJob*)pJob;
+	for (Sint32 y = pY1; y < pY2; ++y){
+		float *out[FloatImage::Channels];
+		for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+			out[c] = job.dst->GetRow(job.y + y, (FloatImage::Channel)c) + job.x;
+		}
+		ExpandSpan(job.in + (Sint64)y*job.pitch, out, job.shift, job.width, job.scale, job.add);
+	}
+}
 
-	if (pSrc.GetWidth() == screen.GetWidth() && pSrc.GetHeight() == screen.GetHeight()){
-		const Color32 *src = pSrc[0];
-		Color32 *dst = screen[0];
-		const Sint32 size = pSrc.GetWidth()*pSrc.GetHeight();
-		for (Sint32 i = 0; i < size; ++i){
-			dst[i] = src[i];
+//
+// QuantizeSpan
+// Rounds the planes pIn to 8-bit channels in pDst, adding
+// pOffset[x & 3] (0.5 rounds) before truncating and clamping
+// to 0 to 255. NaN becomes 0.
+//
+static void QuantizeSpan(const float *const *pIn, Color32 *pDst, const Sint32 *pShift, Sint32 pCount, const float *pOffset)
+{
+	Sint32 i = 0;
+#if defined(GFX_SSE2)
+	{
+		const __m128 OFFSET = _mm_loadu_ps(pOffset);
+		const __m128 MAX = _mm_set1_ps((float)UCHAR_MAX);
+		const __m128 ZERO = _mm_setzero_ps();
+		for (; i+4 <= pCount; i+=4){
+			__m128i p = _mm_setzero_si128();
+			for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+				const __m128 f = _mm_min_ps(_mm_max_ps(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(pIn[c]+i), MAX), OFFSET), ZERO), MAX);
+				p = _mm_or_si128(p, _mm_sll_epi32(_mm_cvttps_epi32(f), _mm_cvtsi32_si128(pShift[c])));
+			}
+			_mm_storeu_si128((__m128i*)(pDst+i), p);
 		}
-	} else {
-		unsigned int xscale = pSrc.GetWidth()/screen.GetWidth();
-		float yscale = (float)pSrc.GetHeight()/(float)screen.GetHeight();
-		if (xscale == yscale && !(xscale & (xscale - 1))) {
-			unsigned int si = (unsigned int)(log(yscale)/log(2.f)); // 2^si = xscale, si*ln(2)=ln(32)
-			if (si < 23) { // if more shifts are needed than 22, then loss of information
-				Sint32 *aaR = new Sint32[screen.GetWidth()];
-				Sint32 *aaG = new Sint32[screen.GetWidth()];
-				Sint32 *aaB = new Sint32[screen.GetWidth()];
-				for (Sint32 x = 0; x < screen.GetWidth(); ++x) {
-					aaR[x] = 0;
-					aaG[x] = 0;
-					aaB[x] = 0;
-				}
-				
-				Color32 *dst = screen[0];
-				const Color32 *src = pSrc[0];
-				for (Sint32 y = 0; y < screen.GetHeight(); ++y) {
-					for (Sint32 y0 = 0; y0 < yscale; ++y0) {
-						for (Sint32 x0 = 0; x0 < pSrc.GetWidth(); ++x0) {
-							aaR[x0>>si] += src[x0].channels.red;
-							aaG[x0>>si] += src[x0].channels.green;
-							aaB[x0>>si] += src[x0].channels.blue;
-						}
-						src += pSrc.GetWidth();
-					}
-					for (Sint32 x = 0; x < screen.GetWidth(); ++x) {
-						dst[x].channels.red = (Uint8)(aaR[x] >> (si+1));
-						dst[x].channels.green = (Uint8)(aaG[x] >> (si+1));
-						dst[x].channels.blue = (Uint8)(aaB[x] >> (si+1));
-						aaR[x] = 0;
-						aaG[x] = 0;
-						aaB[x] = 0;
-					}
-					dst += screen.GetWidth();
-				}
-				delete [] aaR;
-				delete [] aaG;
-				delete [] aaB;
-			} else {
-				Image::Blit(screen, 0, 0, screen.GetWidth(), screen.GetHeight(), pSrc);
+	}
+#elif defined(GFX_NEON)
+	{
+		const float32x4_t OFFSET = vld1q_f32(pOffset);
+		const float32x4_t MAX = vdupq_n_f32((float)UCHAR_MAX);
+		for (; i+4 <= pCount; i+=4){
+			uint32x4_t p = vdupq_n_u32(0);
+			for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+				const float32x4_t f = vminq_f32(vaddq_f32(vmulq_f32(vld1q_f32(pIn[c]+i), MAX), OFFSET), MAX); // vcvtq_u32_f32 takes negatives and NaN to 0
+				p = vorrq_u32(p, vshlq_u32(vcvtq_u32_f32(f), vdupq_n_s32(pShift[c])));
 			}
-		} else {
-			Image::Blit(screen, 0, 0, screen.GetWidth(), screen.GetHeight(), pSrc);
+			vst1q_u32((uint32_t*)(pDst+i), p);
+		}
+	}
+#endif
+	for (; i < pCount; ++i){
+		Uint32 p = 0;
+		for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+			float f = pIn[c][i]*(float)UCHAR_MAX + pOffset[i & 3];
+			f = f > 0.f ? f : 0.f;
+			f = f < (float)UCHAR_MAX ? f : (float)UCHAR_MAX;
+			p |= (Uint32)(Sint32)f << pShift[c];
+		}
+		pDst[i].value = p;
+	}
+}
+
+static void FloatQuantizeRows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+{
+	static const float ROUND[4] = { 0.5f, 0.5f, 0.5f, 0.5f };
+	static const float BAYER[4][4] = { // (4x4 Bayer index + 0.5)/16
+		{ 0.5f/16.f, 8.5f/16.f, 2.5f/16.f, 10.5f/16.f },
+		{ 12.5f/16.f, 4.5f/16.f, 14.5f/16.f, 6.5f/16.f },
+		{ 3.5f/16.f, 11.5f/16.f, 1.5f/16.f, 9.5f/16.f },
+		{ 15.5f/16.f, 7.5f/16.f, 13.5f/16.f, 5.5f/16.f }
+	};
+	const FloatJob &job = *(const FloatJob*)pJob;
+	for (Sint32 y = pY1; y < pY2; ++y){
+		const float *in[FloatImage::Channels];
+		for (Sint32 c = 0; c < FloatImage::Channels; ++c){
+			in[c] = job.src->GetRow(y, (FloatImage::Channel)c);
 		}
+		QuantizeSpan(in, job.out + (Sint64)y*job.pitch, job.shift, job.width, job.dither ? BAYER[y & 3] : ROUND);
+	}
+}
+
+//
+// Fill
+// Assigns or adds a color to an area.
+//
+void FloatImage::Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, float pR, float pG, float pB, float pA, bool pAdd)
+{
+	pX1 = pX1 > 0 ? pX1 : 0;
+	pY1 = pY1 > 0 ? pY1 : 0;
+	pX2 = pX2 < width ? pX2 : width;
+	pY2 = pY2 < height ? pY2 : height;
+	if (IsBad() || pX2 <= pX1 || pY2 <= pY1) { return; }
+	
+	FloatJob job;
+	job.dst = this;
+	job.x = pX1;
+	job.y = pY1;
+	job.width = pX2 - pX1;
+	job.color[Red] = pR;
+	job.color[Green] = pG;
+	job.color[Blue] = pB;
+	job.color[Alpha] = pA;
+	job.add = pAdd;
+	GfxParallel(0, pY2 - pY1, Image::ParallelSize / job.width + 1, FloatFillRows, &job);
+}
+
+//
+// Blit
+// Assigns or adds the pixels pSx1, pSy1 to pSx2, pSy2
+// (exclusive) of pSrc times pWeight/255 to pDst, with pSx1,
+// pSy1 landing on pDx, pDy. Does not scale.
+//
+void FloatImage::Blit(FloatImage &pDst, Sint32 pDx, Sint32 pDy, const Image &pSrc, float pWeight, bool pAdd, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return;
 	}
+	if (pSx1 < 0) { pDx -= pSx1; pSx1 = 0; }
+	if (pSy1 < 0) { pDy -= pSy1; pSy1 = 0; }
+	if (pDx < 0) { pSx1 -= pDx; pDx = 0; }
+	if (pDy < 0) { pSy1 -= pDy; pDy = 0; }
+	pSx2 = pSx2 < pSrc.GetWidth() ? pSx2 : pSrc.GetWidth();
+	pSy2 = pSy2 < pSrc.GetHeight() ? pSy2 : pSrc.GetHeight();
+	const Sint32 WIDTH = (pSx2 - pSx1) < (pDst.width - pDx) ? (pSx2 - pSx1) : (pDst.width - pDx);
+	const Sint32 HEIGHT = (pSy2 - pSy1) < (pDst.height - pDy) ? (pSy2 - pSy1) : (pDst.height - pDy);
+	if (WIDTH <= 0 || HEIGHT <= 0) { return; }
 	
-	screen.Unlock();
-	screen.Release();
+	FloatJob job;
+	job.dst = &pDst;
+	job.in = pSrc[pSy1] + pSx1;
+	job.pitch = pSrc.GetPitch();
+	job.x = pDx;
+	job.y = pDy;
+	job.width = WIDTH;
+	for (Sint32 c = 0; c < Channels; ++c){
+		job.shift[c] = ChannelShift((Channel)c);
+	}
+	job.scale = pWeight / (float)UCHAR_MAX;
+	job.add = pAdd;
+	GfxParallel(0, HEIGHT, Image::ParallelSize / WIDTH + 1, FloatBlitRows, &job);
+}
 
-	return (SDL_Flip(SDL_GetVideoSurface()) != -1);
+//
+// Expand
+// Recreates the buffer with the size and colors of pSrc.
+//
+bool FloatImage::Expand(const Image &pSrc)
+{
+	if (pSrc.IsBad()) {
+		SDL_SetError("Expand: Bad source");
+		return false;
+	}
+	if ((width != pSrc.GetWidth() || height != pSrc.GetHeight()) && !Create(pSrc.GetWidth(), pSrc.GetHeight())) { return false; }
+	FloatImage::Blit(*this, 0, 0, pSrc);
+	return true;
+}
+
+//
+// Quantize
+// Writes the buffer to pDst, which is recreated if its size
+// differs. pDither adds 4x4 ordered dither instead of
+// rounding, which keeps smooth gradients from banding. pDst
+// ends up with straight alpha and without mips, since its
+// old ones no longer match the pixels.
+//
+bool FloatImage::Quantize(Image &pDst, bool pDither) const
+{
+	if (IsBad()) {
+		SDL_SetError("Quantize: Bad source");
+		return false;
+	}
+	if ((pDst.GetWidth() != width || pDst.GetHeight() != height || pDst.IsBad()) && !pDst.Create(width, height)) { return false; }
+	
+	FloatJob job;
+	job.src = this;
+	job.out = pDst[0];
+	job.pitch = pDst.GetPitch();
+	job.width = width;
+	for (Sint32 c = 0; c < Channels; ++c){
+		job.shift[c] = ChannelShift((Channel)c);
+	}
+	job.dither = pDither;
+	GfxParallel(0, height, Image::ParallelSize / width + 1, FloatQuantizeRows, &job);
+	pDst.FreeMips();
+	pDst.SetPremultiplied(false);
+	pDst.Damage(0, 0, width, height);
+	return true;
+}
+
+//
+// GfxScreen
+//
+
+//
+// GfxScreen (ctor)
+//
+GfxScreen::GfxScreen( void ) : Image()
+{
+	Lock();
+	Unlock();
+}
+
+//
+// ~GfxScreen
+// Releases the surface memory so that ~Image does not
+// delete it.
+//
+GfxScreen::~GfxScreen( void )
+{
+	Unlock();
+	pixels = (Color32*)0;
+}
+
+//
+// Free
+// Releases the surface memory from the image.
+//
+void GfxScreen::Free( void )
+{
+	pixels = (Color32*)0;
+	width = 0;
+	height = 0;
+	pitch = 0;
+	damage.clear();
+	FreeMips();
+}
+
+//
+// Create
+// The screen can not be reallocated.
+//
+bool GfxScreen::Create(Sint32, Sint32)
+{
+	SDL_SetError("GfxScreen: Cannot allocate screen memory (use GfxSetVideo)");
+	return false;
+}
+
+//
+// Lock
+// Locks the surface if needed and points the image to its
+// current memory.
+//
+bool GfxScreen::Lock( void )
+{
+	SDL_Surface *surface = SDL_GetVideoSurface();
+	if (surface == (SDL_Surface*)0) {
+		SDL_SetError("GfxScreen: No video surface");
+		Free();
+		return false;
+	}
+	if (SDL_MUSTLOCK(surface) && surface->locked == 0 && SDL_LockSurface(surface) == -1) {
+		Free();
+		return false;
+	}
+	pixels = (Color32*)surface->pixels;
+	width = surface->w;
+	height = surface->h;
+	pitch = surface->pitch / (Sint32)sizeof(Color32);
+	return IsGood();
+}
+
+//
+// Unlock
+// Unlocks the surface. The image keeps pointing to the
+// surface memory, but it should not be drawn to until it
+// is locked again.
+//
+void GfxScreen::Unlock( void )
+{
+	SDL_Surface *surface = SDL_GetVideoSurface();
+	if (surface != (SDL_Surface*)0 && SDL_MUSTLOCK(surface)) {
+		while (surface->locked > 0) {
+			SDL_UnlockSurface(surface);
+		}
+	}
 }
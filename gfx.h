@@ -17,6 +17,8 @@
 #endif
 
 #include <string>
+#include <vector>
+#include <typeinfo>
 #include <limits.h>
 #include <fstream>
 #include <math.h>
@@ -26,6 +28,15 @@
 #include "SDL.h" // SDL.lib SDLmain.lib (msvc)
 #endif
 
+//
+// GFX_MOVE
+// Defined when the compiler has rvalue references, which
+// gives Image move construction and assignment.
+//
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+#define GFX_MOVE
+#endif
+
 //
 // defines
 // Determines what loader is the most approapriate.
@@ -45,10 +56,83 @@
 
 //
 // System functions
-// 
-bool GfxInit(Uint32 pScreenW=640, Uint32 pScreenH=480, bool pFullscreen=false, Uint32 SDL_INIT_FLAGS=SDL_INIT_VIDEO);
+// Without SDL_INIT_VIDEO in the flags no screen is set up,
+// which is all that drawing into Images needs (headless).
+//
+bool GfxInit(Uint32 pScreenW=640, Uint32 pScreenH=480, bool pFullscreen=false, Uint32 SDL_INIT_FLAGS=SDL_INIT_VIDEO, Uint32 pThreads=0);
 void GfxQuit( void );
 
+//
+// Worker pool
+// Optional persistent threads used to split Fill, Blit and
+// GfxFlip into bands of rows. No threads means everything
+// runs serially on the calling thread. GfxParallel calls
+// pFunc for sub-ranges of [pBegin, pEnd) of at least pGrain
+// items, and returns when all of them are done. pThread is
+// 0 for the calling thread and 1..GfxThreads() for workers.
+//
+typedef void (*GfxParallelFunc)(void *pData, Sint32 pBegin, Sint32 pEnd, Sint32 pThread);
+static const Sint32 GfxMaxThreads = 64;
+bool GfxSetThreads(Uint32 pThreads);
+Sint32 GfxThreads( void );
+void GfxParallel(Sint32 pBegin, Sint32 pEnd, Sint32 pGrain, GfxParallelFunc pFunc, void *pData);
+
+//
+// Row storage
+// Scratch colors for parallel jobs, pCount for every thread
+// of the pool, found with GfxThreadRows(pThread) inside the
+// job. The storage is kept between jobs, and only one job
+// can hold it at a time: GfxReserveRows returns false if
+// another job does or if it could not be allocated, and
+// GfxReleaseRows gives it back.
+//
+union Color32;
+bool GfxReserveRows(Sint32 pCount);
+Color32 *GfxThreadRows(Sint32 pThread);
+void GfxReleaseRows( void );
+
+//
+// Pixel storage
+// Image buffers come from GfxAllocate, which returns memory
+// aligned to GfxAlignment bytes, and go back through
+// GfxRelease. Released buffers are cached (while Gfx is
+// initialized, up to GfxSetStorageLimit bytes) and handed out
+// again for allocations of the same size, so images that are
+// freed and created every frame do not go through the heap.
+// GfxSetAllocator replaces the allocator behind the cache
+// (0 restores the default); pAlloc must return GfxAlignment
+// aligned memory or 0. Set it before creating any image.
+//
+typedef void *(*GfxAllocFunc)(size_t pBytes);
+typedef void (*GfxFreeFunc)(void *pMemory, size_t pBytes);
+static const Sint32 GfxAlignment = 64;
+void *GfxAllocate(size_t pBytes);
+void GfxRelease(void *pMemory, size_t pBytes);
+void GfxSetAllocator(GfxAllocFunc pAlloc, GfxFreeFunc pFree);
+void GfxSetStorageLimit(size_t pBytes);
+void GfxTrimStorage( void );
+
+//
+// Stream cache
+// Streamed Blits read decoded tiles through an LRU cache of
+// GfxSetStreamBudget bytes (32 MiB by default), keyed by file
+// and tile, so areas that stay in view are not decoded or
+// read again every frame. Tiles in use by a Blit are never
+// evicted, so a 0 budget keeps only those. The cache exists
+// while Gfx is initialized. Stats count tiles: hits and misses
+// of Blits, tiles decoded by Image::Stream::Prefetch, and
+// evictions.
+//
+struct GfxStreamStats
+{
+	Uint64 hits, misses, prefetches, evictions;
+	size_t bytes; // decoded tiles currently held
+};
+void GfxSetStreamBudget(size_t pBytes);
+void GfxTrimStreamCache( void );
+GfxStreamStats GfxGetStreamStats( void );
+void GfxResetStreamStats( void );
+
 //
 // ARGB32/BGRA32
 // 32-bit single channel color structures.
@@ -62,7 +146,8 @@ struct BGRA32 {
 
 //
 // Color32
-// Providing saturation arithmetic for colors.
+// Providing saturation arithmetic for colors. The operators
+// do not depend on GfxInit.
 //
 union Color32
 {
@@ -114,23 +199,44 @@ Color32 operator<<(Color32 pLeft, Sint32 pRight);
 //
 // BlitPred
 // Abstract functor for inserting custom blit code where
-// supported in Image class.
+// supported in Image class. Image calls Blend once per
+// scanline; the default loops over operator(), so only
+// operator() has to be implemented.
 //
 class Blender {
 public:
 	virtual Color32 operator()(Color32 pDst, Color32 pSrc) const = 0;
+	virtual void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const {
+		for (Sint32 i = 0; i < pCount; ++i){
+			pDst[i] = (*this)(pDst[i], pSrc[i]);
+		}
+	}
 	virtual ~Blender( void ) {}
 };
 
+//
+// GfxExactBlender
+// True if pBlend is exactly a Blender_t. The span fast paths
+// of the built-in blenders are only taken then, so classes
+// deriving from them that change operator() still draw
+// through it.
+//
+template < typename Blender_t >
+inline bool GfxExactBlender(const Blender_t &pBlend)
+{
+	return typeid(pBlend) == typeid(Blender_t);
+}
+
 //
 // Assign
 // Simply assigns one color to another.
 //
 class Assign : public Blender {
 public:
-	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+	Color32 operator()(Color32, Color32 pSrc) const {
 		return pSrc;
 	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
 };
 
 //
@@ -147,6 +253,7 @@ public:
 		pDst.channels.alpha += (pSrc.channels.alpha *(pSrc.channels.alpha -pDst.channels.alpha) >> CHAR_BIT);
 		return pDst;
 	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
 };
 
 //
@@ -161,22 +268,46 @@ public:
 	Color32 operator()(Color32 pDst, Color32 pSrc) const {
 		return pSrc==key ? pDst : pSrc;
 	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+	Color32 GetKey( void ) const { return key; }
+};
+
+//
+// PremultipliedBlend
+// Blends a premultiplied source color over the destination,
+// dst*(255-alpha)/255 + src for all four channels, two
+// channels per multiply. Use with premultiplied images (see
+// Image::Premultiply); these can be filtered with plain
+// Bilinear without fringing.
+//
+class PremultipliedBlend : public Blender {
+public:
+	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+		const Uint32 INV = UCHAR_MAX - pSrc.channels.alpha;
+		Uint32 rb = (pDst.value & 0x00ff00ff) * INV + 0x00800080;
+		Uint32 ag = ((pDst.value >> 8) & 0x00ff00ff) * INV + 0x00800080;
+		rb = (((rb + ((rb >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff) + (pSrc.value & 0x00ff00ff);
+		ag = (((ag + ((ag >> 8) & 0x00ff00ff)) >> 8) & 0x00ff00ff) + ((pSrc.value >> 8) & 0x00ff00ff);
+		rb |= ((rb >> 8) & 0x00010001) * UCHAR_MAX; // saturates, which only happens for colors that are not premultiplied
+		ag |= ((ag >> 8) & 0x00010001) * UCHAR_MAX;
+		pDst.value = (rb & 0x00ff00ff) | ((ag & 0x00ff00ff) << 8);
+		return pDst;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
 };
 
 //
 // Grayscale
-// Converts the source color to grayscale.
+// Converts the source color to grayscale, weighting red,
+// green and blue by 0.3, 0.59 and 0.11 in 16-bit fixed point.
 //
 class Grayscale : public Blender {
 public:
-	Color32 operator()(Color32 pDst, Color32 pSrc) const {
-		const Uint8 Gray = (Uint8)(
-			(float)pSrc.channels.red*0.3f +
-			(float)pSrc.channels.green*0.59f +
-			(float)pSrc.channels.blue*0.11f
-			);
+	Color32 operator()(Color32, Color32 pSrc) const {
+		const Uint8 Gray = (Uint8)(((Uint32)pSrc.channels.red*19661 + (Uint32)pSrc.channels.green*38666 + (Uint32)pSrc.channels.blue*7209) >> 16);
 		return Color32(Gray, Gray, Gray);
 	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
 };
 
 //
@@ -188,20 +319,146 @@ public:
 	Color32 operator()(Color32 pDst, Color32 pSrc) const {
 		return Grayscale::operator()(pSrc, pDst);
 	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+};
+
+//
+// Additive/Multiply/ScreenBlend
+// Saturating dst+src, dst*src/255 and the inverse of
+// (255-dst)*(255-src)/255 on all four channels.
+//
+class Additive : public Blender {
+public:
+	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+		return pDst += pSrc;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+};
+
+class Multiply : public Blender {
+public:
+	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+		return pDst *= pSrc;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+};
+
+class ScreenBlend : public Blender {
+public:
+	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+		pDst.value = ~pDst.value;
+		pDst *= Color32(~pSrc.value);
+		pDst.value = ~pDst.value;
+		return pDst;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+};
+
+//
+// Modulate
+// Multiplies the source color by a tint (alpha included)
+// and assigns it, i.e. a source stage for Compose.
+//
+class Modulate : public Blender {
+private:
+	Color32 tint;
+public:
+	Modulate(Color32 pTint) : tint(pTint) {}
+	Color32 operator()(Color32, Color32 pSrc) const {
+		return pSrc *= tint;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const;
+	Color32 GetTint( void ) const { return tint; }
+};
+
+//
+// Compose
+// Chains up to four blenders into one, e.g.
+// Compose<ColorKey, Modulate, AlphaBlend>. Every stage gets
+// the destination and the color of the stage before it, and
+// the last color is written. ColorKey stages stop the chain
+// for keyed colors, which leaves the destination untouched.
+// Stages are called non-virtually, so the chain compiles to
+// a single per-pixel loop. ComposeStage can be overloaded for
+// other stages that need to stop the chain.
+//
+class ComposePass {};
+
+template < typename Stage_t >
+inline bool ComposeStage(const Stage_t &pStage, Color32 pDst, Color32 &pColor)
+{
+	pColor = pStage.Stage_t::operator()(pDst, pColor);
+	return true;
+}
+inline bool ComposeStage(const ColorKey &pStage, Color32, Color32 &pColor)
+{
+	return pColor != pStage.GetKey();
+}
+inline bool ComposeStage(const ComposePass&, Color32, Color32&)
+{
+	return true;
+}
+
+template < typename A_t, typename B_t, typename C_t = ComposePass, typename D_t = ComposePass >
+class Compose : public Blender {
+private:
+	A_t a;
+	B_t b;
+	C_t c;
+	D_t d;
+public:
+	Compose(const A_t &pA = A_t(), const B_t &pB = B_t(), const C_t &pC = C_t(), const D_t &pD = D_t()) : a(pA), b(pB), c(pC), d(pD) {}
+	Color32 operator()(Color32 pDst, Color32 pSrc) const {
+		return (ComposeStage(a, pDst, pSrc) && ComposeStage(b, pDst, pSrc) && ComposeStage(c, pDst, pSrc) && ComposeStage(d, pDst, pSrc)) ? pSrc : pDst;
+	}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const {
+		if (!GfxExactBlender(*this)) { Blender::Blend(pDst, pSrc, pCount); return; }
+		for (Sint32 i = 0; i < pCount; ++i){
+			pDst[i] = Compose::operator()(pDst[i], pSrc[i]);
+		}
+	}
 };
 
+//
+// Span kernels
+// Blends a span of source colors onto a span of destination
+// colors. Uses SSE2/AVX2/NEON when available at compile time
+// and produces the same result as the per-pixel blenders
+// and operators.
+//
+void GfxSpanAlphaBlend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount);
+void GfxSpanColorKey(Color32 *pDst, const Color32 *pSrc, Sint32 pCount, Color32 pKey);
+void GfxSpanPremultipliedBlend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount);
+void GfxSpanAdd(Color32 *pDst, const Color32 *pSrc, Sint32 pCount); // pDst[i] += pSrc[i]
+void GfxSpanSub(Color32 *pDst, const Color32 *pSrc, Sint32 pCount); // pDst[i] -= pSrc[i]
+void GfxSpanMul(Color32 *pDst, const Color32 *pSrc, Sint32 pCount); // pDst[i] *= pSrc[i]
+void GfxSpanFill(Color32 *pDst, Color32 pColor, Sint32 pCount, bool pStream=false); // pDst[i] = pColor, pStream writes around the cache (non-temporal stores)
+
 //
 // forward declaration
 //
 class Image;
+class ImageView;
 
 //
 // Sampler
-// Base class for pixel sampling.
+// Base class for pixel sampling. Sample takes integer texel
+// coordinates and 16-bit fractions. Span samples pCount
+// colors starting at the 16.16 fixed point coordinate
+// (pU, pV) and stepping (pDu, pDv) per pixel. Filter is what
+// Blit calls once per scanline; it also receives the size of
+// a destination pixel in source texels (16.16, the larger of
+// both axes) for samplers that filter by it, and defaults to
+// Span. The defaults fall back on each other and finally on
+// operator(), so samplers only need to implement the
+// floating point interface.
 //
 class Sampler {
 public:
 	virtual Color32 operator()(const Image &pImage, float pU, float pV) const = 0;
+	virtual Color32 Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY) const;
+	virtual void Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const;
+	virtual void Filter(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Sint32, Color32 *pOut, Sint32 pCount) const { this->Span(pImage, pU, pV, pDu, pDv, pOut, pCount); }
 	virtual ~Sampler( void ) {}
 };
 
@@ -214,92 +471,405 @@ public:
 class Nearest : public Sampler {
 public:
 	Color32 operator()(const Image &pImage, float pU, float pV) const;
+	Color32 Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY) const;
+	void Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const;
 };
 
 //
 // Bilinear
 // Samples the four closest colors and
 // interpolates between the colors to get the
-// most accurate color. Produces artifacts when
-// used in conjunction with alpha and color key
-// blit predicates.
+// most accurate color. Uses 8-bit integer weights
+// and clamps against the edges of the image.
+// Straight interpolation fringes when used with
+// alpha and color key blit predicates, so there
+// are two more modes: Premultiply weights colors
+// by their alpha (the result is still straight
+// alpha, for AlphaBlend), and the color key mode
+// only interpolates non-key colors and returns
+// the key where they cover less than half, for
+// ColorKey. FilterRow and LerpRows split Straight and
+// Premultiply sampling into a horizontal and a vertical pass
+// with the same result, so magnifying blits can filter every
+// source row once and reuse it for all destination rows it
+// lands between (see BlitJob<Blender_t, Bilinear>).
 //
 class Bilinear : public Sampler {
+public:
+	enum Mode { Straight, Premultiply, Keyed };
+private:
+	Mode mode;
+	Color32 key;
+public:
+	Bilinear( void ) : mode(Straight), key(0, 0, 0)								{}
+	explicit Bilinear(Mode pMode) : mode(pMode), key(0, 0, 0)					{}
+	explicit Bilinear(Color32 pColorKey) : mode(Keyed), key(pColorKey)			{}
 public:
 	Color32 operator()(const Image &pImage, float pU, float pV) const;
+	Color32 Sample(const Image &pImage, Sint32 pX, Sint32 pY, Sint32 pFracX, Sint32 pFracY) const;
+	void Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const;
+	bool IsSeparable( void ) const	{ return mode != Keyed; }
+	void FilterRow(const Image &pImage, Uint32 pU, Sint32 pDu, Sint32 pY, Color32 *pOut, Sint32 pCount) const; // horizontal pass of source row pY
+	void LerpRows(const Color32 *pRow0, const Color32 *pRow1, Uint32 pWeight, Color32 *pOut, Sint32 pCount) const; // vertical pass, pWeight/256 towards pRow1
+	Mode GetMode( void ) const		{ return mode; }
+	Color32 GetKey( void ) const	{ return key; }
+};
+
+//
+// Box
+// Samples the nearest color of the mip level closest to the
+// blit footprint, so minified blits read box filtered
+// texels. Same as Nearest for magnified blits and for images
+// without mips (see Image::GenerateMips).
+//
+class Box : public Nearest {
+public:
+	void Filter(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Sint32 pFootprint, Color32 *pOut, Sint32 pCount) const;
+};
+
+//
+// Trilinear
+// Samples the two mip levels around the blit footprint
+// bilinearly and interpolates between them. Same as Bilinear
+// for magnified blits and for images without mips.
+//
+class Trilinear : public Bilinear {
+public:
+	Trilinear( void )												{}
+	explicit Trilinear(Mode pMode) : Bilinear(pMode)				{}
+public:
+	void Filter(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Sint32 pFootprint, Color32 *pOut, Sint32 pCount) const;
+};
+
+//
+// Stats
+// Counters of where drawing time goes, compiled in with
+// GFX_STATS; without it nothing is counted and GfxGetStats
+// returns zeros. Every thread of the pool counts into a slot
+// of its own, threads outside the pool share slot 0 (so
+// draw from one of them). GfxGetStats sums the slots since
+// the last GfxResetStats, e.g. once per frame. Pixels are
+// destination pixels after clipping (Line counts whole
+// lines), calls and times (microseconds, including the work
+// handed to the pool) are per public call. Stream bytes are
+// the bytes tiles are decoded from.
+//
+enum GfxStatBlender { GfxStatAssign, GfxStatAlphaBlend, GfxStatColorKey, GfxStatPremultipliedBlend, GfxStatGrayscale, GfxStatAdditive, GfxStatMultiply, GfxStatScreenBlend, GfxStatModulate, GfxStatCompose, GfxStatOtherBlender, GfxStatBlenders };
+enum GfxStatSampler { GfxStatNearest, GfxStatBilinear, GfxStatBox, GfxStatTrilinear, GfxStatOtherSampler, GfxStatSamplers };
+enum GfxStatTimer { GfxStatFill, GfxStatLine, GfxStatBlit, GfxStatConvert, GfxStatLoad, GfxStatFlipCopy, GfxStatSDLFlip, GfxStatTimers };
+struct GfxStats
+{
+	Uint64 pixels[GfxStatBlenders]; // by Fill, Line and Blit
+	Uint64 blits[GfxStatSamplers];
+	Uint64 streamBytes;
+	Uint64 calls[GfxStatTimers];
+	Uint64 micros[GfxStatTimers];
+};
+GfxStats GfxGetStats( void );
+void GfxResetStats( void );
+GfxStats &GfxStatSlot( void ); // counters of the calling thread
+Uint64 GfxStatClock( void ); // microseconds
+
+inline GfxStatBlender GfxStatOf(const Blender&)				{ return GfxStatOtherBlender; }
+inline GfxStatBlender GfxStatOf(const Assign&)				{ return GfxStatAssign; }
+inline GfxStatBlender GfxStatOf(const AlphaBlend&)			{ return GfxStatAlphaBlend; }
+inline GfxStatBlender GfxStatOf(const ColorKey&)			{ return GfxStatColorKey; }
+inline GfxStatBlender GfxStatOf(const PremultipliedBlend&)	{ return GfxStatPremultipliedBlend; }
+inline GfxStatBlender GfxStatOf(const Grayscale&)			{ return GfxStatGrayscale; }
+inline GfxStatBlender GfxStatOf(const Additive&)			{ return GfxStatAdditive; }
+inline GfxStatBlender GfxStatOf(const Multiply&)			{ return GfxStatMultiply; }
+inline GfxStatBlender GfxStatOf(const ScreenBlend&)			{ return GfxStatScreenBlend; }
+inline GfxStatBlender GfxStatOf(const Modulate&)			{ return GfxStatModulate; }
+template < typename A_t, typename B_t, typename C_t, typename D_t >
+inline GfxStatBlender GfxStatOf(const Compose<A_t, B_t, C_t, D_t>&)	{ return GfxStatCompose; }
+inline GfxStatSampler GfxStatOf(const Sampler&)				{ return GfxStatOtherSampler; }
+inline GfxStatSampler GfxStatOf(const Nearest&)				{ return GfxStatNearest; }
+inline GfxStatSampler GfxStatOf(const Bilinear&)			{ return GfxStatBilinear; }
+inline GfxStatSampler GfxStatOf(const Box&)					{ return GfxStatBox; }
+inline GfxStatSampler GfxStatOf(const Trilinear&)			{ return GfxStatTrilinear; }
+inline Uint64 GfxStatLength(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2)
+{
+	const Uint64 DX = pX2 < pX1 ? pX1 - pX2 : pX2 - pX1;
+	const Uint64 DY = pY2 < pY1 ? pY1 - pY2 : pY2 - pY1;
+	return (DX < DY ? DY : DX) + 1;
+}
+
+//
+// GfxStatScope
+// Times the enclosing scope into a timer of the calling
+// thread.
+//
+class GfxStatScope
+{
+private:
+	GfxStatTimer timer;
+	Uint64 start;
+public:
+	explicit GfxStatScope(GfxStatTimer pTimer) : timer(pTimer), start(GfxStatClock())	{}
+	~GfxStatScope( void )
+	{
+		GfxStats &stats = GfxStatSlot();
+		++stats.calls[timer];
+		stats.micros[timer] += GfxStatClock() - start;
+	}
 };
 
+#ifdef GFX_STATS
+#define GFX_STAT(pStatement) pStatement
+#define GFX_STAT_SCOPE(pTimer) GfxStatScope gfxStatScope(pTimer)
+#else
+#define GFX_STAT(pStatement)
+#define GFX_STAT_SCOPE(pTimer)
+#endif
+
 //
 // Image
 // Class for handling images.
+// Damage tracking is off by default. When enabled, Fill,
+// Line, Blit, Resolve and SetRGB(A) record the areas they
+// write as a short list of coalesced rectangles that
+// GfxFlipDamage uses to upload only what changed. Writes
+// through operator[] are not seen; report them with Damage.
+// GenerateMips builds a chain of half size copies for the
+// Box and Trilinear samplers. The chain is not updated when
+// the image changes, but is freed along with the pixels.
+// Rows of images allocated by Create start on GfxAlignment
+// byte boundaries, so the pitch may be larger than the width.
+// Images hold straight alpha unless Premultiply has been
+// called (or requested by Load/Convert); the state is saved
+// in native files. With GFX_MOVE, moving an image hands over
+// its buffer instead of copying the pixels. The accessors are
+// virtual for subclasses; inner loops go through an ImageView.
 //
 class Image
 {
+public:
+	struct Rect { Sint32 x1, y1, x2, y2; }; // x2 and y2 are exclusive
+	struct Point { Sint32 x, y; };
+	struct Vertex { float x, y, u, v; Color32 color; }; // position, texel coordinates (in pixels of the texture) and color
+	//
+	// BlitArea
+	// Clipped destination area of a blit and the 16.16 fixed
+	// point source coordinates of its first pixel, stepped by
+	// du/dv per destination pixel. sx1..sy2 is the clipped
+	// source rectangle and footprint is the larger of |du|
+	// and |dv|.
+	//
+	struct BlitArea
+	{
+		Sint32 x, y, width, height;
+		Uint32 u, v;
+		Sint32 du, dv, footprint;
+		Sint32 sx1, sy1, sx2, sy2;
+	};
+	//
+	// BlitCommand
+	// One blit of a batch, from src (e.g. an Atlas region) to
+	// dst. Reversed dst edges mirror like in Blit.
+	//
+	struct BlitCommand { Rect dst, src; };
 protected:
 	Color32 *pixels;
 	Sint32 width, height;
+	Sint32 pitch; // distance between rows in pixels
+	void *memory; // buffer from GfxAllocate, 0 for memory given to SetMemory
+	size_t capacity; // size of memory in bytes
+	bool trackDamage;
+	std::vector<Rect> damage;
+	Image *mip; // next mip level (half size), owned
+	bool premultiplied;
+protected:
+	void AddDamage(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2);
+	void Release( void );
 public:
-	Image( void ) : pixels((Color32*)0), width(0), height(0)						{}
-	Image(Sint32 pWidth, Sint32 pHeight) : pixels((Color32*)0), width(0), height(0)	{ this->Create(pWidth, pHeight); }
-	Image(const Image &pImage) : pixels((Color32*)0), width(0), height(0)			{ this->Copy(pImage); }
-	virtual ~Image( void )															{ delete [] pixels; } // don't call virtual functions in destructors
+	Image( void ) : pixels((Color32*)0), width(0), height(0), pitch(0), memory((void*)0), capacity(0), trackDamage(false), mip((Image*)0), premultiplied(false)							{}
+	Image(Sint32 pWidth, Sint32 pHeight) : pixels((Color32*)0), width(0), height(0), pitch(0), memory((void*)0), capacity(0), trackDamage(false), mip((Image*)0), premultiplied(false)	{ this->Create(pWidth, pHeight); }
+	Image(const Image &pImage) : pixels((Color32*)0), width(0), height(0), pitch(0), memory((void*)0), capacity(0), trackDamage(false), mip((Image*)0), premultiplied(false)				{ this->Copy(pImage); }
+	virtual ~Image( void )															{ Release(); delete mip; } // don't call virtual functions in destructors
 public:
 	virtual void Free( void );
 	virtual bool Create(Sint32 pWidth, Sint32 pHeight);
-	virtual void SetMemory(Color32 *pPix, Sint32 pWidth, Sint32 pHeight);
+	virtual void SetMemory(Color32 *pPix, Sint32 pWidth, Sint32 pHeight, Sint32 pPitch=0);
 	virtual bool Copy(const Image &pImage);
-	virtual bool Load(const std::string &pFile);
-	virtual bool Save(const std::string &pFile) const;
-	virtual bool Convert(const std::string &pFile);
+	void Swap(Image &pImage);
+	void Move(Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2, Sint32 pDx, Sint32 pDy);
+	void Scroll(Sint32 pDx, Sint32 pDy)			{ this->Move(0, 0, this->width, this->height, pDx, pDy); } // moves the whole image by pDx, pDy, the uncovered edges keep their pixels
+	virtual bool Load(const std::string &pFile, bool pPremultiply=false);
+	virtual bool Save(const std::string &pFile, bool pCompress=true) const;
+	virtual bool Convert(const std::string &pFile, bool pPremultiply=false);
 	virtual void ReverseByteorder( void );
+	virtual void Premultiply( void );
+	virtual void Unpremultiply( void );
+	bool IsPremultiplied( void ) const	{ return this->premultiplied; }
+	void SetPremultiplied(bool pPremultiplied)	{ this->premultiplied = pPremultiplied; } // marks pixels that were written directly, does not convert them
 	virtual void GetRGB(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB) const;
 	virtual void GetRGBA(Sint32 pX, Sint32 pY, float &pR, float &pG, float &pB, float &pA) const;
 	virtual void SetRGB(Sint32 pX, Sint32 pY, float pR, float pG, float pB);
 	virtual void SetRGBA(Sint32 pX, Sint32 pY, float pR, float pG, float pB, float pA);
 	template < typename Blender_t >
-	void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, Blender_t &pBlend);
+	void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pBlend);
 	template < typename Blender_t >
-	void Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, Blender_t &pBlend);
+	void Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend);
+	template < typename Blender_t >
+	void LineAA(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend);
+	template < typename Blender_t >
+	void Polyline(const Image::Point *pPoints, Sint32 pCount, Color32 pColor, const Blender_t &pBlend);
+	template < typename Blender_t >
+	void PolylineAA(const Image::Point *pPoints, Sint32 pCount, Color32 pColor, const Blender_t &pBlend);
+	template < typename Blender_t >
+	void Triangle(const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Blender_t &pBlend);
 	virtual Sint32 GetWidth( void ) const	{ return this->width; }
 	virtual Sint32 GetHeight( void ) const	{ return this->height; }
+	virtual Sint32 GetPitch( void ) const	{ return this->pitch; }
 	virtual bool IsGood( void ) const		{ return (this->pixels != (Color32*)0); }
 	virtual bool IsBad( void ) const		{ return (this->pixels == (Color32*)0); }
+public:
+	virtual void TrackDamage(bool pTrack);
+	virtual void ClearDamage( void )					{ this->damage.clear(); }
+	bool IsTrackingDamage( void ) const					{ return this->trackDamage; }
+	const std::vector<Rect> &GetDamage( void ) const	{ return this->damage; }
+	void Damage(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2) { if (this->trackDamage) { this->AddDamage(pX1, pY1, pX2, pY2); } } // inline so untracked images pay a single branch
+public:
+	virtual bool GenerateMips( void );
+	void FreeMips( void )								{ delete this->mip; this->mip = (Image*)0; }
+	const Image *GetMip(Sint32 pLevel) const; // level 0 is the image itself, clamped to the smallest level
+	Sint32 GetMipCount( void ) const;
 public:
 	virtual Image &operator=(const Image &pImage);
-	virtual Color32 *operator[](Sint32 pY)				{ return this->pixels + (this->width * pY); }
-	virtual const Color32 *operator[](Sint32 pY) const	{ return this->pixels + (this->width * pY); }
+#ifdef GFX_MOVE
+	Image(Image &&pImage);
+	Image &operator=(Image &&pImage);
+#endif
+	virtual Color32 *operator[](Sint32 pY)				{ return this->pixels + (Sint64)this->pitch*pY; }
+	virtual const Color32 *operator[](Sint32 pY) const	{ return this->pixels + (Sint64)this->pitch*pY; }
 	virtual operator bool( void ) const					{ return this->IsGood(); }
 public:
 	static const Sint32 MaxDimension = USHRT_MAX;
+	static const Sint32 SpanSize = 256; // pixels processed per span kernel call
+	static const Sint32 ParallelSize = 16384; // smallest number of pixels handed to a worker thread
+	static const Sint32 NonTemporalSize = 1 << 20; // pixels an Assign fill covers before it writes around the cache
+	static const Sint32 MaxDamage = 16; // damage rectangles kept before they are forced together
+	static const Sint32 TileSize = 64; // tile size of saved images, and the largest tile size loaded
+	static const Sint32 RowAlign = GfxAlignment / 4; // pitch of created images is a multiple of this many pixels
 public:
 	//
 	// Stream
 	// Class used for streaming native images. There is no
-	// support for streaming non-native images.
+	// support for streaming non-native images. The file is
+	// memory mapped while associated, so untiled rows are read
+	// straight from the mapping. Tiled files are read through
+	// the stream cache one band of tiles at a time, and only
+	// the tiles that a blit reads are decoded. When the file
+	// can not be mapped (e.g. larger than the address space)
+	// untiled files are read through the cache in TileSize
+	// squares. Prefetch decodes the tiles of a source rectangle
+	// into the cache on the worker threads (without workers it
+	// does nothing), e.g. ahead of a scrolling view. Refresh
+	// drops the cached tiles of the file. Do not truncate or
+	// rewrite a file while a Stream is associated to it.
 	//
 	class Stream
 	{
 	private:
 		Sint32 width, height;
 		std::string file;
-		Sint32 dataStart;
+		Sint64 dataStart;
+		const Uint8 *map; // entire file, or null when not mapped
+		Uint64 mapSize;
+		Sint32 tile, tilesX, tilesY; // tile is 0 for untiled files
+		std::vector<Uint64> index; // tile offsets relative to dataStart
+		bool premultiplied;
+		Sint32 cacheId; // file key in the stream cache
+	public:
+		Stream( void ) : width(0), height(0), dataStart(0), map((const Uint8*)0), mapSize(0), tile(0), tilesX(0), tilesY(0), premultiplied(false), cacheId(0)					{}
+		Stream(const Stream &pStream) : width(0), height(0), dataStart(0), map((const Uint8*)0), mapSize(0), tile(0), tilesX(0), tilesY(0), premultiplied(false), cacheId(0)	{ this->Load(pStream.file); }
+		~Stream( void )																									{ this->Free(); }
+		Stream &operator=(const Stream &pStream)																			{ if (this != &pStream) { this->Load(pStream.file); } return *this; }
 	public:
 		void Free( void );
 		bool Load(const std::string &pFile);
 		bool IsGood( void ) const;
 		bool Refresh( void );
+		bool DecodeBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2, Color32 *pOut, Sint32 pPitch) const;
+		bool PinBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2, const Color32 **pTiles) const;
+		void UnpinBand(Sint32 pTy, Sint32 pTx1, Sint32 pTx2) const;
+		void Prefetch(Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2) const;
 	public:
 		Sint32 GetWidth( void ) const				{ return this->width; }
 		Sint32 GetHeight( void ) const				{ return this->height; }
 		const std::string &GetFile( void ) const	{ return this->file; }
-		Sint32 GetDataStart( void ) const			{ return this->dataStart; }
+		Sint64 GetDataStart( void ) const			{ return this->dataStart; }
+		bool IsMapped( void ) const					{ return (this->map != (const Uint8*)0); }
+		bool IsTiled( void ) const					{ return (this->tile > 0); }
+		Sint32 GetTileSize( void ) const			{ return this->tile; }
+		Sint32 GetCacheTileSize( void ) const		{ return this->tile > 0 ? this->tile : Image::TileSize; } // size of the squares the cache holds
+		bool IsPremultiplied( void ) const			{ return this->premultiplied; }
 		bool IsBad( void ) const					{ return !this->IsGood(); }
+		const Color32 *GetRow(Sint32 pY) const		{ return (const Color32*)(this->map + this->dataStart) + (Sint64)pY*this->width; } // only valid when mapped and untiled
+	};
+	//
+	// Sprite
+	// Precompiled image for fast 1:1 blits. Every row is
+	// stored as runs of opaque pixels, which are copied, and
+	// runs of translucent pixels, which are blended (with
+	// PremultipliedBlend if the image was premultiplied,
+	// AlphaBlend otherwise). Transparent pixels are not
+	// stored. Build makes pixels matching the color key
+	// transparent and everything else opaque, like ColorKey.
+	// BuildAlpha makes pixels with alpha at or below
+	// pThreshold transparent and pixels with full alpha
+	// opaque.
+	//
+	class Sprite
+	{
+	public:
+		struct Run { Sint32 x, count, offset; bool blend; };
+	private:
+		Sint32 width, height;
+		std::vector<Run> runs;
+		std::vector<Sint32> rows; // first run of every row, plus the end
+		std::vector<Color32> pixels;
+		bool premultiplied;
+	public:
+		Sprite( void ) : width(0), height(0), premultiplied(false)	{}
+	public:
+		void Free( void );
+		bool Build(const Image &pImage, Color32 pColorKey);
+		bool BuildAlpha(const Image &pImage, Uint8 pThreshold=0);
+	public:
+		Sint32 GetWidth( void ) const					{ return this->width; }
+		Sint32 GetHeight( void ) const					{ return this->height; }
+		bool IsPremultiplied( void ) const				{ return this->premultiplied; }
+		bool IsGood( void ) const						{ return (this->width > 0 && this->height > 0); }
+		bool IsBad( void ) const						{ return !this->IsGood(); }
+		const Run *GetRuns(Sint32 pY) const				{ return this->runs.empty() ? (const Run*)0 : &this->runs[0] + this->rows[pY]; }
+		Sint32 GetRunCount(Sint32 pY) const				{ return this->rows[pY+1] - this->rows[pY]; }
+		const Color32 *GetPixels(const Run &pRun) const	{ return &this->pixels[0] + pRun.offset; }
 	};
 public:
 	template < typename Blender_t, typename Sampler_t >
-	static void Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, Blender_t &pBlend, Sampler_t &pSample, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	static void Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	template < typename Blender_t >
+	static bool Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image::Stream &pSrc, const Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	static void Blit(Image &pDst, Sint32 pX, Sint32 pY, const Image::Sprite &pSrc);
 	template < typename Blender_t >
-	static bool Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image::Stream &pSrc, Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	static void Fill(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pBlend);
+	template < typename Blender_t >
+	static void Line(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend);
+	template < typename Blender_t, typename Sampler_t >
+	static void Blit(const ImageView &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	static void Blit(const ImageView &pDst, Sint32 pX, Sint32 pY, const Image::Sprite &pSrc);
+	template < typename Blender_t, typename Sampler_t >
+	static void Triangle(Image &pDst, const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample);
+	template < typename Blender_t, typename Sampler_t >
+	static void Quad(Image &pDst, const Image::Vertex *pQuad, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample);
+	template < typename Blender_t, typename Sampler_t >
+	static void BlitRotated(Image &pDst, float pX, float pY, float pAngle, float pScaleX, float pScaleY, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	template < typename Blender_t, typename Sampler_t >
+	static void Blit(Image &pDst, const Image &pSrc, const Image::BlitCommand *pCommands, Sint32 pCount, const Blender_t &pBlend, const Sampler_t &pSample);
+	static bool Clip(Sint32 pDstW, Sint32 pDstH, Sint32 pSrcW, Sint32 pSrcH, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2, Image::BlitArea &pArea);
+	static void SortBatch(Image::BlitCommand *pCommands, Sint32 pCount);
+	static bool Resolve(Image &pDst, const Image &pSrc, Sint32 pFactor);
 public:
 	virtual void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor)
 	{
@@ -311,6 +881,38 @@ public:
 		Assign defBlend;
 		this->Line(pX1, pY1, pColor1, pX2, pY2, pColor2, defBlend);
 	}
+	void LineAA(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2)
+	{
+		AlphaBlend defBlend;
+		this->LineAA(pX1, pY1, pColor1, pX2, pY2, pColor2, defBlend);
+	}
+	void Polyline(const Image::Point *pPoints, Sint32 pCount, Color32 pColor)
+	{
+		Assign defBlend;
+		this->Polyline(pPoints, pCount, pColor, defBlend);
+	}
+	void PolylineAA(const Image::Point *pPoints, Sint32 pCount, Color32 pColor)
+	{
+		AlphaBlend defBlend;
+		this->PolylineAA(pPoints, pCount, pColor, defBlend);
+	}
+	void Triangle(const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC)
+	{
+		Assign defBlend;
+		this->Triangle(pA, pB, pC, defBlend);
+	}
+	static void BlitRotated(Image &pDst, float pX, float pY, float pAngle, float pScaleX, float pScaleY, const Image &pSrc, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
+	{
+		Assign defBlend;
+		Nearest defSamp;
+		Image::BlitRotated(pDst, pX, pY, pAngle, pScaleX, pScaleY, pSrc, defBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
+	}
+	template < typename Blender_t >
+	static void BlitRotated(Image &pDst, float pX, float pY, float pAngle, float pScaleX, float pScaleY, const Image &pSrc, const Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
+	{
+		Nearest defSamp;
+		Image::BlitRotated(pDst, pX, pY, pAngle, pScaleX, pScaleY, pSrc, pBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
+	}
 	static void Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
 	{
 		Assign defBlend;
@@ -318,7 +920,7 @@ public:
 		Image::Blit(pDst, pDx1, pDy1, pDx2, pDy2, pSrc, defBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
 	}
 	template < typename Blender_t >
-	static void Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
+	static void Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
 	{
 		Nearest defSamp;
 		Image::Blit(pDst, pDx1, pDy1, pDx2, pDy2, pSrc, pBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
@@ -328,6 +930,116 @@ public:
 		Assign defBlend;
 		return Image::Blit(pDst, pDx1, pDy1, pDx2, pDy2, pSrc, defBlend, pSx1, pSy1, pSx2, pSy2);
 	}
+	static void Fill(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor)
+	{
+		Assign defBlend;
+		Image::Fill(pDst, pX1, pY1, pX2, pY2, pColor, defBlend);
+	}
+	static void Line(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2)
+	{
+		Assign defBlend;
+		Image::Line(pDst, pX1, pY1, pColor1, pX2, pY2, pColor2, defBlend);
+	}
+	static void Blit(Image &pDst, const Image &pSrc, const Image::BlitCommand *pCommands, Sint32 pCount)
+	{
+		Assign defBlend;
+		Nearest defSamp;
+		Image::Blit(pDst, pSrc, pCommands, pCount, defBlend, defSamp);
+	}
+	template < typename Blender_t >
+	static void Blit(Image &pDst, const Image &pSrc, const Image::BlitCommand *pCommands, Sint32 pCount, const Blender_t &pBlend)
+	{
+		Nearest defSamp;
+		Image::Blit(pDst, pSrc, pCommands, pCount, pBlend, defSamp);
+	}
+};
+
+//
+// ImageView
+// Non-virtual window onto pixels: first row, size and pitch.
+// Reading it involves no virtual calls, so the Fill, Line and
+// Blit templates draw into views (the Image versions record
+// damage and then draw into a view of the image). Views do
+// not own their memory and do not record damage.
+//
+class ImageView
+{
+private:
+	Color32 *pixels;
+	Sint32 width, height;
+	Sint32 pitch;
+public:
+	ImageView( void ) : pixels((Color32*)0), width(0), height(0), pitch(0)																{}
+	ImageView(Color32 *pPixels, Sint32 pWidth, Sint32 pHeight, Sint32 pPitch) : pixels(pPixels), width(pWidth), height(pHeight), pitch(pPitch)	{}
+	explicit ImageView(Image &pImage) : pixels(pImage[0]), width(pImage.GetWidth()), height(pImage.GetHeight()), pitch(pImage.GetPitch())	{}
+	ImageView(const ImageView &pView, Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2); // sub-rectangle, clipped to pView
+public:
+	Sint32 GetWidth( void ) const				{ return this->width; }
+	Sint32 GetHeight( void ) const				{ return this->height; }
+	Sint32 GetPitch( void ) const				{ return this->pitch; }
+	bool IsGood( void ) const					{ return (this->pixels != (Color32*)0 && this->width > 0 && this->height > 0); }
+	bool IsBad( void ) const					{ return !this->IsGood(); }
+	Color32 *operator[](Sint32 pY) const		{ return this->pixels + (Sint64)this->pitch*pY; }
+};
+
+//
+// FillJob
+// Fills a band of rows for Fill, one Blend call per span.
+// stream is set for fills larger than NonTemporalSize and is
+// only used by the Assign version below.
+//
+template < typename Blender_t >
+struct FillJob
+{
+	Color32 *dst;
+	Sint32 pitch, count;
+	Color32 color;
+	const Blender_t *blend;
+	bool stream;
+	
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+	{
+		const FillJob &job = *(const FillJob*)pJob;
+		Color32 span[Image::SpanSize];
+		const Sint32 SPAN = job.count<Image::SpanSize ? job.count : Image::SpanSize;
+		for (Sint32 x = 0; x < SPAN; ++x){
+			span[x] = job.color;
+		}
+		Color32 *dst = job.dst + (Sint64)job.pitch*pY1;
+		for (Sint32 y = pY1; y < pY2; ++y, dst += job.pitch){
+			for (Sint32 x = 0; x < job.count; x+=SPAN){
+				job.blend->Blend(dst+x, span, (job.count-x)<SPAN ? (job.count-x) : SPAN);
+			}
+		}
+	}
+};
+
+//
+// FillJob<Assign>
+// Assign fills are pattern fills, straight into the rows.
+//
+template < >
+struct FillJob<Assign>
+{
+	Color32 *dst;
+	Sint32 pitch, count;
+	Color32 color;
+	const Assign *blend;
+	bool stream;
+	
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+	{
+		const FillJob &job = *(const FillJob*)pJob;
+		if (!GfxExactBlender(*job.blend)) {
+			FillJob<Blender> generic = { job.dst, job.pitch, job.count, job.color, job.blend, job.stream };
+			FillJob<Blender>::Rows(&generic, pY1, pY2, 0);
+			return;
+		}
+		Color32 *dst = job.dst + (Sint64)job.pitch*pY1;
+		for (Sint32 y = pY1; y < pY2; ++y, dst += job.pitch){
+			GfxSpanFill(dst, job.color, job.count, job.stream);
+		}
+	}
 };
 
 //
@@ -336,264 +1048,1431 @@ public:
 // the specified predicate (normal assignment is default).
 //
 template < typename Blender_t >
-void Image::Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, Blender_t &pPred)
+void Image::Fill(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pPred)
 {
 	pX1 = 0>pX1 ? 0 : pX1;
 	pY1 = 0>pY1 ? 0 : pY1;
-	pX2 = width<pX2 ? width : pX2;
-	pY2 = height<pY2 ? height : pY2;
+	pX2 = pDst.GetWidth()<pX2 ? pDst.GetWidth() : pX2;
+	pY2 = pDst.GetHeight()<pY2 ? pDst.GetHeight() : pY2;
+	if (pDst.IsBad() || pX2 <= pX1 || pY2 <= pY1) { return; }
+	GFX_STAT_SCOPE(GfxStatFill);
+	GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pPred)] += (Uint64)(pX2 - pX1)*(pY2 - pY1));
 	
-	Color32 *dst = (*this)[pY1];
-	for (Sint32 y = pY1; y < pY2; ++y, dst += width){
-		for (Sint32 x = pX1; x < pX2; ++x){
-			dst[x] = pPred(dst[x], pColor);
-		}
-	}
+	FillJob<Blender_t> job;
+	job.dst = pDst[0] + pX1;
+	job.pitch = pDst.GetPitch();
+	job.count = pX2 - pX1;
+	job.color = pColor;
+	job.blend = &pPred;
+	job.stream = (Sint64)job.count*(pY2 - pY1) > Image::NonTemporalSize;
+	GfxParallel(pY1, pY2, Image::ParallelSize / job.count + 1, FillJob<Blender_t>::Rows, &job);
+}
+
+template < typename Blender_t >
+void Image::Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pPred)
+{
+	if (IsBad()) { return; }
+	Damage(0>pX1 ? 0 : pX1, 0>pY1 ? 0 : pY1, width<pX2 ? width : pX2, height<pY2 ? height : pY2);
+	Image::Fill(ImageView(*this), pX1, pY1, pX2, pY2, pColor, pPred);
 }
 
 //
-// Line
-// Draws a line between the two specified points using the
-// two specified colors and the specified predicate (normal
-// assignment is default).
+// LineRaster
+// Integer line rasterizers shared by Line, LineAA and the
+// polylines. Lines are clipped to pClip (x2 and y2 exclusive)
+// by computing the first and last step inside it, and every
+// step inside is found from the start point alone, so a line
+// drawn in pieces (tiles or bands) hits exactly the same
+// pixels with the same colors. pFirst false skips the start
+// point, which polylines use so joints are not blended twice.
+// Colors are stepped in 16.16 fixed point.
 //
 template < typename Blender_t >
-void Image::Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, Blender_t &pPred)
+struct LineRaster
 {
-	float r1 = pColor1.channels.red;
-	float g1 = pColor1.channels.green;
-	float b1 = pColor1.channels.blue;
-	float a1 = pColor1.channels.alpha;
-	float r2 = pColor2.channels.red;
-	float g2 = pColor2.channels.green;
-	float b2 = pColor2.channels.blue;
-	float a2 = pColor2.channels.alpha;
+	// floor/ceil division for a positive pB
+	static Sint64 FloorDiv(Sint64 pA, Sint64 pB) { return pA >= 0 ? pA / pB : -((-pA + pB - 1) / pB); }
+	static Sint64 CeilDiv(Sint64 pA, Sint64 pB) { return pA >= 0 ? (pA + pB - 1) / pB : -(-pA / pB); }
 	
-	float xdiff = (float)(pX2 - pX1);
-	float ydiff = (float)(pY2 - pY1);
+	//
+	// Steps
+	// Intersects the steps [pI1, pI2] with the steps whose
+	// major axis coordinate pM1 + pSm*i lies in [pC1, pC2).
+	//
+	static void Steps(Sint32 pM1, Sint32 pSm, Sint32 pC1, Sint32 pC2, Sint64 &pI1, Sint64 &pI2)
+	{
+		const Sint64 LO = pSm > 0 ? (Sint64)pC1 - pM1 : (Sint64)pM1 - pC2 + 1;
+		const Sint64 HI = pSm > 0 ? (Sint64)pC2 - 1 - pM1 : (Sint64)pM1 - pC1;
+		pI1 = pI1 > LO ? pI1 : LO;
+		pI2 = pI2 < HI ? pI2 : HI;
+	}
 	
-	if(xdiff == 0.f && ydiff == 0.f) {
-		if (pX1 >= 0 && pX1 < width && pY1 >= 0 && pY1 < height){
-			Color32 color((Uint8)r1, (Uint8)g1, (Uint8)b1, (Uint8)a1);
-			(*this)[pY1][pX1] = pPred((*this)[pY1][pX1], color);
+	//
+	// Colors
+	// Sets up 16.16 fixed point color stepping at step pI of
+	// pN. The start is offset by half a unit so truncating
+	// the accumulated value rounds.
+	//
+	static void Colors(Color32 pColor1, Color32 pColor2, Sint32 pN, Sint64 pI, Sint32 *pC, Sint32 *pDc)
+	{
+		const Sint32 FROM[4] = { pColor1.channels.red, pColor1.channels.green, pColor1.channels.blue, pColor1.channels.alpha };
+		const Sint32 TO[4] = { pColor2.channels.red, pColor2.channels.green, pColor2.channels.blue, pColor2.channels.alpha };
+		for (int c = 0; c < 4; ++c){
+			pDc[c] = pN > 0 ? (TO[c] - FROM[c])*65536 / pN : 0;
+			pC[c] = FROM[c]*65536 + 0x8000 + (Sint32)(pDc[c]*pI);
 		}
-		return;
 	}
 	
-	if(fabs(xdiff) > fabs(ydiff)) {
-		float xmin, xmax;
+	//
+	// Draw
+	// Bresenham line. The minor axis offset at step i is
+	// floor((2*i*a + n) / 2n), i.e. i*a/n rounded, where n
+	// and a are the major and minor axis lengths.
+	//
+	static void Draw(Color32 *pPixels, Sint32 pPitch, const Image::Rect &pClip, Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend, bool pFirst)
+	{
+		const Sint32 SX = pX2 < pX1 ? -1 : 1;
+		const Sint32 SY = pY2 < pY1 ? -1 : 1;
+		const Sint32 ADX = (pX2 - pX1)*SX;
+		const Sint32 ADY = (pY2 - pY1)*SY;
+		const bool XMAJOR = ADX >= ADY;
+		const Sint32 N = XMAJOR ? ADX : ADY; // steps
+		const Sint32 A = XMAJOR ? ADY : ADX; // minor axis length
+		const Sint32 M1 = XMAJOR ? pX1 : pY1, SM = XMAJOR ? SX : SY;
+		const Sint32 N1 = XMAJOR ? pY1 : pX1, SN = XMAJOR ? SY : SX;
+		const Sint32 CM1 = XMAJOR ? pClip.x1 : pClip.y1, CM2 = XMAJOR ? pClip.x2 : pClip.y2;
+		const Sint32 CN1 = XMAJOR ? pClip.y1 : pClip.x1, CN2 = XMAJOR ? pClip.y2 : pClip.x2;
 		
-		// set xmin to the lower x value given
-		// and xmax to the higher value
-		if(pX1 < pX2) {
-			xmin = (float)pX1;
-			xmax = (float)pX2;
-		} else {
-			xmin = (float)pX2;
-			xmax = (float)pX1;
+		// clip the steps against the major axis, then the minor axis
+		Sint64 i1 = pFirst ? 0 : 1;
+		Sint64 i2 = N;
+		Steps(M1, SM, CM1, CM2, i1, i2);
+		Sint64 k1 = 0, k2 = A; // allowed minor axis offsets
+		Steps(N1, SN, CN1, CN2, k1, k2);
+		if (k1 > k2) { return; }
+		if (A > 0) {
+			const Sint64 LO = CeilDiv(2*(Sint64)N*k1 - N, 2*(Sint64)A);
+			const Sint64 HI = FloorDiv(2*(Sint64)N*(k2 + 1) - N - 1, 2*(Sint64)A);
+			i1 = i1 > LO ? i1 : LO;
+			i2 = i2 < HI ? i2 : HI;
 		}
-		xmin = xmin>0.f ? xmin : 0.f; // clipping
-		xmax = xmax<(width-1) ? xmax : (width-1); // clipping
+		if (i1 > i2) { return; }
 		
-		// draw line in terms of y slope
-		float slope = ydiff / xdiff;
-		for(float x = xmin; x <= xmax; x += 1.f) {
-			float y = pY1 + ((x - pX1) * slope);
-			if (y < 0.f || y >= height) continue; // clipping
-			Color32 color(
-						  (Uint8)(r1 + ((r2 - r1) * ((x -pX1) / xdiff))),
-						  (Uint8)(g1 + ((g2 - g1) * ((x -pX1) / xdiff))),
-						  (Uint8)(b1 + ((b2 - b1) * ((x -pX1) / xdiff))),
-						  (Uint8)(a1 + ((a2 - a1) * ((x -pX1) / xdiff)))
-						  );
-			(*this)[(Sint32)y][(Sint32)x] = pPred((*this)[(Sint32)y][(Sint32)x], color);
-		}
-	} else {
-		float ymin, ymax;
+		const Sint64 NUM = N > 0 ? 2*i1*A + N : 0;
+		const Sint32 K = N > 0 ? (Sint32)(NUM / (2*(Sint64)N)) : 0;
+		Sint32 rem = N > 0 ? (Sint32)(NUM % (2*(Sint64)N)) : 0;
+		const Sint32 X = XMAJOR ? pX1 + SX*(Sint32)i1 : pX1 + SX*K;
+		const Sint32 Y = XMAJOR ? pY1 + SY*K : pY1 + SY*(Sint32)i1;
+		const Sint32 MSTEP = XMAJOR ? SX : SY*pPitch;
+		const Sint32 NSTEP = XMAJOR ? SY*pPitch : SX;
+		Sint32 c[4], dc[4];
+		Colors(pColor1, pColor2, N, i1, c, dc);
+		Color32 *dst = pPixels + (Sint64)pPitch*Y + X;
+		for (Sint64 i = i1; i <= i2; ++i, dst += MSTEP){
+			Color32 color;
+			color.channels.red = (Uint8)(c[0] >> 16);
+			color.channels.green = (Uint8)(c[1] >> 16);
+			color.channels.blue = (Uint8)(c[2] >> 16);
+			color.channels.alpha = (Uint8)(c[3] >> 16);
+			*dst = pBlend(*dst, color);
+			c[0] += dc[0];
+			c[1] += dc[1];
+			c[2] += dc[2];
+			c[3] += dc[3];
+			rem += 2*A;
+			if (rem >= 2*N) {
+				rem -= 2*N;
+				dst += NSTEP;
+			}
+		}
+	}
+	
+	//
+	// DrawAA
+	// Wu line. The minor axis position is stepped in 16.16
+	// fixed point and every step covers the two pixels it
+	// falls between, weighted by distance, through alpha.
+	//
+	static void DrawAA(Color32 *pPixels, Sint32 pPitch, const Image::Rect &pClip, Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend, bool pFirst)
+	{
+		const Sint32 SX = pX2 < pX1 ? -1 : 1;
+		const Sint32 SY = pY2 < pY1 ? -1 : 1;
+		const bool XMAJOR = (pX2 - pX1)*SX >= (pY2 - pY1)*SY;
+		const Sint32 N = XMAJOR ? (pX2 - pX1)*SX : (pY2 - pY1)*SY;
+		const Sint32 M1 = XMAJOR ? pX1 : pY1, SM = XMAJOR ? SX : SY;
+		const Sint32 N1 = XMAJOR ? pY1 : pX1;
+		const Sint32 CM1 = XMAJOR ? pClip.x1 : pClip.y1, CM2 = XMAJOR ? pClip.x2 : pClip.y2;
+		const Sint32 CN1 = XMAJOR ? pClip.y1 : pClip.x1, CN2 = XMAJOR ? pClip.y2 : pClip.x2;
+		const Sint64 GRAD = N > 0 ? (Sint64)(XMAJOR ? pY2 - pY1 : pX2 - pX1)*65536 / N : 0;
+		const Sint64 P0 = (Sint64)N1*65536;
 		
-		// set ymin to the lower y value given
-		// and ymax to the higher value
-		if(pY1 < pY2) {
-			ymin = (float)pY1;
-			ymax = (float)pY2;
-		} else {
-			ymin = (float)pY2;
-			ymax = (float)pY1;
+		// clip the steps against the major axis, then keep the ones where either pixel is inside
+		Sint64 i1 = pFirst ? 0 : 1;
+		Sint64 i2 = N;
+		Steps(M1, SM, CM1, CM2, i1, i2);
+		const Sint64 LOW = ((Sint64)CN1 - 1)*65536; // first pixel no lower than CN1-1
+		const Sint64 HIGH = (Sint64)CN2*65536 - 1; // and no higher than CN2-1
+		if (GRAD > 0) {
+			const Sint64 LO = CeilDiv(LOW - P0, GRAD);
+			const Sint64 HI = FloorDiv(HIGH - P0, GRAD);
+			i1 = i1 > LO ? i1 : LO;
+			i2 = i2 < HI ? i2 : HI;
+		} else if (GRAD < 0) {
+			const Sint64 LO = CeilDiv(P0 - HIGH, -GRAD);
+			const Sint64 HI = FloorDiv(P0 - LOW, -GRAD);
+			i1 = i1 > LO ? i1 : LO;
+			i2 = i2 < HI ? i2 : HI;
+		} else if (P0 < LOW || P0 > HIGH) {
+			return;
 		}
-		ymin = ymin>0.f ? ymin : 0.f; // clipping
-		ymax = ymax<(height-1) ? ymax : (height-1); // clipping
+		if (i1 > i2) { return; }
 		
-		// draw line in terms of x slope
-		float slope = xdiff / ydiff;
-		for(float y = ymin; y <= ymax; y += 1.f) {
-			float x = pX1 + ((y - pY1) * slope);
-			if (x < 0.f || x >= width) continue; // clipping
-			Color32 color(
-						  (Uint8)(r1 + ((r2 - r1) * ((y -pY1) / ydiff))),
-						  (Uint8)(g1 + ((g2 - g1) * ((y -pY1) / ydiff))),
-						  (Uint8)(b1 + ((b2 - b1) * ((y -pY1) / ydiff))),
-						  (Uint8)(a1 + ((a2 - a1) * ((y -pY1) / ydiff)))
-						  );
-			(*this)[(Sint32)y][(Sint32)x] = pPred((*this)[(Sint32)y][(Sint32)x], color);
+		Sint64 pos = P0 + GRAD*i1;
+		const Sint32 MSTEP = XMAJOR ? SX : SM*pPitch;
+		const Sint32 NSTEP = XMAJOR ? pPitch : 1;
+		Sint32 c[4], dc[4];
+		Colors(pColor1, pColor2, N, i1, c, dc);
+		Color32 *dst = pPixels + (XMAJOR ? M1 + SM*(Sint32)i1 : (Sint64)pPitch*(M1 + SM*(Sint32)i1));
+		for (Sint64 i = i1; i <= i2; ++i, dst += MSTEP, pos += GRAD){
+			const Sint32 P = (Sint32)(pos >> 16);
+			const Sint32 W = (Sint32)(pos >> 8) & 0xff; // weight of the second pixel
+			Color32 color;
+			color.channels.red = (Uint8)(c[0] >> 16);
+			color.channels.green = (Uint8)(c[1] >> 16);
+			color.channels.blue = (Uint8)(c[2] >> 16);
+			const Sint32 ALPHA = c[3] >> 16;
+			Color32 *pix = dst + NSTEP*P;
+			if (P >= CN1) {
+				color.channels.alpha = (Uint8)((ALPHA*(255 - W) + 127) / 255);
+				*pix = pBlend(*pix, color);
+			}
+			if (P + 1 < CN2 && W > 0) {
+				color.channels.alpha = (Uint8)((ALPHA*W + 127) / 255);
+				pix += NSTEP;
+				*pix = pBlend(*pix, color);
+			}
+			c[0] += dc[0];
+			c[1] += dc[1];
+			c[2] += dc[2];
+			c[3] += dc[3];
 		}
 	}
-}
+};
 
 //
-// Blit
-// Blits specified portion of an image (pSrc) to specified
-// portion of another image (pDst) using a predicate
-// (default normal assignment). If the source portion is
-// larger or smaller than destination portion, then resizing
-// will occur.
+// LineJob
+// Draws the segments of a polyline that cross a band of rows.
+// Each band clips every segment to its rows, so bands never
+// write the same pixel. Draw sets up the bands.
 //
-template < typename Blender_t, typename Sampler_t >
-void Image::Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, Blender_t &pBlend, Sampler_t &pSample, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+template < typename Blender_t, bool Antialias >
+struct LineJob
 {
-	if (pSrc.IsBad() || pDst.IsBad()) {
-		SDL_SetError("Blit: Bad source/destination");
-		return;
-	}
+	Color32 *pixels;
+	Sint32 pitch, width;
+	const Image::Point *points;
+	Sint32 count;
+	Color32 color;
+	const Blender_t *blend;
+	
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+	{
+		const LineJob &job = *(const LineJob*)pJob;
+		const Image::Rect CLIP = { 0, pY1, job.width, pY2 };
+		const Sint32 PAD = Antialias ? 1 : 0; // a Wu line reaches one pixel past its minor axis
+		for (Sint32 i = 1; i < job.count; ++i){
+			const Image::Point &a = job.points[i-1];
+			const Image::Point &b = job.points[i];
+			if ((a.y < b.y ? a.y : b.y) >= pY2 + PAD || (a.y > b.y ? a.y : b.y) < pY1 - PAD) { continue; } // segment misses the band
+			if (Antialias) {
+				LineRaster<Blender_t>::DrawAA(job.pixels, job.pitch, CLIP, a.x, a.y, job.color, b.x, b.y, job.color, *job.blend, i == 1);
+			} else {
+				LineRaster<Blender_t>::Draw(job.pixels, job.pitch, CLIP, a.x, a.y, job.color, b.x, b.y, job.color, *job.blend, i == 1);
+			}
+		}
+	}
+	
+	static void Draw(Image &pDst, const Image::Point *pPoints, Sint32 pCount, Color32 pColor, const Blender_t &pPred)
+	{
+		if (pDst.IsBad() || pCount <= 0) { return; }
+		if (pCount == 1) {
+			pDst.Line(pPoints[0].x, pPoints[0].y, pColor, pPoints[0].x, pPoints[0].y, pColor, pPred);
+			return;
+		}
+		Sint32 x1 = pPoints[0].x, y1 = pPoints[0].y, x2 = x1, y2 = y1;
+		for (Sint32 i = 1; i < pCount; ++i){
+			x1 = pPoints[i].x < x1 ? pPoints[i].x : x1;
+			y1 = pPoints[i].y < y1 ? pPoints[i].y : y1;
+			x2 = pPoints[i].x > x2 ? pPoints[i].x : x2;
+			y2 = pPoints[i].y > y2 ? pPoints[i].y : y2;
+		}
+		GFX_STAT_SCOPE(GfxStatLine);
+#ifdef GFX_STATS
+		GfxStats &stats = GfxStatSlot();
+		for (Sint32 i = 1; i < pCount; ++i){
+			stats.pixels[GfxStatOf(pPred)] += GfxStatLength(pPoints[i-1].x, pPoints[i-1].y, pPoints[i].x, pPoints[i].y) - (i > 1); // joints are drawn once
+		}
+#endif
+		const Sint32 PAD = Antialias ? 1 : 0;
+		pDst.Damage(x1 - PAD, y1 - PAD, x2 + PAD + 1, y2 + PAD + 1);
+		y1 = y1 - PAD > 0 ? y1 - PAD : 0;
+		y2 = y2 + PAD + 1 < pDst.GetHeight() ? y2 + PAD + 1 : pDst.GetHeight();
+		if (y2 <= y1) { return; }
+		
+		LineJob job;
+		job.pixels = pDst[0];
+		job.pitch = pDst.GetPitch();
+		job.width = pDst.GetWidth();
+		job.points = pPoints;
+		job.count = pCount;
+		job.color = pColor;
+		job.blend = &pPred;
+		GfxParallel(y1, y2, Image::ParallelSize / job.width + 1, LineJob::Rows, &job);
+	}
+};
+
+//
+// Line
+// Draws a line between the two specified points (both
+// included) using the two specified colors and the specified
+// predicate (normal assignment is default).
+//
+template < typename Blender_t >
+void Image::Line(const ImageView &pDst, Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pPred)
+{
+	if (pDst.IsBad()) { return; }
+	GFX_STAT_SCOPE(GfxStatLine);
+	GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pPred)] += GfxStatLength(pX1, pY1, pX2, pY2));
+	const Image::Rect CLIP = { 0, 0, pDst.GetWidth(), pDst.GetHeight() };
+	LineRaster<Blender_t>::Draw(pDst[0], pDst.GetPitch(), CLIP, pX1, pY1, pColor1, pX2, pY2, pColor2, pPred, true);
+}
+
+template < typename Blender_t >
+void Image::Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pPred)
+{
+	if (IsBad()) { return; }
+	Damage(pX1<pX2 ? pX1 : pX2, pY1<pY2 ? pY1 : pY2, (pX1>pX2 ? pX1 : pX2) + 1, (pY1>pY2 ? pY1 : pY2) + 1);
+	Image::Line(ImageView(*this), pX1, pY1, pColor1, pX2, pY2, pColor2, pPred);
+}
+
+//
+// LineAA
+// Draws an antialiased (Wu) line. Coverage is written to the
+// alpha channel of the colors, so the predicate should blend
+// (AlphaBlend is default).
+//
+template < typename Blender_t >
+void Image::LineAA(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pPred)
+{
+	if (IsBad()) { return; }
+	GFX_STAT_SCOPE(GfxStatLine);
+	GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pPred)] += GfxStatLength(pX1, pY1, pX2, pY2));
+	Damage((pX1<pX2 ? pX1 : pX2) - 1, (pY1<pY2 ? pY1 : pY2) - 1, (pX1>pX2 ? pX1 : pX2) + 2, (pY1>pY2 ? pY1 : pY2) + 2);
+	const Image::Rect CLIP = { 0, 0, width, height };
+	LineRaster<Blender_t>::DrawAA(pixels, pitch, CLIP, pX1, pY1, pColor1, pX2, pY2, pColor2, pPred, true);
+}
+
+//
+// Polyline
+// Draws pCount-1 connected segments through pPoints in one
+// call, split into bands of rows across the thread pool.
+// Joints are drawn once. PolylineAA draws Wu segments.
+//
+template < typename Blender_t >
+void Image::Polyline(const Image::Point *pPoints, Sint32 pCount, Color32 pColor, const Blender_t &pPred)
+{
+	LineJob<Blender_t, false>::Draw(*this, pPoints, pCount, pColor, pPred);
+}
+
+template < typename Blender_t >
+void Image::PolylineAA(const Image::Point *pPoints, Sint32 pCount, Color32 pColor, const Blender_t &pPred)
+{
+	LineJob<Blender_t, true>::Draw(*this, pPoints, pCount, pColor, pPred);
+}
+
+//
+// TriangleSetup
+// Edge functions and attribute planes of a triangle, used by
+// the triangle rasterizer. Vertices are snapped to 1/16 pixel
+// and pixels are covered when their center is inside, with a
+// top-left fill rule so triangles that share an edge never
+// draw the same pixel twice. Band finds the covered extent of
+// BlockSize rows by walking BlockSize*BlockSize blocks: blocks
+// outside an edge are skipped, blocks inside all edges are
+// taken whole and only blocks on an edge are tested per pixel.
+// Vertices further than Image::MaxDimension from the origin
+// are not drawn.
+//
+struct TriangleSetup
+{
+	static const Sint32 BlockSize = 8;
+	Sint32 x1, y1, x2, y2; // clipped pixel bounds, x2 and y2 are exclusive
+	Sint64 edge[3]; // edge functions at the center of pixel (x1, y1), inside when >= 0
+	Sint32 edgeDx[3], edgeDy[3]; // edge function steps per pixel
+	float attr[6], attrDx[6], attrDy[6]; // u, v, red, green, blue, alpha at the center of pixel (x1, y1), and their steps per pixel
 	
-	// clip pSrcRect against max borders
+	bool Setup(const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Image::Rect &pClip);
+	void Band(Sint32 pY, Sint32 *pX1, Sint32 *pX2) const;
+};
+
+//
+// TriangleJob
+// Shades the covered spans of a triangle, a band of BlockSize
+// rows at a time. Textured triangles sample pSrc at the
+// interpolated texel coordinates (clamped to uvClip) and
+// multiply by the interpolated vertex color unless every
+// vertex is white. Untextured triangles blend the vertex
+// colors. Texel coordinates are in pixels of pSrc, so a
+// vertex at texel (0, 0) maps to the top left texel corner.
+//
+template < typename Blender_t, typename Sampler_t, bool Textured >
+struct TriangleJob
+{
+	const TriangleSetup *setup;
+	Image *dst;
+	const Image *src;
+	const Blender_t *blend;
+	const Sampler_t *sample;
+	Image::Rect uvClip;
+	Sint32 footprint;
+	bool gouraud; // vertex colors differ
+	bool modulate; // textured and some vertex is not white
+	Color32 color; // color when not gouraud
+	
+	// stepping of one fixed point attribute along a span, clamped so that every step stays in [pMin, pMax]
+	static void Step(float pStart, float pEnd, Sint32 pCount, Sint64 pMin, Sint64 pMax, Uint32 &pValue, Sint32 &pDelta)
+	{
+		const Sint64 S = pStart <= (float)pMin ? pMin : (pStart >= (float)pMax ? pMax : (Sint64)pStart);
+		const Sint64 E = pEnd <= (float)pMin ? pMin : (pEnd >= (float)pMax ? pMax : (Sint64)pEnd);
+		Sint64 d = pCount > 1 ? (E - S) / (pCount - 1) : 0;
+		d = d > INT_MAX ? INT_MAX : (d < -INT_MAX ? -INT_MAX : d);
+		pValue = (Uint32)S;
+		pDelta = (Sint32)d;
+	}
+	
+	void Shade(Sint32 pY, Sint32 pX1, Sint32 pX2) const
+	{
+		const TriangleSetup &ts = *setup;
+		const Sint32 COUNT = pX2 - pX1;
+		const float FX = (float)(pX1 - ts.x1);
+		const float FY = (float)(pY - ts.y1);
+		float start[6], end[6];
+		for (int a = 0; a < 6; ++a){
+			start[a] = ts.attr[a] + ts.attrDx[a]*FX + ts.attrDy[a]*FY;
+			end[a] = start[a] + ts.attrDx[a]*(float)(COUNT - 1);
+		}
+		Uint32 u = 0, v = 0;
+		Sint32 du = 0, dv = 0;
+		if (Textured) { // sample positions are texel corners, like Blit, so 1:1 mappings hit texels exactly
+			Step((start[0] - 0.5f)*65536.f, (end[0] - 0.5f)*65536.f, COUNT, (Sint64)uvClip.x1 << 16, ((Sint64)uvClip.x2 << 16) - 1, u, du);
+			Step((start[1] - 0.5f)*65536.f, (end[1] - 0.5f)*65536.f, COUNT, (Sint64)uvClip.y1 << 16, ((Sint64)uvClip.y2 << 16) - 1, v, dv);
+		}
+		Uint32 c[4] = { 0, 0, 0, 0 };
+		Sint32 dc[4] = { 0, 0, 0, 0 };
+		if (gouraud) {
+			for (int a = 0; a < 4; ++a){
+				Step(start[a+2]*65536.f, end[a+2]*65536.f, COUNT, 0, (255 << 16) | 0xffff, c[a], dc[a]);
+			}
+		}
+		
+		Color32 span[Image::SpanSize];
+		Color32 *out = (*dst)[pY] + pX1;
+		for (Sint32 x = 0; x < COUNT; x+=Image::SpanSize){
+			const Sint32 n = (COUNT-x)<Image::SpanSize ? (COUNT-x) : Image::SpanSize;
+			if (Textured) {
+				sample->Filter(*src, u, v, du, dv, footprint, span, n);
+				u += (Uint32)du*(Uint32)n;
+				v += (Uint32)dv*(Uint32)n;
+			}
+			if (!Textured || modulate) {
+				for (Sint32 i = 0; i < n; ++i){
+					Color32 k = color;
+					if (gouraud) {
+						k.channels.red = (Uint8)(c[0] >> 16);
+						k.channels.green = (Uint8)(c[1] >> 16);
+						k.channels.blue = (Uint8)(c[2] >> 16);
+						k.channels.alpha = (Uint8)(c[3] >> 16);
+						c[0] += (Uint32)dc[0];
+						c[1] += (Uint32)dc[1];
+						c[2] += (Uint32)dc[2];
+						c[3] += (Uint32)dc[3];
+					}
+					if (Textured) { // exact t*k/255 per channel
+						Uint32 t;
+						t = span[i].channels.red*k.channels.red + 128;		span[i].channels.red = (Uint8)((t + (t >> 8)) >> 8);
+						t = span[i].channels.green*k.channels.green + 128;	span[i].channels.green = (Uint8)((t + (t >> 8)) >> 8);
+						t = span[i].channels.blue*k.channels.blue + 128;	span[i].channels.blue = (Uint8)((t + (t >> 8)) >> 8);
+						t = span[i].channels.alpha*k.channels.alpha + 128;	span[i].channels.alpha = (Uint8)((t + (t >> 8)) >> 8);
+					} else {
+						span[i] = k;
+					}
+				}
+			}
+			blend->Blend(out + x, span, n);
+		}
+	}
+	
+	static void Rows(void *pJob, Sint32 pBand1, Sint32 pBand2, Sint32)
+	{
+		const TriangleJob &job = *(const TriangleJob*)pJob;
+		Sint32 ex1[TriangleSetup::BlockSize], ex2[TriangleSetup::BlockSize];
+		for (Sint32 b = pBand1; b < pBand2; ++b){
+			const Sint32 Y = job.setup->y1 + b*TriangleSetup::BlockSize;
+			job.setup->Band(Y, ex1, ex2);
+			for (Sint32 r = 0; r < TriangleSetup::BlockSize && Y + r < job.setup->y2; ++r){
+				if (ex1[r] < ex2[r]) { job.Shade(Y + r, ex1[r], ex2[r]); }
+			}
+		}
+	}
+	
+	static void Draw(Image &pDst, const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Image *pSrc, const Image::Rect &pUvClip, const Blender_t &pBlend, const Sampler_t &pSample)
+	{
+		if (pDst.IsBad() || (Textured && (pSrc == (const Image*)0 || pSrc->IsBad()))) { return; }
+		if (Textured && (pUvClip.x2 <= pUvClip.x1 || pUvClip.y2 <= pUvClip.y1)) { return; }
+		TriangleSetup ts;
+		const Image::Rect CLIP = { 0, 0, pDst.GetWidth(), pDst.GetHeight() };
+		if (!ts.Setup(pA, pB, pC, CLIP)) { return; }
+		pDst.Damage(ts.x1, ts.y1, ts.x2, ts.y2);
+		
+		TriangleJob job;
+		job.setup = &ts;
+		job.dst = &pDst;
+		job.src = pSrc;
+		job.blend = &pBlend;
+		job.sample = &pSample;
+		job.uvClip = pUvClip;
+		job.gouraud = pA.color.value != pB.color.value || pA.color.value != pC.color.value;
+		job.modulate = job.gouraud || pA.color.value != 0xffffffff;
+		job.color = pA.color;
+		float fp = 0.f;
+		for (int a = 0; a < 2; ++a){
+			fp = fabs(ts.attrDx[a]) > fp ? fabs(ts.attrDx[a]) : fp;
+			fp = fabs(ts.attrDy[a]) > fp ? fabs(ts.attrDy[a]) : fp;
+		}
+		job.footprint = fp < 32768.f ? (Sint32)(fp*65536.f) : INT_MAX;
+		const Sint32 BANDS = (ts.y2 - ts.y1 + TriangleSetup::BlockSize - 1) / TriangleSetup::BlockSize;
+		GfxParallel(0, BANDS, Image::ParallelSize / ((ts.x2 - ts.x1)*TriangleSetup::BlockSize) + 1, TriangleJob::Rows, &job);
+	}
+};
+
+//
+// Triangle
+// Draws a triangle filled with its (interpolated) vertex
+// colors using the specified predicate (normal assignment is
+// default). The texel coordinates of the vertices are unused.
+//
+template < typename Blender_t >
+void Image::Triangle(const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Blender_t &pBlend)
+{
+	const Image::Rect UVCLIP = { 0, 0, 0, 0 };
+	Nearest defSamp;
+	TriangleJob<Blender_t, Nearest, false>::Draw(*this, pA, pB, pC, (const Image*)0, UVCLIP, pBlend, defSamp);
+}
+
+//
+// Triangle (textured)
+// Draws a triangle of pSrc, affinely mapped by the texel
+// coordinates of the vertices.
+//
+template < typename Blender_t, typename Sampler_t >
+void Image::Triangle(Image &pDst, const Image::Vertex &pA, const Image::Vertex &pB, const Image::Vertex &pC, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample)
+{
+	const Image::Rect UVCLIP = { 0, 0, pSrc.GetWidth(), pSrc.GetHeight() };
+	TriangleJob<Blender_t, Sampler_t, true>::Draw(pDst, pA, pB, pC, &pSrc, UVCLIP, pBlend, pSample);
+}
+
+//
+// Quad
+// Draws the textured quad pQuad[0..3] (in order around its
+// edge, convex) as two triangles.
+//
+template < typename Blender_t, typename Sampler_t >
+void Image::Quad(Image &pDst, const Image::Vertex *pQuad, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample)
+{
+	Image::Triangle(pDst, pQuad[0], pQuad[1], pQuad[2], pSrc, pBlend, pSample);
+	Image::Triangle(pDst, pQuad[0], pQuad[2], pQuad[3], pSrc, pBlend, pSample);
+}
+
+//
+// BlitRotated
+// Draws the source rectangle pSx1..pSy2 scaled by pScaleX and
+// pScaleY, rotated pAngle radians (clockwise on screen) about
+// its center and centered at pX, pY on pDst. Sampling is
+// clamped to the source rectangle, so atlas neighbours do not
+// bleed in.
+//
+template < typename Blender_t, typename Sampler_t >
+void Image::BlitRotated(Image &pDst, float pX, float pY, float pAngle, float pScaleX, float pScaleY, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+{
 	pSx1 = 0>pSx1 ? 0 : pSx1;
 	pSy1 = 0>pSy1 ? 0 : pSy1;
 	pSx2 = pSrc.GetWidth()<pSx2 ? pSrc.GetWidth() : pSx2;
 	pSy2 = pSrc.GetHeight()<pSy2 ? pSrc.GetHeight() : pSy2;
+	if (pSx2 <= pSx1 || pSy2 <= pSy1) { return; }
+	
+	const float HW = 0.5f*(float)(pSx2 - pSx1)*pScaleX;
+	const float HH = 0.5f*(float)(pSy2 - pSy1)*pScaleY;
+	const float COS = (float)cos(pAngle);
+	const float SIN = (float)sin(pAngle);
+	const float OX[4] = { -HW, HW, HW, -HW };
+	const float OY[4] = { -HH, -HH, HH, HH };
+	const Sint32 U[4] = { pSx1, pSx2, pSx2, pSx1 };
+	const Sint32 V[4] = { pSy1, pSy1, pSy2, pSy2 };
+	Image::Vertex quad[4];
+	for (int i = 0; i < 4; ++i){
+		quad[i].x = pX + OX[i]*COS - OY[i]*SIN;
+		quad[i].y = pY + OX[i]*SIN + OY[i]*COS;
+		quad[i].u = (float)U[i];
+		quad[i].v = (float)V[i];
+		quad[i].color = Color32(255, 255, 255, 255);
+	}
+	const Image::Rect UVCLIP = { pSx1, pSy1, pSx2, pSy2 };
+	TriangleJob<Blender_t, Sampler_t, true>::Draw(pDst, quad[0], quad[1], quad[2], &pSrc, UVCLIP, pBlend, pSample);
+	TriangleJob<Blender_t, Sampler_t, true>::Draw(pDst, quad[0], quad[2], quad[3], &pSrc, UVCLIP, pBlend, pSample);
+}
+
+//
+// BlitSpan
+// Draws a single scanline for Blit. pU and pV are 16.16
+// fixed point texel coordinates, pDu is the step per
+// destination pixel and pFootprint is passed on to
+// Sampler::Filter. The scanline is sampled into a span
+// and blended in one call per Image::SpanSize pixels. With
+// Assign the sampler writes straight into the destination.
+//
+template < typename Blender_t, typename Sampler_t >
+struct BlitSpan
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pFootprint)
+	{
+		Color32 span[Image::SpanSize];
+		for (Sint32 x = 0; x < pCount; x+=Image::SpanSize){
+			const Sint32 n = (pCount-x)<Image::SpanSize ? (pCount-x) : Image::SpanSize;
+			pSample.Filter(pSrc, pU, pV, pDu, 0, pFootprint, span, n);
+			pBlend.Blend(pDst+x, span, n);
+			pU+=(Uint32)n*(Uint32)pDu;
+		}
+	}
+};
+
+template < typename Sampler_t >
+struct BlitSpan<Assign, Sampler_t>
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Image &pSrc, const Assign &pBlend, const Sampler_t &pSample, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pFootprint)
+	{
+		if (GfxExactBlender(pBlend)) {
+			pSample.Filter(pSrc, pU, pV, pDu, 0, pFootprint, pDst, pCount);
+		} else {
+			BlitSpan<Blender, Sampler_t>::Draw(pDst, pCount, pSrc, pBlend, pSample, pU, pV, pDu, pFootprint);
+		}
+	}
+};
+
+//
+// BlitSpan<Blender_t, Nearest>
+// Unscaled nearest spans are blended straight from the
+// source row (for Assign, Nearest::Span copies the row).
+//
+template < typename Blender_t >
+struct BlitSpan<Blender_t, Nearest>
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Image &pSrc, const Blender_t &pBlend, const Nearest &pSample, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pFootprint)
+	{
+		if (pDu == 1 << 16) {
+			pBlend.Blend(pDst, pSrc[(Sint32)(pV >> 16)] + (pU >> 16), pCount);
+		} else {
+			BlitSpan<Blender_t, Sampler>::Draw(pDst, pCount, pSrc, pBlend, pSample, pU, pV, pDu, pFootprint);
+		}
+	}
+};
+
+template < >
+struct BlitSpan<Assign, Nearest>
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Image &pSrc, const Assign &pBlend, const Nearest &pSample, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pFootprint)
+	{
+		if (GfxExactBlender(pBlend)) {
+			pSample.Span(pSrc, pU, pV, pDu, 0, pDst, pCount);
+		} else {
+			BlitSpan<Blender, Nearest>::Draw(pDst, pCount, pSrc, pBlend, pSample, pU, pV, pDu, pFootprint);
+		}
+	}
+};
+
+//
+// BlitJob
+// Draws a band of scanlines for Blit. Rows are relative to
+// the first destination row of the blit.
+//
+template < typename Blender_t, typename Sampler_t >
+struct BlitJob
+{
+	Color32 *dst;
+	Sint32 pitch, count;
+	const Image *src;
+	const Blender_t *blend;
+	const Sampler_t *sample;
+	Uint32 u, v;
+	Sint32 du, dv;
+	Sint32 footprint;
 	
-	float u1 = (float)pSx1 / (float)(pSrc.GetWidth()-1);
-	float v1 = (float)pSy1 / (float)(pSrc.GetHeight()-1);
-	float u2 = (float)pSx2 / (float)(pSrc.GetWidth()-1);
-	float v2 = (float)pSy2 / (float)(pSrc.GetHeight()-1);
-	float du = (u2 - u1) / (float)(pDx2 - pDx1);
-	float dv = (v2 - v1) / (float)(pDy2 - pDy1);
-	
-	// enable a negative writable area on pDst (flips blit direction)	
-	if (pDx2 < pDx1) {
-		Sint32 itemp = pDx1;
-		pDx1 = pDx2;
-		pDx2 = itemp;
-		float ftemp = u1;
-		u1 = u2;
-		u2 = ftemp;
-		if (pDx1 < 0) { // make read offset for pSrc + clip against min borders
-			u1 = u1 - du * pDx1;
-			pDx1 = 0;
-		}
-	} else if (pDx1 < 0) { // make read offset for pSrc + clip against min borders
-		u1 = u1 + du * -pDx1;
-		pDx1 = 0;
-	}
-	if (pDy2 < pDy1) {
-		Sint32 itemp = pDy1;
-		pDy1 = pDy2;
-		pDy2 = itemp;
-		float ftemp = v1;
-		v1 = v2;
-		v2 = ftemp;
-		if (pDy1 < 0) { // make read offset for pSrc + clip against min borders
-			v1 = v1 - dv * pDy1;
-			pDy1 = 0;
-		}
-	} else if (pDy1 < 0) { // make read offset for pSrc + clip against min borders
-		v1 = v1 + dv * -pDy1;
-		pDy1 = 0;
-	}
-	
-	// clip pDstRect agains max borders
-	pDx2 = pDst.GetWidth()<pDx2 ? pDst.GetWidth() : pDx2;
-	pDy2 = pDst.GetHeight()<pDy2 ? pDst.GetHeight() : pDy2;
-	
-	// determine writable area
-	const Sint32 MAXY = pDy2 -pDy1;
-	const Sint32 MAXX = pDx2 -pDx1;
-	if (MAXX < 0 || MAXY < 0) { return; } // readable area is negative (probably because pSrc is offscreen)
-	
-	Color32 *dpix = pDst[pDy1];
-	const Sint32 DST_WIDTH = pDst.GetWidth();
+	void Run(Sint32 pHeight)
+	{
+		GfxParallel(0, pHeight, Image::ParallelSize / this->count + 1, BlitJob::Rows, this);
+	}
 	
-	// draw scanlines
-	float v = v1;
-	for (Sint32 y = 0; y < MAXY; ++y, dpix+=DST_WIDTH){
-		float u = u1;
-		for (Sint32 x = 0; x < MAXX; ++x){
-			dpix[x+pDx1] = pBlend(dpix[x+pDx1], pSample(pSrc, u, v));
-			//dpix[x+pDx1] = pSrc[(Sint32)((pSrc.GetHeight()-1)*v)][(Sint32)((pSrc.GetWidth()-1)*u)];
-			u+=du;
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+	{
+		const BlitJob &job = *(const BlitJob*)pJob;
+		Color32 *dpix = job.dst + (Sint64)job.pitch*pY1;
+		Uint32 v = job.v + (Uint32)pY1*(Uint32)job.dv;
+		for (Sint32 y = pY1; y < pY2; ++y, dpix += job.pitch){
+			BlitSpan<Blender_t, Sampler_t>::Draw(dpix, job.count, *job.src, *job.blend, *job.sample, job.u, v, job.du, job.footprint);
+			v+=(Uint32)job.dv;
+		}
+	}
+};
+
+//
+// LerpSpan
+// Interpolates a destination row between two filtered rows
+// and blends it like BlitSpan.
+//
+template < typename Blender_t >
+struct LerpSpan
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Color32 *pRow0, const Color32 *pRow1, Uint32 pWeight, const Blender_t &pBlend, const Bilinear &pSample)
+	{
+		Color32 span[Image::SpanSize];
+		for (Sint32 x = 0; x < pCount; x+=Image::SpanSize){
+			const Sint32 n = (pCount-x)<Image::SpanSize ? (pCount-x) : Image::SpanSize;
+			pSample.LerpRows(pRow0 + x, pRow1 + x, pWeight, span, n);
+			pBlend.Blend(pDst + x, span, n);
+		}
+	}
+};
+
+template < >
+struct LerpSpan<Assign>
+{
+	static void Draw(Color32 *pDst, Sint32 pCount, const Color32 *pRow0, const Color32 *pRow1, Uint32 pWeight, const Assign &pBlend, const Bilinear &pSample)
+	{
+		if (GfxExactBlender(pBlend)) {
+			pSample.LerpRows(pRow0, pRow1, pWeight, pDst, pCount);
+		} else {
+			LerpSpan<Blender>::Draw(pDst, pCount, pRow0, pRow1, pWeight, pBlend, pSample);
 		}
-		v+=dv;
 	}
+};
+
+//
+// BlitJob<Blender_t, Bilinear>
+// Blits that do not minify vertically filter each source row once
+// into one of two cached rows and interpolate every
+// destination row from the pair it falls between.
+//
+template < typename Blender_t >
+struct BlitJob<Blender_t, Bilinear>
+{
+	Color32 *dst;
+	Sint32 pitch, count;
+	const Image *src;
+	const Blender_t *blend;
+	const Bilinear *sample;
+	Uint32 u, v;
+	Sint32 du, dv;
+	Sint32 footprint;
+	bool cache; // rows are filtered into GfxThreadRows
+	
+	//
+	// Run
+	// Draws pHeight rows, with the row cache if the blit can
+	// use it and the row storage is free.
+	//
+	void Run(Sint32 pHeight)
+	{
+		this->cache = this->sample->IsSeparable() && this->dv <= 1 << 16 && this->dv >= -(1 << 16) && GfxReserveRows(this->count*2);
+		GfxParallel(0, pHeight, Image::ParallelSize / this->count + 1, BlitJob::Rows, this);
+		if (this->cache) { GfxReleaseRows(); }
+	}
+	
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32 pThread)
+	{
+		const BlitJob &job = *(const BlitJob*)pJob;
+		Color32 *dpix = job.dst + (Sint64)job.pitch*pY1;
+		Uint32 v = job.v + (Uint32)pY1*(Uint32)job.dv;
+		if (!job.cache) {
+			for (Sint32 y = pY1; y < pY2; ++y, dpix += job.pitch){
+				BlitSpan<Blender_t, Bilinear>::Draw(dpix, job.count, *job.src, *job.blend, *job.sample, job.u, v, job.du, job.footprint);
+				v+=(Uint32)job.dv;
+			}
+			return;
+		}
+		const Sint32 MAX_Y = job.src->GetHeight() - 1;
+		Color32 *rows[2] = { GfxThreadRows(pThread), GfxThreadRows(pThread) + job.count };
+		Sint32 cached[2] = { -1, -1 };
+		for (Sint32 y = pY1; y < pY2; ++y, dpix += job.pitch){
+			const Sint32 Y0 = (Sint32)(v >> 16) < MAX_Y ? (Sint32)(v >> 16) : MAX_Y;
+			const Sint32 Y1 = Y0 < MAX_Y ? Y0+1 : Y0;
+			if (cached[0] != Y0 && cached[1] == Y0) { // moved on by a row, or back (mirrored)
+				Color32 *swap = rows[0];
+				rows[0] = rows[1];
+				rows[1] = swap;
+				cached[1] = cached[0];
+				cached[0] = Y0;
+			}
+			if (cached[0] != Y0) {
+				job.sample->FilterRow(*job.src, job.u, job.du, Y0, rows[0], job.count);
+				cached[0] = Y0;
+			}
+			if (cached[1] != Y1) {
+				job.sample->FilterRow(*job.src, job.u, job.du, Y1, rows[1], job.count);
+				cached[1] = Y1;
+			}
+			LerpSpan<Blender_t>::Draw(dpix, job.count, rows[0], rows[1], (v >> 8) & UCHAR_MAX, *job.blend, *job.sample);
+			v+=(Uint32)job.dv;
+		}
+	}
+};
+
+//
+// Blit
+// Blits specified portion of an image (pSrc) to specified
+// portion of another image (pDst) using a predicate
+// (default normal assignment). If the source portion is
+// larger or smaller than destination portion, then resizing
+// will occur.
+//
+template < typename Blender_t, typename Sampler_t >
+void Image::Blit(const ImageView &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return;
+	}
+	
+	BlitArea area;
+	if (!Image::Clip(pDst.GetWidth(), pDst.GetHeight(), pSrc.GetWidth(), pSrc.GetHeight(), pDx1, pDy1, pDx2, pDy2, pSx1, pSy1, pSx2, pSy2, area)) { return; }
+	GFX_STAT_SCOPE(GfxStatBlit);
+	GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pBlend)] += (Uint64)area.width*area.height);
+	GFX_STAT(++GfxStatSlot().blits[GfxStatOf(pSample)]);
+	
+	// draw scanlines
+	BlitJob<Blender_t, Sampler_t> job;
+	job.dst = pDst[area.y] + area.x;
+	job.pitch = pDst.GetPitch();
+	job.count = area.width;
+	job.src = &pSrc;
+	job.blend = &pBlend;
+	job.sample = &pSample;
+	job.u = area.u;
+	job.v = area.v;
+	job.du = area.du;
+	job.dv = area.dv;
+	job.footprint = area.footprint;
+	job.Run(area.height);
+}
+
+template < typename Blender_t, typename Sampler_t >
+void Image::Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+{
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return;
+	}
+	
+	BlitArea area;
+	if (!Image::Clip(pDst.GetWidth(), pDst.GetHeight(), pSrc.GetWidth(), pSrc.GetHeight(), pDx1, pDy1, pDx2, pDy2, pSx1, pSy1, pSx2, pSy2, area)) { return; }
+	pDst.Damage(area.x, area.y, area.x + area.width, area.y + area.height);
+	Image::Blit(ImageView(pDst), pDx1, pDy1, pDx2, pDy2, pSrc, pBlend, pSample, pSx1, pSy1, pSx2, pSy2);
 }
 
+//
+// StreamJob
+// Draws a band of scanlines for the Stream Blit, reading
+// source rows from the file mapping, where row is source row
+// y0 and pitch is the distance between rows, or from the
+// cached tiles of one band (tiles is not 0), where tile
+// column tx1 starts at source row y0. 1:1 spans are blended
+// directly from the source.
+//
+template < typename Blender_t >
+struct StreamJob
+{
+	Color32 *dst;
+	Sint32 pitch, count;
+	const Color32 *row;
+	Sint64 srcPitch;
+	Sint32 y0;
+	const Color32 *const *tiles;
+	Sint32 tile, tx1;
+	const Blender_t *blend;
+	Uint32 u, v;
+	Sint32 du, dv;
+	
+	static void Span(Color32 *pDst, Sint32 pCount, const Color32 *pRow, const Blender_t &pBlend, Uint32 pU, Sint32 pDu)
+	{
+		if (pDu == (1<<16)) {
+			pBlend.Blend(pDst, pRow + (pU>>16), pCount);
+			return;
+		}
+		Color32 span[Image::SpanSize];
+		for (Sint32 x = 0; x < pCount; x+=Image::SpanSize){
+			const Sint32 n = (pCount-x)<Image::SpanSize ? (pCount-x) : Image::SpanSize;
+			for (Sint32 i = 0; i < n; ++i, pU+=(Uint32)pDu){
+				span[i] = pRow[pU>>16];
+			}
+			pBlend.Blend(pDst+x, span, n);
+		}
+	}
+	
+	//
+	// TileSpan
+	// Span across cached tiles, split where u crosses into the
+	// next tile column. pRow is the row within the tiles.
+	//
+	static void TileSpan(Color32 *pDst, Sint32 pCount, const StreamJob &pJob, Sint32 pRow, Uint32 pU)
+	{
+		while (pCount > 0) {
+			const Sint32 COLUMN = (Sint32)(pU>>16) / pJob.tile;
+			Sint64 n = pCount;
+			if (pJob.du > 0) {
+				n = ((((Sint64)(COLUMN + 1)*pJob.tile) << 16) - (Sint64)pU + pJob.du - 1) / pJob.du;
+			} else if (pJob.du < 0) {
+				n = ((Sint64)pU - (((Sint64)COLUMN*pJob.tile) << 16)) / -pJob.du + 1;
+			}
+			n = n < pCount ? n : pCount;
+			const Color32 *row = pJob.tiles[COLUMN - pJob.tx1] + (Sint64)pRow*pJob.tile;
+			Span(pDst, (Sint32)n, row, *pJob.blend, pU - ((Uint32)(COLUMN*pJob.tile) << 16), pJob.du);
+			pDst += n;
+			pCount -= (Sint32)n;
+			pU += (Uint32)n*(Uint32)pJob.du;
+		}
+	}
+	
+	static void Rows(void *pJob, Sint32 pY1, Sint32 pY2, Sint32)
+	{
+		const StreamJob &job = *(const StreamJob*)pJob;
+		Color32 *dpix = job.dst + (Sint64)job.pitch*pY1;
+		Uint32 v = job.v + (Uint32)pY1*(Uint32)job.dv;
+		for (Sint32 y = pY1; y < pY2; ++y, dpix += job.pitch){
+			if (job.tiles != (const Color32*const*)0) {
+				TileSpan(dpix, job.count, job, (Sint32)(v>>16) - job.y0, job.u);
+			} else {
+				Span(dpix, job.count, job.row + (Sint64)((Sint32)(v>>16) - job.y0)*job.srcPitch, *job.blend, job.u, job.du);
+			}
+			v+=(Uint32)job.dv;
+		}
+	}
+};
+
 //
 // Blit
 // Blits (streams) specified portion of a file (pSrc) to
 // specified portion of an image (pDst) using a predicate
 // (default normal assignment). If the source portion is
 // larger or smaller than destination portion, then
-// resizing will occur.
+// resizing will occur. Texel stepping is identical to the
+// Image Blit.
 //
 template < typename Blender_t >
-bool Image::Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image::Stream &pSrc, Blender_t &pBlend, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+bool Image::Blit(Image &pDst, Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image::Stream &pSrc, const Blender_t &pBlend, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
 {
-	// clip pSrcRect against max borders
-	pSx1 = 0>pSx1 ? 0 : pSx1;
-	pSy1 = 0>pSy1 ? 0 : pSy1;
-	pSx2 = pSrc.GetWidth()<pSx2 ? pSrc.GetWidth() : pSx2;
-	pSy2 = pSrc.GetHeight()<pSy2 ? pSrc.GetHeight() : pSy2;
+	if (pSrc.IsBad() || pDst.IsBad()) {
+		SDL_SetError("Blit: Bad source/destination");
+		return false;
+	}
 	
-	const Sint32 SCALEX = (Sint32)((float)(pSx2 -pSx1) /(float)(pDx2 -pDx1) *(1<<16));
-	const Sint32 SCALEY = (Sint32)((float)(pSy2 -pSy1) /(float)(pDy2 -pDy1) *(1<<16));
+	BlitArea area;
+	if (!Image::Clip(pDst.GetWidth(), pDst.GetHeight(), pSrc.GetWidth(), pSrc.GetHeight(), pDx1, pDy1, pDx2, pDy2, pSx1, pSy1, pSx2, pSy2, area)) { return true; }
+	pDst.Damage(area.x, area.y, area.x + area.width, area.y + area.height);
+	GFX_STAT_SCOPE(GfxStatBlit);
+	GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pBlend)] += (Uint64)area.width*area.height);
+	GFX_STAT(++GfxStatSlot().blits[GfxStatNearest]);
+	const Sint32 MAXX = area.width;
+	const Sint32 MAXY = area.height;
+	const Sint32 dv = area.dv;
 	
-	// make read offset for pSrc
-	Sint32 sx = 0;
-	Sint32 sy = 0;
-	if (pDx1 < 0) { sx = -pDx1; }
-	if (pDy1 < 0) { sy = -pDy1; }
+	StreamJob<Blender_t> job;
+	job.dst = pDst[area.y] + area.x;
+	job.pitch = pDst.GetPitch();
+	job.count = MAXX;
+	job.blend = &pBlend;
+	job.u = area.u;
+	job.v = area.v;
+	job.du = area.du;
+	job.dv = dv;
+	job.tiles = (const Color32*const*)0;
 	
-	// clip pDstRect agains max borders
-	pDx1 = 0>pDx1 ? 0 : pDx1;
-	pDy1 = 0>pDy1 ? 0 : pDy1;
-	pDx2 = pDst.GetWidth()<pDx2 ? pDst.GetWidth() : pDx2;
-	pDy2 = pDst.GetHeight()<pDy2 ? pDst.GetHeight() : pDy2;
+	if (pSrc.IsMapped() && !pSrc.IsTiled()) {
+		job.row = pSrc.GetRow(0);
+		job.srcPitch = pSrc.GetWidth();
+		job.y0 = 0;
+		GfxParallel(0, MAXY, Image::ParallelSize / MAXX + 1, StreamJob<Blender_t>::Rows, &job);
+		return true;
+	}
 	
-	// determine writable area
-	const Sint32 MAXY = pDy2 -pDy1;
-	const Sint32 MAXX = pDx2 -pDx1;
-	if (MAXX < 0 || MAXY < 0) {  return true; } // readable area is negative (probably because pSrc is offscreen)
+	// read the cached tiles of the band that destination rows land in, one band at a time
+	const Sint32 TILE = pSrc.GetCacheTileSize();
+	const Sint32 TX1 = area.sx1 / TILE;
+	const Sint32 TX2 = (area.sx2 - 1) / TILE + 1;
+	std::vector<const Color32*> tiles((size_t)(TX2 - TX1));
+	Color32 *dst = job.dst;
+	Uint32 v = job.v;
+	job.tiles = &tiles[0];
+	job.tile = TILE;
+	job.tx1 = TX1;
+	for (Sint32 y = 0; y < MAXY; ){
+		const Sint32 TY = (Sint32)(v>>16) / TILE;
+		if (!pSrc.PinBand(TY, TX1, TX2, &tiles[0])) {
+			SDL_SetError("Blit: Could not read stream");
+			return false;
+		}
+		Sint32 y2 = y;
+		Uint32 v2 = v;
+		while (y2 < MAXY && (Sint32)(v2>>16) / TILE == TY) {
+			++y2;
+			v2+=(Uint32)dv;
+		}
+		job.dst = dst + (Sint64)y*job.pitch;
+		job.v = v;
+		job.y0 = TY*TILE;
+		GfxParallel(0, y2 - y, Image::ParallelSize / MAXX + 1, StreamJob<Blender_t>::Rows, &job);
+		pSrc.UnpinBand(TY, TX1, TX2);
+		y = y2;
+		v = v2;
+	}
+	return true;
+}
+
+//
+// BatchJob
+// Draws a batch of clipped blits that has been binned by
+// destination rows. Each bin owns a band of destination rows,
+// so bins run in parallel without touching the same pixels,
+// and within a bin the commands are drawn in submission order.
+//
+template < typename Blender_t, typename Sampler_t >
+struct BatchJob
+{
+	Color32 *dst;
+	Sint32 pitch, binRows;
+	const Image *src;
+	const Blender_t *blend;
+	const Sampler_t *sample;
+	const Image::BlitArea *areas;
+	const Sint32 *bins; // indices into areas, per bin
+	const Sint32 *binStart; // first index into bins, per bin (plus one past the end)
 	
-	Color32 *dpix = pDst[pDy1];
-	const Sint32 DST_WIDTH = pDst.GetWidth();
-	const Sint32 SrcTypeSize = sizeof(Color32);
-	const Sint32 SrcXByteRead = ((pSx2 -pSx1) *SrcTypeSize)>0 ? ((pSx2 -pSx1) *SrcTypeSize) : 0;
-	const Sint32 SrcByteWidth = pSrc.GetWidth()*SrcTypeSize;
-	const Sint32 SrcXOffset = (pSx1 *SrcTypeSize) + pSrc.GetDataStart();
+	static void Rows(void *pJob, Sint32 pBin1, Sint32 pBin2, Sint32)
+	{
+		const BatchJob &job = *(const BatchJob*)pJob;
+		for (Sint32 b = pBin1; b < pBin2; ++b){
+			const Sint32 ROW1 = b * job.binRows;
+			const Sint32 ROW2 = ROW1 + job.binRows;
+			for (Sint32 i = job.binStart[b]; i < job.binStart[b+1]; ++i){
+				const Image::BlitArea &area = job.areas[job.bins[i]];
+				const Sint32 Y1 = area.y > ROW1 ? area.y : ROW1;
+				const Sint32 Y2 = area.y + area.height < ROW2 ? area.y + area.height : ROW2;
+				Color32 *dpix = job.dst + (Sint64)job.pitch*Y1 + area.x;
+				Uint32 v = area.v + (Uint32)(Y1 - area.y)*(Uint32)area.dv;
+				for (Sint32 y = Y1; y < Y2; ++y, dpix += job.pitch){
+					BlitSpan<Blender_t, Sampler_t>::Draw(dpix, area.width, *job.src, *job.blend, *job.sample, area.u, v, area.du, area.footprint);
+					v+=(Uint32)area.dv;
+				}
+			}
+		}
+	}
+};
+
+//
+// Blit (batch)
+// Draws pCount blits from pSrc (typically an Atlas) to pDst in
+// one pass. Every command is clipped once and binned by the
+// destination rows it covers, then the bins are drawn across
+// the thread pool. The result is identical to calling Blit
+// once per command in the same order. See SortBatch.
+//
+template < typename Blender_t, typename Sampler_t >
+void Image::Blit(Image &pDst, const Image &pSrc, const Image::BlitCommand *pCommands, Sint32 pCount, const Blender_t &pBlend, const Sampler_t &pSample)
+{
+	if (pDst.IsBad() || pSrc.IsBad() || pCount <= 0) { return; }
+	GFX_STAT_SCOPE(GfxStatBlit);
 	
-	// allocate memory
-	Color32 *spix = new Color32[pSx2 -pSx1]; // I trust this will not fail, even if that might be the case
+	// clip every command, skip those that draw nothing
+	std::vector<Image::BlitArea> areas;
+	areas.reserve((size_t)pCount);
+	Image::BlitArea area;
+	for (Sint32 i = 0; i < pCount; ++i){
+		const Image::BlitCommand &cmd = pCommands[i];
+		if (!Image::Clip(pDst.GetWidth(), pDst.GetHeight(), pSrc.GetWidth(), pSrc.GetHeight(), cmd.dst.x1, cmd.dst.y1, cmd.dst.x2, cmd.dst.y2, cmd.src.x1, cmd.src.y1, cmd.src.x2, cmd.src.y2, area)) { continue; }
+		pDst.Damage(area.x, area.y, area.x + area.width, area.y + area.height);
+		GFX_STAT(GfxStatSlot().pixels[GfxStatOf(pBlend)] += (Uint64)area.width*area.height);
+		areas.push_back(area);
+	}
+	GFX_STAT(GfxStatSlot().blits[GfxStatOf(pSample)] += areas.size());
+	if (areas.empty()) { return; }
 	
-	// open file stream (in)
-	std::ifstream fin(pSrc.GetFile().c_str(), std::ios::binary);
-	if (!fin.is_open()) { return false; } // file could not be opened
+	// bin by destination rows, keeping submission order within each bin
+	const Sint32 BINROWS = Image::ParallelSize / pDst.GetWidth() + 1;
+	const Sint32 BINS = (pDst.GetHeight() + BINROWS - 1) / BINROWS;
+	std::vector<Sint32> binStart((size_t)BINS + 1, 0);
+	for (size_t i = 0; i < areas.size(); ++i){
+		const Sint32 B2 = (areas[i].y + areas[i].height - 1) / BINROWS;
+		for (Sint32 b = areas[i].y / BINROWS; b <= B2; ++b){ ++binStart[b+1]; }
+	}
+	for (Sint32 b = 0; b < BINS; ++b){ binStart[b+1] += binStart[b]; }
+	std::vector<Sint32> bins((size_t)binStart[BINS]);
+	std::vector<Sint32> fill(binStart.begin(), binStart.end() - 1);
+	for (size_t i = 0; i < areas.size(); ++i){
+		const Sint32 B2 = (areas[i].y + areas[i].height - 1) / BINROWS;
+		for (Sint32 b = areas[i].y / BINROWS; b <= B2; ++b){ bins[fill[b]++] = (Sint32)i; }
+	}
 	
-	// draw scanlines
-	for (Sint32 y = 0; y < MAXY; ++y, dpix+=DST_WIDTH){
-		fin.seekg( (std::streamoff)(((((SCALEY*(y+sy))>>16)+pSy1)*SrcByteWidth) + SrcXOffset) ); // NOTE: Might not be able to access bytes beyond the INT32_MAX limit.
-		fin.read((char*)spix, SrcXByteRead);
-		for (Sint32 x = 0; x < MAXX; ++x){
-			dpix[x+pDx1] = pBlend(dpix[x+pDx1], spix[((SCALEX*(x+sx))>>16)]);
-		}
+	BatchJob<Blender_t, Sampler_t> job;
+	job.dst = pDst[0];
+	job.pitch = pDst.GetPitch();
+	job.binRows = BINROWS;
+	job.src = &pSrc;
+	job.blend = &pBlend;
+	job.sample = &pSample;
+	job.areas = &areas[0];
+	job.bins = &bins[0];
+	job.binStart = &binStart[0];
+	GfxParallel(0, BINS, 1, BatchJob<Blender_t, Sampler_t>::Rows, &job);
+}
+
+//
+// Atlas
+// Image that packs many small images into itself, so they can
+// be drawn from one texture (see the batch Blit). Packing uses
+// a skyline: the used area is kept as a list of horizontal
+// segments, and a new rectangle goes where its top edge ends
+// up lowest. Every rectangle is followed by pPadding blank
+// pixels on its right and bottom edges, which keeps filtered
+// samplers from bleeding neighbours into each other. The
+// returned rect can be passed directly as pSx1..pSy2. Anything
+// that recreates the pixels (Create, Load, Copy) resets the
+// packer.
+//
+class Atlas : public Image
+{
+private:
+	struct Segment { Sint32 x, y, width; };
+private:
+	std::vector<Segment> skyline;
+	Sint32 padding;
+public:
+	Atlas( void );
+	Atlas(Sint32 pWidth, Sint32 pHeight, Sint32 pPadding=0);
+	~Atlas( void ) {}
+public:
+	void Free( void );
+	bool Create(Sint32 pWidth, Sint32 pHeight);
+	void Reset( void );
+	bool Reserve(Sint32 pWidth, Sint32 pHeight, Image::Rect &pRect);
+	bool Insert(const Image &pSrc, Image::Rect &pRect);
+	void SetPadding(Sint32 pPadding)	{ this->padding = pPadding < 0 ? 0 : pPadding; }
+	Sint32 GetPadding( void ) const		{ return this->padding; }
+};
+
+//
+// FloatImage
+// Float buffer for passes that accumulate light or composite
+// in high dynamic range. Each row stores red, green, blue and
+// alpha as four planes of GetPitch floats, so kernels read
+// four pixels of a channel at once. Nothing is clamped until
+// Quantize writes the buffer to an Image, rounding or with
+// 4x4 ordered dithering; Expand and Blit read Images with
+// channels 0 to 255 becoming 0 to 1 (times pWeight), and
+// Blit and Fill either assign or add. Work is split across
+// the worker pool and uses SSE2/NEON where available.
+//
+class FloatImage
+{
+public:
+	enum Channel { Red, Green, Blue, Alpha, Channels };
+	static const Sint32 RowAlign = GfxAlignment / sizeof(float); // plane rows are aligned to GfxAlignment
+private:
+	float *planes;
+	size_t capacity;
+	Sint32 width, height, pitch;
+private:
+	FloatImage(const FloatImage&); // buffers are large, copies are made with Blit
+	FloatImage &operator=(const FloatImage&);
+public:
+	FloatImage( void ) : planes((float*)0), capacity(0), width(0), height(0), pitch(0)	{}
+	FloatImage(Sint32 pWidth, Sint32 pHeight);
+	~FloatImage( void )	{ Free(); }
+public:
+	void Free( void );
+	bool Create(Sint32 pWidth, Sint32 pHeight); // all channels 0
+	bool Expand(const Image &pSrc);
+	bool Quantize(Image &pDst, bool pDither=false) const;
+	void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, float pR, float pG, float pB, float pA, bool pAdd=false);
+	static void Blit(FloatImage &pDst, Sint32 pDx, Sint32 pDy, const Image &pSrc, float pWeight=1.f, bool pAdd=false, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	
+	Sint32 GetWidth( void ) const	{ return this->width; }
+	Sint32 GetHeight( void ) const	{ return this->height; }
+	Sint32 GetPitch( void ) const	{ return this->pitch; }
+	bool IsGood( void ) const		{ return (this->planes != (float*)0); }
+	bool IsBad( void ) const		{ return (this->planes == (float*)0); }
+	float *GetRow(Sint32 pY, Channel pChannel)				{ return this->planes + ((Sint64)pY*Channels + pChannel)*this->pitch; }
+	const float *GetRow(Sint32 pY, Channel pChannel) const	{ return this->planes + ((Sint64)pY*Channels + pChannel)*this->pitch; }
+};
+
+//
+// DrawList
+// Records Fill, Line and Blit calls against one image instead
+// of drawing them right away. Execute bins the recorded calls
+// into TileSize*TileSize tiles (small enough that a tile stays
+// in L2 while every call touching it is drawn) and draws the
+// tiles across the thread pool, each tile running its calls in
+// recording order. The result is the same as making the calls
+// directly. Blenders and samplers are copied when recorded,
+// but source images and sprites are not, so they must stay
+// alive and unchanged until Execute. Call Execute before
+// presenting (e.g. before GfxFlip).
+//
+class DrawList
+{
+public:
+	static const Sint32 TileSize = 128; // 64 KiB of 32-bit pixels per tile
+private:
+	//
+	// Command
+	// A recorded call. Draw replays it onto a view of the tile
+	// at pX, pY, with coordinates moved into the view. bounds
+	// is the clipped area it covers on the target.
+	//
+	struct Command
+	{
+		Image::Rect bounds;
+		virtual void Draw(const ImageView &pTile, Sint32 pX, Sint32 pY) const = 0;
+		virtual ~Command( void ) {}
+	};
+	template < typename Blender_t >
+	struct FillCommand : public Command
+	{
+		Sint32 x1, y1, x2, y2;
+		Color32 color;
+		Blender_t blend;
+		FillCommand(const Blender_t &pBlend) : blend(pBlend) {}
+		void Draw(const ImageView &pTile, Sint32 pX, Sint32 pY) const { Image::Fill(pTile, x1 - pX, y1 - pY, x2 - pX, y2 - pY, color, blend); }
+	};
+	template < typename Blender_t >
+	struct LineCommand : public Command
+	{
+		Sint32 x1, y1, x2, y2;
+		Color32 color1, color2;
+		Blender_t blend;
+		LineCommand(const Blender_t &pBlend) : blend(pBlend) {}
+		void Draw(const ImageView &pTile, Sint32 pX, Sint32 pY) const { Image::Line(pTile, x1 - pX, y1 - pY, color1, x2 - pX, y2 - pY, color2, blend); }
+	};
+	template < typename Blender_t, typename Sampler_t >
+	struct BlitCommand : public Command
+	{
+		Sint32 dx1, dy1, dx2, dy2, sx1, sy1, sx2, sy2;
+		const Image *src;
+		Blender_t blend;
+		Sampler_t sample;
+		BlitCommand(const Blender_t &pBlend, const Sampler_t &pSample) : blend(pBlend), sample(pSample) {}
+		void Draw(const ImageView &pTile, Sint32 pX, Sint32 pY) const { Image::Blit(pTile, dx1 - pX, dy1 - pY, dx2 - pX, dy2 - pY, *src, blend, sample, sx1, sy1, sx2, sy2); }
+	};
+	struct SpriteCommand : public Command
+	{
+		Sint32 x, y;
+		const Image::Sprite *src;
+		void Draw(const ImageView &pTile, Sint32 pX, Sint32 pY) const { Image::Blit(pTile, x - pX, y - pY, *src); }
+	};
+private:
+	Image *target;
+	std::vector<Command*> commands;
+private:
+	DrawList(const DrawList&); // commands are owned, so lists are not copied
+	DrawList &operator=(const DrawList&);
+	bool Clip(Image::Rect &pRect) const;
+	struct DrawJob;
+	static void DrawTiles(void *pJob, Sint32 pTile1, Sint32 pTile2, Sint32 pThread);
+public:
+	explicit DrawList(Image &pTarget) : target(&pTarget)	{}
+	~DrawList( void )										{ Clear(); }
+public:
+	template < typename Blender_t >
+	void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pBlend);
+	template < typename Blender_t >
+	void Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend);
+	template < typename Blender_t, typename Sampler_t >
+	void Blit(Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension);
+	void Blit(Sint32 pX, Sint32 pY, const Image::Sprite &pSrc);
+	void Execute( void );
+	void Clear( void );
+	Sint32 GetCount( void ) const	{ return (Sint32)this->commands.size(); }
+	Image &GetTarget( void ) const	{ return *this->target; }
+public:
+	void Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor)
+	{
+		Assign defBlend;
+		this->Fill(pX1, pY1, pX2, pY2, pColor, defBlend);
 	}
-	delete [] spix;
-	fin.close();
-	return true;
+	void Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2)
+	{
+		Assign defBlend;
+		this->Line(pX1, pY1, pColor1, pX2, pY2, pColor2, defBlend);
+	}
+	template < typename Blender_t >
+	void Blit(Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
+	{
+		Nearest defSamp;
+		this->Blit(pDx1, pDy1, pDx2, pDy2, pSrc, pBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
+	}
+	void Blit(Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, Sint32 pSx1=0, Sint32 pSy1=0, Sint32 pSx2=Image::MaxDimension, Sint32 pSy2=Image::MaxDimension)
+	{
+		Assign defBlend;
+		Nearest defSamp;
+		this->Blit(pDx1, pDy1, pDx2, pDy2, pSrc, defBlend, defSamp, pSx1, pSy1, pSx2, pSy2);
+	}
+};
+
+//
+// Fill (DrawList)
+//
+template < typename Blender_t >
+void DrawList::Fill(Sint32 pX1, Sint32 pY1, Sint32 pX2, Sint32 pY2, Color32 pColor, const Blender_t &pBlend)
+{
+	Image::Rect bounds = { pX1, pY1, pX2, pY2 };
+	if (!Clip(bounds)) { return; }
+	FillCommand<Blender_t> *cmd = new FillCommand<Blender_t>(pBlend);
+	cmd->bounds = bounds;
+	cmd->x1 = pX1;
+	cmd->y1 = pY1;
+	cmd->x2 = pX2;
+	cmd->y2 = pY2;
+	cmd->color = pColor;
+	commands.push_back(cmd);
+}
+
+//
+// Line (DrawList)
+//
+template < typename Blender_t >
+void DrawList::Line(Sint32 pX1, Sint32 pY1, Color32 pColor1, Sint32 pX2, Sint32 pY2, Color32 pColor2, const Blender_t &pBlend)
+{
+	Image::Rect bounds = { pX1<pX2 ? pX1 : pX2, pY1<pY2 ? pY1 : pY2, (pX1>pX2 ? pX1 : pX2) + 1, (pY1>pY2 ? pY1 : pY2) + 1 };
+	if (!Clip(bounds)) { return; }
+	LineCommand<Blender_t> *cmd = new LineCommand<Blender_t>(pBlend);
+	cmd->bounds = bounds;
+	cmd->x1 = pX1;
+	cmd->y1 = pY1;
+	cmd->x2 = pX2;
+	cmd->y2 = pY2;
+	cmd->color1 = pColor1;
+	cmd->color2 = pColor2;
+	commands.push_back(cmd);
+}
+
+//
+// Blit (DrawList)
+//
+template < typename Blender_t, typename Sampler_t >
+void DrawList::Blit(Sint32 pDx1, Sint32 pDy1, Sint32 pDx2, Sint32 pDy2, const Image &pSrc, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pSx1, Sint32 pSy1, Sint32 pSx2, Sint32 pSy2)
+{
+	Image::BlitArea area;
+	if (pSrc.IsBad() || !Image::Clip(target->GetWidth(), target->GetHeight(), pSrc.GetWidth(), pSrc.GetHeight(), pDx1, pDy1, pDx2, pDy2, pSx1, pSy1, pSx2, pSy2, area)) { return; }
+	BlitCommand<Blender_t, Sampler_t> *cmd = new BlitCommand<Blender_t, Sampler_t>(pBlend, pSample);
+	cmd->bounds.x1 = area.x;
+	cmd->bounds.y1 = area.y;
+	cmd->bounds.x2 = area.x + area.width;
+	cmd->bounds.y2 = area.y + area.height;
+	cmd->dx1 = pDx1;
+	cmd->dy1 = pDy1;
+	cmd->dx2 = pDx2;
+	cmd->dy2 = pDy2;
+	cmd->sx1 = pSx1;
+	cmd->sy1 = pSy1;
+	cmd->sx2 = pSx2;
+	cmd->sy2 = pSy2;
+	cmd->src = &pSrc;
+	commands.push_back(cmd);
 }
 
+//
+// ImageLoader
+// Loads images in the background on the worker threads.
+// Submit queues a file for an image and returns a ticket;
+// native files are read with Load and anything else with
+// Convert. Queued files start in order of priority (highest
+// first, then in the order submitted), and at most half of
+// the workers load at a time so that drawing keeps some
+// threads. Poll, called from the thread that owns the
+// targets (e.g. once per frame), moves finished images into
+// their targets without copying pixels and reports them to
+// the callback. Wait finishes one ticket right away, loading
+// it on the calling thread if it has not started. Without
+// worker threads, Poll loads one queued file per call on the
+// calling thread. A target must outlive its ticket. Files
+// still queued when GfxQuit runs are reported as failed.
+//
+class ImageLoader
+{
+public:
+	enum State { None, Queued, Loading, Ready };
+	typedef void (*Callback)(Sint32 pTicket, Image &pTarget, bool pSuccess, void *pUser);
+private:
+	struct Task;
+	std::vector<Task*> tasks;
+	Sint32 next;
+	Callback callback;
+	void *user;
+private:
+	ImageLoader(const ImageLoader&);
+	ImageLoader &operator=(const ImageLoader&);
+	Task *Find(Sint32 pTicket) const;
+	bool Deliver(Sint32 pIndex);
+	static void Run(void *pTask);
+	static void Drop(void *pTask);
+public:
+	ImageLoader( void ) : next(1), callback((Callback)0), user((void*)0)	{}
+	~ImageLoader( void );
+public:
+	Sint32 Submit(const std::string &pFile, Image &pTarget, Sint32 pPriority=0, bool pPremultiply=false);
+	bool SetPriority(Sint32 pTicket, Sint32 pPriority);
+	bool Cancel(Sint32 pTicket);
+	State GetState(Sint32 pTicket) const;
+	bool Wait(Sint32 pTicket);
+	Sint32 Poll( void );
+	Sint32 GetCount( void ) const						{ return (Sint32)this->tasks.size(); }
+	void SetCallback(Callback pFunc, void *pUser=(void*)0)	{ this->callback = pFunc; this->user = pUser; }
+};
+
+//
+// GfxScreen
+// Image that wraps the SDL video surface, so it can be used
+// as a render target without an extra copy. Lock before
+// drawing (this also picks up the current surface memory and
+// pitch), Unlock when done, and present with GfxFlip(). The
+// memory belongs to SDL, so Create fails and Free only
+// releases the surface memory from the image.
+//
+class GfxScreen : public Image
+{
+public:
+	GfxScreen( void );
+	~GfxScreen( void );
+public:
+	void Free( void );
+	bool Create(Sint32 pWidth, Sint32 pHeight);
+	bool Lock( void );
+	void Unlock( void );
+};
+
 //
 // Screen functions
 //
 bool GfxSetVideo(Uint32 pScreenW, Uint32 pScreenH, bool pFullscreen);
 bool GfxFlip(const Image &pSrc);
+bool GfxFlip( void );
+bool GfxFlipDamage(Image &pSrc);
 inline Sint32 GfxWidth( void ) { return SDL_GetVideoSurface()->w; }
 inline Sint32 GfxHeight( void ) { return SDL_GetVideoSurface()->h; }
 inline Color32 *GfxPixels( void ) { return (Color32*)SDL_GetVideoSurface()->pixels; }
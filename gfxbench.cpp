@@ -0,0 +1,622 @@
+//
+// gfxbench.cpp
+// Headless benchmark and regression check for the rendering
+// kernels. Build it together with gfx.cpp, e.g.
+//   g++ -O2 gfxbench.cpp gfx.cpp -lSDL -lpthread -o gfxbench
+// and run
+//   gfxbench [-threads N] [-sizes 256,1024] [-time MS] [-filter TEXT]
+//            [-out FILE] [-golden FILE] [-check FILE]
+// Every case writes one CSV line (case,size,mpixels,hash,check)
+// where mpixels is millions of destination pixels per second
+// and hash is a hash of the destination after a single run
+// from a fixed starting image. check compares that run with a
+// scalar reference (the per-pixel blender and sampler
+// interfaces, so SIMD paths and fast paths are validated
+// against them; Convert and Resolve against a per-pixel
+// decode and box average) and with the hashes of a golden
+// file made by -golden: ok, FAIL, or - when there is nothing
+// to compare.
+// The exit code is 1 if any case fails.
+//
+// Copyright (c) Jonathan Karlsson 2010
+// Code may be used freely for commercial and non-commercial purposes.
+// Author retains his moral rights under the applicable copyright laws
+// (i.e. credit the author where credit is due).
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <sstream>
+
+#include "gfx.h"
+
+//
+// Random
+// Small deterministic generator, so images and hashes are the
+// same on every platform.
+//
+static Uint32 randomState = 1;
+
+static Uint32 Random( void )
+{
+	randomState = randomState * 1664525 + 1013904223;
+	return randomState ^ (randomState >> 16);
+}
+
+static void RandomFill(Image &pImage, Uint32 pSeed)
+{
+	randomState = pSeed;
+	for (Sint32 y = 0; y < pImage.GetHeight(); ++y){
+		for (Sint32 x = 0; x < pImage.GetWidth(); ++x){
+			Color32 c;
+			c.value = Random();
+			if ((x/16 + y/16) % 4 == 0) { c.channels.alpha = 0; } // blocks of fully transparent and fully opaque pixels
+			if ((x/16 + y/16) % 4 == 1) { c.channels.alpha = UCHAR_MAX; }
+			pImage[y][x] = c;
+		}
+	}
+}
+
+//
+// Hash
+// FNV-1a over the pixels, without row padding.
+//
+static Uint32 Hash(const Image &pImage)
+{
+	Uint32 hash = 2166136261u;
+	for (Sint32 y = 0; y < pImage.GetHeight(); ++y){
+		const Uint8 *row = (const Uint8*)pImage[y];
+		for (Sint32 i = 0; i < pImage.GetWidth()*(Sint32)sizeof(Color32); ++i){
+			hash = (hash ^ row[i]) * 16777619u;
+		}
+	}
+	return hash;
+}
+
+static bool Equal(const Image &pA, const Image &pB)
+{
+	if (pA.GetWidth() != pB.GetWidth() || pA.GetHeight() != pB.GetHeight()) { return false; }
+	for (Sint32 y = 0; y < pA.GetHeight(); ++y){
+		if (memcmp((const void*)pA[y], (const void*)pB[y], pA.GetWidth()*sizeof(Color32)) != 0) { return false; }
+	}
+	return true;
+}
+
+//
+// ScalarBlend
+// Reference blender: operator() once per pixel, which skips
+// the span kernels and the Assign fast paths.
+//
+template < typename Blender_t >
+class ScalarBlend : public Blender_t
+{
+public:
+	ScalarBlend(const Blender_t &pBlend) : Blender_t(pBlend) {}
+	void Blend(Color32 *pDst, const Color32 *pSrc, Sint32 pCount) const
+	{
+		for (Sint32 i = 0; i < pCount; ++i){
+			pDst[i] = (*this)(pDst[i], pSrc[i]);
+		}
+	}
+};
+
+//
+// ScalarSample
+// Reference sampler: Sample once per pixel.
+//
+template < typename Sampler_t >
+class ScalarSample : public Sampler_t
+{
+public:
+	ScalarSample(const Sampler_t &pSample) : Sampler_t(pSample) {}
+	void Span(const Image &pImage, Uint32 pU, Uint32 pV, Sint32 pDu, Sint32 pDv, Color32 *pOut, Sint32 pCount) const
+	{
+		Sampler::Span(pImage, pU, pV, pDu, pDv, pOut, pCount);
+	}
+};
+
+//
+// Images
+// Shared source images of one size.
+//
+struct Images
+{
+	Sint32 size;
+	Image background; // starting destination, size x size
+	Image source; // 2*size square, with mips
+	std::string file; // source saved for the stream cases
+	std::string bitmap; // source saved as a 24-bit BMP for Convert
+};
+
+//
+// Case
+// One benchmark. Run draws into pDst, Reference draws the
+// same with the scalar interfaces and returns false when
+// there is none. Pixels is the destination pixels per Run.
+//
+class Case
+{
+public:
+	std::string name;
+	const Images *images;
+public:
+	Case(const std::string &pName) : name(pName), images((const Images*)0) {}
+	virtual ~Case( void ) {}
+	virtual bool Prepare(const Images &pImages)		{ images = &pImages; return true; }
+	virtual void Release( void )					{}
+	virtual void Run(Image &pDst) = 0;
+	virtual bool Reference(Image&)					{ return false; }
+	virtual Sint64 Pixels( void ) const				{ return (Sint64)images->size*images->size; }
+};
+
+//
+// FillCase
+// Fills the whole destination.
+//
+template < typename Blender_t >
+class FillCase : public Case
+{
+private:
+	Blender_t blend;
+public:
+	FillCase(const std::string &pName, const Blender_t &pBlend) : Case(pName), blend(pBlend) {}
+	void Run(Image &pDst)			{ pDst.Fill(0, 0, images->size, images->size, Color32(10, 200, 30, 128), blend); }
+	bool Reference(Image &pDst)
+	{
+		const ScalarBlend<Blender_t> scalar(blend);
+		pDst.Fill(0, 0, images->size, images->size, Color32(10, 200, 30, 128), scalar);
+		return true;
+	}
+};
+
+//
+// LineCase
+// Draws a fixed set of lines across the destination.
+//
+template < typename Blender_t, bool Antialias >
+class LineCase : public Case
+{
+private:
+	Blender_t blend;
+	std::vector<Image::Point> points;
+	Sint64 pixels;
+public:
+	LineCase(const std::string &pName, const Blender_t &pBlend) : Case(pName), blend(pBlend), pixels(0) {}
+	bool Prepare(const Images &pImages)
+	{
+		Case::Prepare(pImages);
+		randomState = 7;
+		points.resize(512);
+		pixels = 0;
+		for (size_t i = 0; i < points.size(); ++i){
+			points[i].x = (Sint32)(Random() % (Uint32)(pImages.size + 64)) - 32;
+			points[i].y = (Sint32)(Random() % (Uint32)(pImages.size + 64)) - 32;
+			if (i % 2 == 1) {
+				const Sint32 DX = abs(points[i].x - points[i-1].x), DY = abs(points[i].y - points[i-1].y);
+				pixels += (DX > DY ? DX : DY) + 1;
+			}
+		}
+		return true;
+	}
+	void Run(Image &pDst)
+	{
+		for (size_t i = 0; i+1 < points.size(); i+=2){
+			if (Antialias) {
+				pDst.LineAA(points[i].x, points[i].y, Color32(255, 0, 0, 200), points[i+1].x, points[i+1].y, Color32(0, 0, 255, 100), blend);
+			} else {
+				pDst.Line(points[i].x, points[i].y, Color32(255, 0, 0, 200), points[i+1].x, points[i+1].y, Color32(0, 0, 255, 100), blend);
+			}
+		}
+	}
+	Sint64 Pixels( void ) const		{ return pixels; }
+};
+
+//
+// BlitCase
+// Blits a source square scaled by scale/4 onto the whole
+// destination.
+//
+template < typename Blender_t, typename Sampler_t >
+class BlitCase : public Case
+{
+private:
+	Blender_t blend;
+	Sampler_t sample;
+	Sint32 scale; // in quarters
+	bool reference;
+public:
+	BlitCase(const std::string &pName, const Blender_t &pBlend, const Sampler_t &pSample, Sint32 pScale, bool pReference) : Case(pName), blend(pBlend), sample(pSample), scale(pScale), reference(pReference) {}
+	Sint32 SourceSize( void ) const	{ return images->size*4 / scale; }
+	void Run(Image &pDst)			{ Image::Blit(pDst, 0, 0, images->size, images->size, images->source, blend, sample, 0, 0, SourceSize(), SourceSize()); }
+	bool Reference(Image &pDst)
+	{
+		if (!reference) { return false; }
+		const ScalarBlend<Blender_t> scalarBlend(blend);
+		const ScalarSample<Sampler_t> scalarSample(sample);
+		Image::Blit(pDst, 0, 0, images->size, images->size, images->source, scalarBlend, scalarSample, 0, 0, SourceSize(), SourceSize());
+		return true;
+	}
+};
+
+//
+// StreamCase
+// Blits the saved source through an Image::Stream, with the
+// stream cache hot or trimmed before every run (cold).
+//
+template < typename Blender_t >
+class StreamCase : public Case
+{
+private:
+	Blender_t blend;
+	Sint32 scale; // in quarters
+	bool cold;
+	Image::Stream stream;
+public:
+	StreamCase(const std::string &pName, const Blender_t &pBlend, Sint32 pScale, bool pCold) : Case(pName), blend(pBlend), scale(pScale), cold(pCold) {}
+	bool Prepare(const Images &pImages)
+	{
+		Case::Prepare(pImages);
+		return stream.Load(pImages.file);
+	}
+	void Release( void )			{ stream.Free(); }
+	Sint32 SourceSize( void ) const	{ return images->size*4 / scale; }
+	void Run(Image &pDst)
+	{
+		if (cold) { GfxTrimStreamCache(); }
+		Image::Blit(pDst, 0, 0, images->size, images->size, stream, blend, 0, 0, SourceSize(), SourceSize());
+	}
+	bool Reference(Image &pDst)
+	{
+		const ScalarBlend<Blender_t> scalarBlend(blend);
+		const ScalarSample<Nearest> scalarSample((Nearest()));
+		Image::Blit(pDst, 0, 0, images->size, images->size, images->source, scalarBlend, scalarSample, 0, 0, SourceSize(), SourceSize());
+		return true;
+	}
+};
+
+//
+// ConvertCase
+// Loads and converts the 24-bit BMP of the source, so every
+// Run writes the pixels of the whole source.
+//
+class ConvertCase : public Case
+{
+public:
+	ConvertCase(const std::string &pName) : Case(pName) {}
+	bool Prepare(const Images &pImages)
+	{
+		Case::Prepare(pImages);
+		Image test;
+		return test.Convert(pImages.bitmap);
+	}
+	void Run(Image &pDst)			{ pDst.Convert(images->bitmap); }
+	bool Reference(Image &pDst)
+	{
+		// one SDL_GetRGBA per pixel, like ConvertGeneric
+		SDL_Surface *src = APIIMGLOAD(images->bitmap.c_str());
+		if (src == (SDL_Surface*)0) { return false; }
+		const Sint32 BYTES = src->format->BytesPerPixel;
+		const bool GOOD = pDst.Create(src->w, src->h);
+		for (Sint32 y = 0; GOOD && y < src->h; ++y){
+			const Uint8 *row = (const Uint8*)src->pixels + (Sint64)src->pitch*y;
+			Color32 *out = pDst[y];
+			for (Sint32 x = 0; x < src->w; ++x){
+				const Uint8 *spix = row + x*BYTES;
+				Uint32 value = 0;
+				switch (BYTES) {
+				case 1: value = *spix; break;
+				case 2: { Uint16 v; memcpy(&v, spix, sizeof(v)); value = v; } break;
+#if SDL_BYTEORDER == SDL_LIL_ENDIAN
+				case 3: value = spix[0] | (spix[1] << 8) | (spix[2] << 16); break;
+#else
+				case 3: value = (spix[0] << 16) | (spix[1] << 8) | spix[2]; break;
+#endif
+				default: memcpy(&value, spix, sizeof(value)); break;
+				}
+				SDL_GetRGBA(value, src->format, &out[x].channels.red, &out[x].channels.green, &out[x].channels.blue, &out[x].channels.alpha);
+			}
+		}
+		SDL_FreeSurface(src);
+		return GOOD;
+	}
+	Sint64 Pixels( void ) const		{ return (Sint64)images->source.GetWidth()*images->source.GetHeight(); }
+};
+
+//
+// ResolveCase
+// Box filters a source of factor times the destination size
+// into the destination.
+//
+class ResolveCase : public Case
+{
+private:
+	Sint32 factor;
+	Image source;
+public:
+	ResolveCase(const std::string &pName, Sint32 pFactor) : Case(pName), factor(pFactor) {}
+	bool Prepare(const Images &pImages)
+	{
+		Case::Prepare(pImages);
+		if (!source.Create(pImages.size*factor, pImages.size*factor)) { return false; } // may not fit for large sizes
+		RandomFill(source, 3);
+		return true;
+	}
+	void Release( void )			{ source.Free(); }
+	void Run(Image &pDst)			{ Image::Resolve(pDst, source, factor); }
+	bool Reference(Image &pDst)
+	{
+		// plain box average per pixel, truncated like Resolve
+		for (Sint32 y = 0; y < images->size; ++y){
+			Color32 *out = pDst[y];
+			for (Sint32 x = 0; x < images->size; ++x){
+				Sint32 sum[4] = { 0, 0, 0, 0 };
+				for (Sint32 y0 = 0; y0 < factor; ++y0){
+					const Color32 *in = source[y*factor + y0] + x*factor;
+					for (Sint32 x0 = 0; x0 < factor; ++x0){
+						sum[0] += in[x0].channels.red;
+						sum[1] += in[x0].channels.green;
+						sum[2] += in[x0].channels.blue;
+						sum[3] += in[x0].channels.alpha;
+					}
+				}
+				out[x] = Color32((Uint8)(sum[0] / (factor*factor)), (Uint8)(sum[1] / (factor*factor)), (Uint8)(sum[2] / (factor*factor)), (Uint8)(sum[3] / (factor*factor)));
+			}
+		}
+		return true;
+	}
+};
+
+//
+// FloatCase
+// Expands the destination into a float buffer, adds half of
+// the source and quantizes it back.
+//
+class FloatCase : public Case
+{
+private:
+	bool dither;
+	FloatImage buffer;
+public:
+	FloatCase(const std::string &pName, bool pDither) : Case(pName), dither(pDither) {}
+	void Release( void )			{ buffer.Free(); }
+	void Run(Image &pDst)
+	{
+		buffer.Expand(pDst);
+		FloatImage::Blit(buffer, 0, 0, images->source, 0.5f, true);
+		buffer.Quantize(pDst, dither);
+	}
+};
+
+//
+// SaveBitmap
+// Writes pImage as an uncompressed 24-bit BMP.
+//
+static bool SaveBitmap(const Image &pImage, const std::string &pFile)
+{
+	FILE *file = fopen(pFile.c_str(), "wb");
+	if (file == (FILE*)0) { return false; }
+	const Sint32 W = pImage.GetWidth(), H = pImage.GetHeight();
+	const Uint32 ROW = (Uint32)(W*3 + 3) & ~3u;
+	Uint8 header[54];
+	memset(header, 0, sizeof(header));
+	const Uint32 FIELDS[][2] = { {2, 54 + ROW*H}, {10, 54}, {14, 40}, {18, (Uint32)W}, {22, (Uint32)H}, {34, ROW*H} };
+	header[0] = 'B';
+	header[1] = 'M';
+	for (size_t i = 0; i < sizeof(FIELDS)/sizeof(FIELDS[0]); ++i){
+		for (Sint32 b = 0; b < 4; ++b){
+			header[FIELDS[i][0] + b] = (Uint8)(FIELDS[i][1] >> (b*8));
+		}
+	}
+	header[26] = 1; // planes
+	header[28] = 24; // bits per pixel
+	fwrite(header, 1, sizeof(header), file);
+	std::vector<Uint8> row(ROW, 0);
+	for (Sint32 y = H - 1; y >= 0; --y){ // bottom up
+		for (Sint32 x = 0; x < W; ++x){
+			const Color32 C = pImage[y][x];
+			row[x*3] = C.channels.blue;
+			row[x*3 + 1] = C.channels.green;
+			row[x*3 + 2] = C.channels.red;
+		}
+		fwrite(&row[0], 1, ROW, file);
+	}
+	return fclose(file) == 0;
+}
+
+//
+// Cases
+//
+template < typename Blender_t, typename Sampler_t >
+static void AddBlits(std::vector<Case*> &pCases, const std::string &pBlend, const Blender_t &pBlender, const std::string &pSample, const Sampler_t &pSampler, bool pReference)
+{
+	const Sint32 SCALES[] = { 2, 4, 6, 8, 12, 16 }; // 0.5x, 1x, 1.5x, 2x, 3x, 4x
+	const char *NAMES[] = { "0.5", "1", "1.5", "2", "3", "4" };
+	for (Sint32 i = 0; i < 6; ++i){
+		pCases.push_back(new BlitCase<Blender_t, Sampler_t>(std::string("blit/") + pBlend + "/" + pSample + "/" + NAMES[i], pBlender, pSampler, SCALES[i], pReference));
+	}
+}
+
+template < typename Blender_t >
+static void AddBlender(std::vector<Case*> &pCases, const std::string &pName, const Blender_t &pBlend)
+{
+	pCases.push_back(new FillCase<Blender_t>("fill/" + pName, pBlend));
+	pCases.push_back(new LineCase<Blender_t, false>("line/" + pName, pBlend));
+	AddBlits(pCases, pName, pBlend, "Nearest", Nearest(), true);
+	AddBlits(pCases, pName, pBlend, "Bilinear", Bilinear(), true);
+	AddBlits(pCases, pName, pBlend, "BilinearPremultiply", Bilinear(Bilinear::Premultiply), true);
+	AddBlits(pCases, pName, pBlend, "BilinearKeyed", Bilinear(Color32(0, 0, 0)), true);
+	AddBlits(pCases, pName, pBlend, "Box", Box(), false); // mip selection has no scalar counterpart
+	AddBlits(pCases, pName, pBlend, "Trilinear", Trilinear(), false);
+}
+
+static void AddCases(std::vector<Case*> &pCases)
+{
+	AddBlender(pCases, "Assign", Assign());
+	AddBlender(pCases, "AlphaBlend", AlphaBlend());
+	AddBlender(pCases, "ColorKey", ColorKey(Color32(0, 0, 0)));
+	AddBlender(pCases, "PremultipliedBlend", PremultipliedBlend());
+	AddBlender(pCases, "Grayscale", Grayscale());
+	AddBlender(pCases, "Additive", Additive());
+	AddBlender(pCases, "Multiply", Multiply());
+	AddBlender(pCases, "ScreenBlend", ScreenBlend());
+	AddBlender(pCases, "Compose", Compose<ColorKey, Modulate, AlphaBlend>(ColorKey(Color32(0, 0, 0)), Modulate(Color32(255, 192, 128, 160))));
+	pCases.push_back(new LineCase<AlphaBlend, true>("lineaa/AlphaBlend", AlphaBlend()));
+	pCases.push_back(new StreamCase<Assign>("stream/Assign/1", Assign(), 4, false));
+	pCases.push_back(new StreamCase<AlphaBlend>("stream/AlphaBlend/1", AlphaBlend(), 4, false));
+	pCases.push_back(new StreamCase<AlphaBlend>("stream/AlphaBlend/2", AlphaBlend(), 8, false));
+	pCases.push_back(new StreamCase<Assign>("stream-cold/Assign/1", Assign(), 4, true));
+	pCases.push_back(new ConvertCase("convert/bmp24"));
+	pCases.push_back(new ResolveCase("resolve/2", 2));
+	pCases.push_back(new ResolveCase("resolve/4", 4));
+	pCases.push_back(new FloatCase("float/accumulate", false));
+	pCases.push_back(new FloatCase("float/accumulate-dither", true));
+}
+
+//
+// Options
+//
+struct Options
+{
+	Uint32 threads;
+	std::vector<Sint32> sizes;
+	Uint32 time; // milliseconds per case
+	std::string filter, out, golden, check;
+};
+
+static bool ParseOptions(int argc, char **argv, Options &pOptions)
+{
+	pOptions.threads = 0;
+	pOptions.time = 100;
+	for (int i = 1; i < argc; ++i){
+		const std::string ARG = argv[i];
+		if (i + 1 >= argc) {
+			fprintf(stderr, "gfxbench: missing value for %s\n", ARG.c_str());
+			return false;
+		}
+		const std::string VALUE = argv[++i];
+		if (ARG == "-threads") { pOptions.threads = (Uint32)atoi(VALUE.c_str()); }
+		else if (ARG == "-time") { pOptions.time = (Uint32)atoi(VALUE.c_str()); }
+		else if (ARG == "-filter") { pOptions.filter = VALUE; }
+		else if (ARG == "-out") { pOptions.out = VALUE; }
+		else if (ARG == "-golden") { pOptions.golden = VALUE; }
+		else if (ARG == "-check") { pOptions.check = VALUE; }
+		else if (ARG == "-sizes") {
+			std::istringstream sin(VALUE);
+			std::string size;
+			while (std::getline(sin, size, ',')) {
+				if (atoi(size.c_str()) > 0) { pOptions.sizes.push_back(atoi(size.c_str())); }
+			}
+		} else {
+			fprintf(stderr, "gfxbench: unknown option %s\n", ARG.c_str());
+			return false;
+		}
+	}
+	if (pOptions.sizes.empty()) {
+		pOptions.sizes.push_back(256);
+		pOptions.sizes.push_back(1024);
+	}
+	return true;
+}
+
+static bool Prepare(Images &pImages, Sint32 pSize)
+{
+	pImages.size = pSize;
+	std::ostringstream sout;
+	sout << "gfxbench_" << pSize;
+	pImages.file = sout.str() + ".img";
+	pImages.bitmap = sout.str() + ".bmp";
+	if (!pImages.background.Create(pSize, pSize) || !pImages.source.Create(pSize*2, pSize*2)) { return false; }
+	RandomFill(pImages.background, 1);
+	RandomFill(pImages.source, 2);
+	return pImages.source.GenerateMips() && pImages.source.Save(pImages.file) && SaveBitmap(pImages.source, pImages.bitmap);
+}
+
+int main(int argc, char **argv)
+{
+	Options options;
+	if (!ParseOptions(argc, argv, options)) { return 2; }
+	if (!GfxInit(0, 0, false, 0, options.threads)) { // no SDL_INIT_VIDEO, headless
+		fprintf(stderr, "gfxbench: %s\n", SDL_GetError());
+		return 2;
+	}
+
+	std::map<std::string, Uint32> golden;
+	if (!options.check.empty()) {
+		FILE *file = fopen(options.check.c_str(), "r");
+		char key[256];
+		Uint32 hash;
+		while (file != (FILE*)0 && fscanf(file, "%255s %x", key, &hash) == 2) {
+			golden[key] = hash;
+		}
+		if (file == (FILE*)0) { fprintf(stderr, "gfxbench: could not read %s\n", options.check.c_str()); }
+		else { fclose(file); }
+	}
+	FILE *out = options.out.empty() ? stdout : fopen(options.out.c_str(), "w");
+	FILE *goldenOut = options.golden.empty() ? (FILE*)0 : fopen(options.golden.c_str(), "w");
+	if (out == (FILE*)0) { out = stdout; }
+	fprintf(out, "case,size,mpixels,hash,check\n");
+
+	std::vector<Case*> cases;
+	AddCases(cases);
+	bool failed = false;
+	for (size_t s = 0; s < options.sizes.size(); ++s){
+		Images images;
+		if (!Prepare(images, options.sizes[s])) {
+			fprintf(stderr, "gfxbench: could not prepare size %d: %s\n", options.sizes[s], SDL_GetError());
+			failed = true;
+			continue;
+		}
+		for (size_t c = 0; c < cases.size(); ++c){
+			Case &bench = *cases[c];
+			if (!options.filter.empty() && bench.name.find(options.filter) == std::string::npos) { continue; }
+			if (!bench.Prepare(images)) {
+				fprintf(out, "%s,%d,,,skipped\n", bench.name.c_str(), images.size);
+				continue;
+			}
+
+			// correctness: one run from the background
+			Image dst(images.background), reference(images.background);
+			bench.Run(dst);
+			const Uint32 HASH = Hash(dst);
+			std::string check = "-";
+			if (bench.Reference(reference)) {
+				check = Equal(dst, reference) ? "ok" : "FAIL";
+			}
+			std::ostringstream key;
+			key << bench.name << "@" << images.size;
+			if (golden.count(key.str()) != 0 && check != "FAIL") {
+				check = golden[key.str()] == HASH ? "ok" : "FAIL";
+			}
+			failed = failed || check == "FAIL";
+			if (goldenOut != (FILE*)0) { fprintf(goldenOut, "%s %08x\n", key.str().c_str(), HASH); }
+
+			// speed: repeat until options.time has passed
+			Uint32 runs = 0;
+			const Uint32 START = SDL_GetTicks();
+			Uint32 elapsed = 0;
+			do {
+				bench.Run(dst);
+				++runs;
+				elapsed = SDL_GetTicks() - START;
+			} while (elapsed < options.time);
+			const double MPIXELS = (double)bench.Pixels()*runs / ((double)(elapsed > 0 ? elapsed : 1)*1000.0);
+			fprintf(out, "%s,%d,%.1f,%08x,%s\n", bench.name.c_str(), images.size, MPIXELS, HASH, check.c_str());
+			fflush(out);
+		}
+		for (size_t c = 0; c < cases.size(); ++c){
+			cases[c]->Release();
+		}
+		remove(images.file.c_str());
+		remove(images.bitmap.c_str());
+	}
+
+	for (size_t c = 0; c < cases.size(); ++c){
+		delete cases[c];
+	}
+	if (out != stdout) { fclose(out); }
+	if (goldenOut != (FILE*)0) { fclose(goldenOut); }
+	GfxQuit();
+	return failed ? 1 : 0;
+}